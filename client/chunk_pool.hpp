@@ -0,0 +1,97 @@
+/***
+    This file is part of snapcast
+    Copyright (C) 2014-2019  Johannes Pohl
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#ifndef CHUNK_POOL_H
+#define CHUNK_POOL_H
+
+#ifndef ESP_PLATFORM
+#include "message/pcm_chunk.hpp"
+#else
+#include <message/pcm_chunk.hpp>
+#endif
+#include <atomic>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+
+/// Recycles PcmChunks, so that receiving audio doesn't allocate memory
+/**
+ * A chunk is handed out again as soon as the pool holds the only reference to it,
+ * i.e. when the stream and the player are done with it.
+ * Chunks may outlive the pool, they are freed with their last reference.
+ * Not thread safe: "get" must be called from a single thread.
+ */
+class ChunkPool
+{
+public:
+    ChunkPool() : next_(0)
+    {
+    }
+
+    /// Get a rewound chunk with a payload of "payloadSize" bytes
+    std::shared_ptr<msg::PcmChunk> get(uint32_t payloadSize)
+    {
+        for (size_t n = 0; n < entries_.size(); ++n)
+        {
+            Entry& entry = entries_[next_];
+            next_ = (next_ + 1) % entries_.size();
+            if (entry.chunk.use_count() == 1)
+            {
+                // synchronize with the release of the last foreign reference
+                std::atomic_thread_fence(std::memory_order_acquire);
+                return prepare(entry, payloadSize);
+            }
+        }
+        entries_.push_back({std::make_shared<msg::PcmChunk>(), nullptr, 0, 0});
+        return prepare(entries_.back(), payloadSize);
+    }
+
+private:
+    struct Entry
+    {
+        std::shared_ptr<msg::PcmChunk> chunk;
+        const char* payload;
+        uint32_t size;
+        uint32_t capacity;
+    };
+
+    std::shared_ptr<msg::PcmChunk> prepare(Entry& entry, uint32_t payloadSize)
+    {
+        msg::PcmChunk& chunk = *entry.chunk;
+        // a decoder has reallocated the payload to exactly payloadSize bytes
+        if ((chunk.payload != entry.payload) || (chunk.payloadSize != entry.size))
+            entry.capacity = chunk.payloadSize;
+        if (entry.capacity < payloadSize)
+        {
+            chunk.payload = (char*)realloc(chunk.payload, payloadSize);
+            entry.capacity = payloadSize;
+        }
+        entry.payload = chunk.payload;
+        entry.size = payloadSize;
+        chunk.payloadSize = payloadSize;
+        chunk.rewind();
+        return entry.chunk;
+    }
+
+    std::vector<Entry> entries_;
+    size_t next_;
+};
+
+
+#endif
@@ -35,8 +35,8 @@ using namespace std;
 
 
 ClientConnection::ClientConnection(MessageReceiver* receiver, const std::string& host, size_t port)
-    : socket_(io_context_), active_(false), messageReceiver_(receiver), reqId_(1), host_(host), port_(port), readerThread_(nullptr),
-      sumTimeout_(chronos::msec(0))
+    : socket_(io_context_), active_(false), protocolVersion_(msg::protocol_v2), messageReceiver_(receiver), reqId_(1), host_(host), port_(port),
+      readerThread_(nullptr), sumTimeout_(chronos::msec(0))
 {
 }
 
@@ -93,6 +93,7 @@ void ClientConnection::start()
     LOG(DEBUG) << "Connected!!!\n";
     SLOG(NOTICE) << "Connected to " << socket_.remote_endpoint().address().to_string() << endl;
     active_ = true;
+    protocolVersion_ = msg::protocol_v2;
     sumTimeout_ = chronos::msec(0);
     #ifdef ESP32
     xTaskCreate(reader_function, "reader", 8192, this, 5, &reader_task_);
@@ -145,31 +146,28 @@ bool ClientConnection::send(const msg::BaseMessage* message)
     if (!socket_.is_open())
         return false;
     // LOG(DEBUG) << "send: " << message->type << ", size: " << message->getSize() << "\n";
-    ASIO_NS::streambuf streambuf;
-    std::ostream stream(&streambuf);
     tv t;
     message->sent = t;
-    message->serialize(stream);
-    ASIO_NS::write(socket_, streambuf);
+    ASIO_NS::write(socket_, ASIO_NS::buffer(message->serialize(protocolVersion_)));
     return true;
 }
 
 
-shared_ptr<msg::SerializedMessage> ClientConnection::sendRequest(const msg::BaseMessage* message, const chronos::msec& timeout)
+bool ClientConnection::sendRequest(const msg::BaseMessage* message, msg::BaseMessage* response, const chronos::msec& timeout)
 {
-    shared_ptr<msg::SerializedMessage> response(nullptr);
+    bool received(false);
     if (++reqId_ >= 10000)
         reqId_ = 1;
     message->id = reqId_;
     //	LOG(INFO) << "Req: " << message->id << "\n";
-    shared_ptr<PendingRequest> pendingRequest(new PendingRequest(reqId_));
+    shared_ptr<PendingRequest> pendingRequest(new PendingRequest(reqId_, response));
 
     std::unique_lock<std::mutex> lock(pendingRequestsMutex_);
     pendingRequests_.insert(pendingRequest);
     send(message);
-    if (pendingRequest->cv.wait_for(lock, std::chrono::milliseconds(timeout)) == std::cv_status::no_timeout)
+    if (pendingRequest->cv.wait_for(lock, std::chrono::milliseconds(timeout), [&pendingRequest] { return pendingRequest->received; }))
     {
-        response = pendingRequest->response;
+        received = true;
         sumTimeout_ = chronos::msec(0);
         //		LOG(INFO) << "Resp: " << pendingRequest->id << "\n";
     }
@@ -181,24 +179,55 @@ shared_ptr<msg::SerializedMessage> ClientConnection::sendRequest(const msg::Base
             throw SnapException("sum timeout exceeded 10s");
     }
     pendingRequests_.erase(pendingRequest);
-    return response;
+    return received;
 }
 
 
 void ClientConnection::getNextMessage()
 {
     msg::BaseMessage baseMessage;
-    size_t baseMsgSize = baseMessage.getSize();
-    vector<char> buffer(baseMsgSize);
-    socketRead(&buffer[0], baseMsgSize);
-    baseMessage.deserialize(&buffer[0]);
+    socketRead(header_.data(), msg::BaseMessage::min_header_size);
+    size_t headerSize = msg::BaseMessage::headerSize(header_.data());
+    if (headerSize > msg::BaseMessage::min_header_size)
+        socketRead(header_.data() + msg::BaseMessage::min_header_size, headerSize - msg::BaseMessage::min_header_size);
+    baseMessage.deserialize(header_.data());
+    // The server sends v3 headers only to clients that announced v3 in the Hello message. Once we got one, the server understands v3, too.
+    if (baseMessage.version > protocolVersion_)
+        protocolVersion_ = baseMessage.version;
     //	LOG(DEBUG) << "getNextMessage: " << baseMessage.type << ", size: " << baseMessage.size << ", id: " << baseMessage.id << ", refers: " <<
     // baseMessage.refersTo << "\n";
-    if (baseMessage.size > buffer.size())
-        buffer.resize(baseMessage.size);
+    if (baseMessage.size > msg::max_size)
+        throw SnapException("message too large: " + cpt::to_string(baseMessage.size));
+
+    // read audio chunks straight into a pooled chunk
+    static constexpr size_t chunk_header_size = sizeof(tv) + sizeof(uint32_t);
+    if ((baseMessage.type == message_type::kWireChunk) && (baseMessage.size >= chunk_header_size) && (messageReceiver_ != nullptr))
+    {
+        std::array<char, chunk_header_size> chunkHeader;
+        socketRead(chunkHeader.data(), chunkHeader.size());
+        tv timestamp;
+        uint32_t payloadSize;
+        msg::BufferReader reader(chunkHeader.data(), chunkHeader.data() + chunkHeader.size(), baseMessage.version);
+        reader.read(timestamp);
+        reader.read(payloadSize);
+        if (payloadSize != baseMessage.size - chunk_header_size)
+            throw SnapException("invalid chunk size: " + cpt::to_string(payloadSize));
+
+        auto chunk = chunkPool_.get(payloadSize);
+        chunk->deserialize(header_.data());
+        chunk->timestamp = timestamp;
+        socketRead(chunk->payload, payloadSize);
+        tv t;
+        chunk->received = t;
+        messageReceiver_->onChunkReceived(this, std::move(chunk));
+        return;
+    }
+
+    if (baseMessage.size > buffer_.size())
+        buffer_.resize(baseMessage.size);
     //	{
     //		std::lock_guard<std::mutex> socketLock(socketMutex_);
-    socketRead(&buffer[0], baseMessage.size);
+    socketRead(buffer_.data(), baseMessage.size);
     //	}
     tv t;
     baseMessage.received = t;
@@ -212,10 +241,8 @@ void ClientConnection::getNextMessage()
             {
                 if (req->id == baseMessage.refersTo)
                 {
-                    req->response.reset(new msg::SerializedMessage());
-                    req->response->message = baseMessage;
-                    req->response->buffer = (char*)malloc(baseMessage.size);
-                    memcpy(req->response->buffer, &buffer[0], baseMessage.size);
+                    req->response->deserialize(baseMessage, buffer_.data());
+                    req->received = true;
                     lock.unlock();
                     req->cv.notify_one();
                     return;
@@ -225,7 +252,7 @@ void ClientConnection::getNextMessage()
     }
 
     if (messageReceiver_ != nullptr)
-        messageReceiver_->onMessageReceived(this, baseMessage, &buffer[0]);
+        messageReceiver_->onMessageReceived(this, baseMessage, buffer_.data());
 }
 
 
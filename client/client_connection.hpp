@@ -24,7 +24,9 @@
 #else
 #include <time_defs.hpp>
 #endif
+#include "chunk_pool.hpp"
 #include "message/message.hpp"
+#include <array>
 #include <atomic>
 #ifndef ESP_PLATFORM
 #include <boost/asio.hpp>
@@ -55,10 +57,12 @@ class ClientConnection;
 /// Used to synchronize server requests (wait for server response)
 struct PendingRequest
 {
-    PendingRequest(uint16_t reqId) : id(reqId), response(nullptr){};
+    PendingRequest(uint16_t reqId, msg::BaseMessage* response) : id(reqId), response(response), received(false){};
 
     uint16_t id;
-    std::shared_ptr<msg::SerializedMessage> response;
+    /// The reader thread deserializes the response into this message
+    msg::BaseMessage* response;
+    bool received;
     std::condition_variable cv;
 };
 
@@ -73,6 +77,8 @@ class MessageReceiver
 public:
     virtual ~MessageReceiver() = default;
     virtual void onMessageReceived(ClientConnection* connection, const msg::BaseMessage& baseMessage, char* buffer) = 0;
+    /// Audio chunks are read straight into a pooled chunk, that is handed over to the receiver
+    virtual void onChunkReceived(ClientConnection* connection, std::shared_ptr<msg::PcmChunk> chunk) = 0;
     virtual void onException(ClientConnection* connection, shared_exception_ptr exception) = 0;
 };
 
@@ -93,23 +99,27 @@ public:
     virtual void stop();
     virtual bool send(const msg::BaseMessage* message);
 
-    /// Send request to the server and wait for answer
-    virtual std::shared_ptr<msg::SerializedMessage> sendRequest(const msg::BaseMessage* message, const chronos::msec& timeout = chronos::msec(1000));
+    /// Send request to the server and wait for the answer, which is deserialized into "response"
+    virtual bool sendRequest(const msg::BaseMessage* message, msg::BaseMessage* response, const chronos::msec& timeout = chronos::msec(1000));
 
     /// Send request to the server and wait for answer of type T
     template <typename T>
     std::shared_ptr<T> sendReq(const msg::BaseMessage* message, const chronos::msec& timeout = chronos::msec(1000))
     {
-        std::shared_ptr<msg::SerializedMessage> reply = sendRequest(message, timeout);
-        if (!reply)
-            return nullptr;
         std::shared_ptr<T> msg(new T);
-        msg->deserialize(reply->message, reply->buffer);
+        if (!sendRequest(message, msg.get(), timeout))
+            return nullptr;
         return msg;
     }
 
     std::string getMacAddress();
 
+    /// Protocol version used for sending, v3 if the server is known to understand it
+    int getProtocolVersion() const
+    {
+        return protocolVersion_;
+    }
+
     virtual bool active() const
     {
         return active_;
@@ -121,10 +131,17 @@ protected:
     void socketRead(void* to, size_t bytes);
     void getNextMessage();
 
+    /// Receive buffers, reused for every message
+    std::array<char, msg::BaseMessage::header_size> header_;
+    std::vector<char> buffer_;
+    ChunkPool chunkPool_;
+
     ASIO_NS::io_context io_context_;
     mutable std::mutex socketMutex_;
     tcp::socket socket_;
     std::atomic<bool> active_;
+    /// Protocol version used for sending, switched to v3 when the server sends v3
+    std::atomic<int> protocolVersion_;
     MessageReceiver* messageReceiver_;
     mutable std::mutex pendingRequestsMutex_;
     std::set<std::shared_ptr<PendingRequest>> pendingRequests_;
@@ -0,0 +1,73 @@
+/***
+    This file is part of snapcast
+    Copyright (C) 2014-2019  Johannes Pohl
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include "clock_servo.hpp"
+#include <algorithm>
+#include <cmath>
+
+
+/// Natural frequency of the loop [rad/s], settles within ~20s
+static constexpr double omega = 0.25;
+/// Critically damped: Kp = 2 * omega, Ki = omega^2
+static constexpr double kp = 2. * omega;
+static constexpr double ki = omega * omega;
+/// Time constant of the phase error filter [s], well below the loop's 1 / omega
+static constexpr double filter_tau = 0.5;
+/// Max. rate correction, 1000ppm is about 1.7 cents
+static constexpr double max_correction = 0.001;
+
+
+constexpr size_t ClockServo::hard_correction_window;
+constexpr long ClockServo::hard_correction_threshold_us;
+constexpr long ClockServo::hard_correction_step_us;
+
+
+ClockServo::ClockServo() : initialized_(false), error_(0.), integral_(0.), correction_(0.)
+{
+}
+
+
+void ClockServo::reset()
+{
+    initialized_ = false;
+    error_ = 0.;
+    correction_ = integral_;
+}
+
+
+double ClockServo::update(double error, double dt)
+{
+    error /= 1000000.;
+    if (!initialized_)
+    {
+        error_ = error;
+        initialized_ = true;
+    }
+    else
+    {
+        error_ += (error - error_) * std::min(dt / filter_tau, 1.);
+    }
+
+    double correction = kp * error_ + integral_;
+    // anti windup: integrate only while the output is not saturated, or if it drives it out of saturation
+    if ((std::abs(correction) < max_correction) || ((correction > 0) != (error_ > 0)))
+        integral_ = std::max(-max_correction, std::min(max_correction, integral_ + ki * error_ * dt));
+
+    correction_ = std::max(-max_correction, std::min(max_correction, kp * error_ + integral_));
+    return 1. + correction_;
+}
@@ -0,0 +1,79 @@
+/***
+    This file is part of snapcast
+    Copyright (C) 2014-2019  Johannes Pohl
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#ifndef CLOCK_SERVO_H
+#define CLOCK_SERVO_H
+
+#include <cmath>
+#include <cstddef>
+
+/// PI controller that turns the playback phase error into a continuous rate correction
+/**
+ * The phase error (age of the played chunk) is low pass filtered and fed into a
+ * critically damped PI loop. The proportional part removes the phase error,
+ * the integral part converges to the frequency offset between the DAC and the
+ * server clock. The correction is limited to max_ppm, small enough to be inaudible.
+ * update() depends only on its arguments and the internal state, so recorded
+ * traces can be replayed deterministically.
+ * Gross phase errors are not servoed, but corrected with a hard jump that is
+ * slewed by hard_correction_step_us per period.
+ */
+class ClockServo
+{
+public:
+    /// Number of periods whose median phase error is checked by needsHardCorrection
+    static constexpr size_t hard_correction_window = 20;
+    /// Median phase error that triggers a hard correction [us]
+    static constexpr long hard_correction_threshold_us = 5000;
+    /// Max. correction of the phase per period while doing a hard correction [us]
+    static constexpr long hard_correction_step_us = 100;
+
+    ClockServo();
+
+    /// True if the phase error is corrected with a hard jump of errors.median() instead of the servo
+    /// @param errors phase errors [us] of the last hard_correction_window periods, e.g. a DoubleBuffer
+    template <typename Buffer>
+    static bool needsHardCorrection(const Buffer& errors)
+    {
+        return errors.full() && (std::abs(static_cast<double>(errors.median())) > hard_correction_threshold_us);
+    }
+
+    /// Forget the filtered phase error, e.g. after a hard resync. The frequency estimate is kept
+    void reset();
+
+    /// Feed the phase error "error" [us] (> 0: playing late) measured after "dt" [s] of playback
+    /// @return input frames to be read per played frame
+    double update(double error, double dt);
+
+    /// Current rate correction [ppm]
+    double ppm() const
+    {
+        return correction_ * 1000000.;
+    }
+
+private:
+    bool initialized_;
+    /// Low pass filtered phase error [s]
+    double error_;
+    /// Integral part, i.e. the estimated frequency offset
+    double integral_;
+    double correction_;
+};
+
+
+#endif
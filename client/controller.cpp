@@ -19,6 +19,7 @@
 #include "controller.hpp"
 #include "decoder/pcm_decoder.hpp"
 #include <iostream>
+#include <limits>
 #include <memory>
 #include <string>
 #if defined(HAS_OGG) && (defined(HAS_TREMOR) || defined(HAS_VORBIS))
@@ -37,8 +38,12 @@
 #include <aixlog.hpp>
 #include <snap_exception.hpp>
 #endif
+#include "message/client_info.hpp"
 #include "message/hello.hpp"
 #include "message/time.hpp"
+#ifndef ESP_PLATFORM
+#include "realtime.hpp"
+#endif
 #include "time_provider.hpp"
 
 using namespace std;
@@ -52,8 +57,10 @@ std::unique_ptr<T> make_unique(Args&&... args) {
 #endif
 
 Controller::Controller(const std::string& hostId, size_t instance, std::shared_ptr<MetadataAdapter> meta)
-    : MessageReceiver(), hostId_(hostId), instance_(instance), active_(false), latency_(0), stream_(nullptr), decoder_(nullptr), player_(nullptr), meta_(meta),
-      serverSettings_(nullptr), async_exception_(nullptr)
+    : MessageReceiver(), hostId_(hostId), instance_(instance), active_(false), latency_(0), syncMode_(SyncMode::threshold), fastStart_(false), multicast_(false),
+      stream_(nullptr), decoder_(nullptr), player_(nullptr), meta_(meta), serverSettings_(nullptr), codecGeneration_(0),
+      awaitCodecHeader_(false), xruns_(0), playerXruns_(0), minBufferMs_(std::numeric_limits<int>::max()), multicastChunks_(0),
+      async_exception_(nullptr)
 {
 }
 
@@ -65,39 +72,97 @@ void Controller::onException(ClientConnection* /*connection*/, shared_exception_
 }
 
 
-void Controller::onMessageReceived(ClientConnection* /*connection*/, const msg::BaseMessage& baseMessage, char* buffer)
+void Controller::onChunkReceived(ClientConnection* connection, std::shared_ptr<msg::PcmChunk> chunk)
 {
-    std::lock_guard<std::mutex> lock(receiveMutex_);
-    if (baseMessage.type == message_type::kWireChunk)
+    if ((connection == nullptr) && awaitCodecHeader_)
+        return;
+    if (connection == nullptr)
+        ++multicastChunks_;
+
+    // the network threads must not block: if the decoder can't keep up, drop the oldest chunk
+    DecodeJob dropped;
+    if ((decodeQueue_.size() >= max_decode_queue) && decodeQueue_.try_pop(dropped, std::chrono::microseconds(0)))
+        LOG(WARNING) << "Decoder queue full, dropping chunk\n";
+    decodeQueue_.push(DecodeJob{std::move(chunk), codecGeneration_.load()});
+
+    if (sendTimeSyncMessage())
+        LOG(DEBUG) << "time sync onChunkReceived\n";
+}
+
+
+void Controller::decoderWorker()
+{
+    DecodeJob job;
+    // per stage latency: time in the queue, time to decode
+    chronos::usec maxQueued(0), sumQueued(0), maxDecode(0), sumDecode(0);
+    size_t decoded(0);
+    long lastReport = chronos::getTickCount();
+    while (active_)
     {
-        if (stream_ && decoder_)
+        if (!decodeQueue_.try_pop(job, std::chrono::milliseconds(100)))
+            continue;
+
+        std::lock_guard<std::mutex> lock(receiveMutex_);
+        // the chunk belongs to a previous stream
+        if (!stream_ || !decoder_ || (job.generation != codecGeneration_))
+            continue;
+
+        auto start = chronos::clk::now();
+        job.chunk->format = sampleFormat_;
+        // LOG(DEBUG) << "chunk: " << job.chunk->payloadSize << ", sampleFormat: " << sampleFormat_.rate << "\n";
+        if (decoder_->decode(job.chunk.get()))
+            stream_->addChunk(*job.chunk);
+        auto end = chronos::clk::now();
+
+        auto queued = std::chrono::duration_cast<chronos::usec>(start - TimeProvider::toTimePoint(job.chunk->received));
+        auto decode = std::chrono::duration_cast<chronos::usec>(end - start);
+        // time left until the chunk is played out, reported to the server as buffer health
+        auto playout = TimeProvider::toTimePoint(job.chunk->timestamp) + chronos::msec(serverSettings_->getBufferMs());
+        auto buffer = std::chrono::duration_cast<chronos::msec>(playout - end - TimeProvider::getInstance().getDiffToServer<chronos::usec>());
+        int bufferMs = static_cast<int>(buffer.count());
+        int minBufferMs = minBufferMs_;
+        while ((bufferMs < minBufferMs) && !minBufferMs_.compare_exchange_weak(minBufferMs, bufferMs))
+            ;
+        job.chunk.reset();
+        maxQueued = std::max(maxQueued, queued);
+        sumQueued += queued;
+        maxDecode = std::max(maxDecode, decode);
+        sumDecode += decode;
+        ++decoded;
+
+        long now = chronos::getTickCount();
+        if (now - lastReport >= 10000)
         {
-            auto* pcmChunk = new msg::PcmChunk(sampleFormat_, 0);
-            pcmChunk->deserialize(baseMessage, buffer);
-            // LOG(DEBUG) << "chunk: " << pcmChunk->payloadSize << ", sampleFormat: " << sampleFormat_.rate << "\n";
-            if (decoder_->decode(pcmChunk))
-            {
-                // TODO: do decoding in thread?
-                stream_->addChunk(pcmChunk);
-                // LOG(DEBUG) << ", decoded: " << pcmChunk->payloadSize << ", Duration: " << pcmChunk->getDuration() << ", sec: " << pcmChunk->timestamp.sec <<
-                // ", usec: " << pcmChunk->timestamp.usec/1000 << ", type: " << pcmChunk->type << "\n";
-            }
-            else
-                delete pcmChunk;
+            LOG(INFO) << "Decoder - chunks: " << decoded << ", queued avg/max [ms]: " << sumQueued.count() / decoded / 1000. << "/" << maxQueued.count() / 1000.
+                      << ", decode avg/max [ms]: " << sumDecode.count() / decoded / 1000. << "/" << maxDecode.count() / 1000. << "\n";
+            maxQueued = sumQueued = maxDecode = sumDecode = chronos::usec(0);
+            decoded = 0;
+            lastReport = now;
         }
     }
-    else if (baseMessage.type == message_type::kTime)
+}
+
+
+void Controller::onMessageReceived(ClientConnection* /*connection*/, const msg::BaseMessage& baseMessage, char* buffer)
+{
+    // time replies are not serialized with the decoder, so decoding doesn't delay them
+    if (baseMessage.type == message_type::kTime)
     {
         msg::Time reply;
         reply.deserialize(baseMessage, buffer);
         TimeProvider::getInstance().setDiff(reply.latency, reply.received - reply.sent); // ToServer(diff / 2);
+        return;
     }
-    else if (baseMessage.type == message_type::kServerSettings)
+
+    std::lock_guard<std::mutex> lock(receiveMutex_);
+    if (baseMessage.type == message_type::kServerSettings)
     {
         serverSettings_.reset(new msg::ServerSettings());
         serverSettings_->deserialize(baseMessage, buffer);
         LOG(INFO) << "ServerSettings - buffer: " << serverSettings_->getBufferMs() << ", latency: " << serverSettings_->getLatency()
                   << ", volume: " << serverSettings_->getVolume() << ", muted: " << serverSettings_->isMuted() << "\n";
+        if (multicastReceiver_->setGroup(serverSettings_->getMulticastAddress(), serverSettings_->getMulticastPort()))
+            awaitCodecHeader_ = true;
         if (stream_ && player_)
         {
             player_->setVolume(serverSettings_->getVolume() / 100.);
@@ -109,6 +174,8 @@ void Controller::onMessageReceived(ClientConnection* /*connection*/, const msg::
     {
         headerChunk_.reset(new msg::CodecHeader());
         headerChunk_->deserialize(baseMessage, buffer);
+        awaitCodecHeader_ = false;
+        ++codecGeneration_;
 
         LOG(INFO) << "Codec: " << headerChunk_->codec << "\n";
         decoder_.reset(nullptr);
@@ -135,11 +202,13 @@ void Controller::onMessageReceived(ClientConnection* /*connection*/, const msg::
         sampleFormat_ = decoder_->setHeader(headerChunk_.get());
         LOG(NOTICE) << TAG("state") << "sampleformat: " << sampleFormat_.rate << ":" << sampleFormat_.bits << ":" << sampleFormat_.channels << "\n";
 
-        stream_ = make_shared<Stream>(sampleFormat_);
+        stream_ = make_shared<Stream>(sampleFormat_, serverSettings_->getBufferMs());
         stream_->setBufferLen(serverSettings_->getBufferMs() - latency_);
+        stream_->setSyncMode(syncMode_);
+        stream_->setFastStart(fastStart_);
 
 #ifdef HAS_ALSA
-        player_ = make_unique<AlsaPlayer>(pcmDevice_, stream_);
+        player_ = make_unique<AlsaPlayer>(pcmDevice_, stream_, playerSettings_);
 #elif HAS_OPENSL
         player_ = make_unique<OpenslPlayer>(pcmDevice_, stream_);
 #elif HAS_COREAUDIO
@@ -152,6 +221,7 @@ void Controller::onMessageReceived(ClientConnection* /*connection*/, const msg::
         player_->setVolume(serverSettings_->getVolume() / 100.);
         player_->setMute(serverSettings_->isMuted());
         player_->start();
+        playerXruns_ = 0;
     }
     else if (baseMessage.type == message_type::kStreamTags)
     {
@@ -162,17 +232,16 @@ void Controller::onMessageReceived(ClientConnection* /*connection*/, const msg::
             meta_->push(streamTags_->msg);
     }
 
-    if (baseMessage.type != message_type::kTime)
-        if (sendTimeSyncMessage(1000))
-            LOG(DEBUG) << "time sync onMessageReceived\n";
+    if (sendTimeSyncMessage())
+        LOG(DEBUG) << "time sync onMessageReceived\n";
 }
 
 
-bool Controller::sendTimeSyncMessage(long after)
+bool Controller::sendTimeSyncMessage()
 {
     static long lastTimeSync(0);
     long now = chronos::getTickCount();
-    if (lastTimeSync + after > now)
+    if (lastTimeSync + TimeProvider::getInstance().getSyncInterval().count() > now)
         return false;
 
     lastTimeSync = now;
@@ -186,18 +255,54 @@ void controller_task(void *pv){
     Controller *param = (Controller*)pv;
     param->worker();
 }
+
+void decoder_task(void *pv){
+    Controller *param = (Controller*)pv;
+    param->decoderWorker();
+}
 #endif
 
 
+void Controller::setSyncMode(SyncMode mode)
+{
+    syncMode_ = mode;
+}
+
+
+void Controller::setPlayerSettings(const PlayerSettings& settings)
+{
+    playerSettings_ = settings;
+}
+
+
+void Controller::setFastStart(bool fastStart)
+{
+    fastStart_ = fastStart;
+}
+
+
+void Controller::setMulticast(bool multicast)
+{
+    multicast_ = multicast;
+}
+
+
 void Controller::start(const PcmDevice& pcmDevice, const std::string& host, size_t port, int latency)
 {
     pcmDevice_ = pcmDevice;
     latency_ = latency;
     clientConnection_.reset(new ClientConnection(this, host, port));
+    multicastReceiver_.reset(new MulticastReceiver(this));
+    active_ = true;
     #ifdef ESP_PLATFORM
     xTaskCreate(controller_task, "controller", 8192, this, 5, &controllerTask_ );
+    xTaskCreate(decoder_task, "decoder", 8192, this, 5, &decoderTask_ );
     #else
     controllerThread_ = thread(&Controller::worker, this);
+    decoderThread_ = thread([this] {
+        realtime::setCurrentThread("decoder", playerSettings_.rtDecoder ? std::max(playerSettings_.rtPriority - 1, 1) : 0, playerSettings_.cpu);
+        decoderWorker();
+    });
     #endif
 }
 
@@ -208,8 +313,76 @@ void Controller::stop()
     active_ = false;
     #ifndef ESP_PLATFORM
     controllerThread_.join();
+    decoderThread_.join();
     #endif
     clientConnection_->stop();
+    multicastReceiver_->stop();
+}
+
+
+void Controller::initialTimeSync()
+{
+    // the replies are passed to the TimeProvider by onMessageReceived, it keeps the sample with the lowest round trip time.
+    // After a reconnect the server might be a different one
+    TimeProvider::getInstance().reset();
+    long start = chronos::getTickCount();
+    for (size_t burst = 0; (burst < max_sync_bursts) && active_ && !TimeProvider::getInstance().isConverged(); ++burst)
+    {
+        for (size_t n = 0; n < sync_burst_size; ++n)
+        {
+            msg::Time timeReq;
+            clientConnection_->send(&timeReq);
+            // spread the requests a little, so they are not queued behind each other
+            chronos::usleep(500);
+        }
+
+        long burstStart = chronos::getTickCount();
+        while (active_ && !TimeProvider::getInstance().isConverged() && (chronos::getTickCount() - burstStart < sync_burst_timeout_ms))
+        {
+            if (async_exception_)
+            {
+                LOG(DEBUG) << "Async exception: " << async_exception_->what() << "\n";
+                throw SnapException(async_exception_->what());
+            }
+            chronos::usleep(1000);
+        }
+    }
+    LOG(INFO) << "Initial time sync " << (TimeProvider::getInstance().isConverged() ? "converged" : "timed out") << " after "
+              << chronos::getTickCount() - start << " ms\n";
+}
+
+
+void Controller::reportClientInfo()
+{
+    {
+        std::lock_guard<std::mutex> lock(receiveMutex_);
+        if (!player_)
+            return;
+        uint32_t xruns = player_->getXruns();
+        if (xruns != playerXruns_)
+        {
+            xruns_ += xruns - playerXruns_;
+            playerXruns_ = xruns;
+            LOG(WARNING) << "Xruns: " << xruns_ << "\n";
+        }
+    }
+
+    int bufferMs = minBufferMs_.exchange(std::numeric_limits<int>::max());
+    if (bufferMs == std::numeric_limits<int>::max())
+        bufferMs = -1;
+
+    if (clientConnection_->getProtocolVersion() >= msg::protocol_v3)
+    {
+        auto rtt = TimeProvider::getInstance().getRtt();
+        msg::ClientInfo info;
+        info.setXruns(xruns_);
+        info.setBufferMs(bufferMs);
+        info.setRtt((rtt.count() < 0) ? -1 : static_cast<int>(rtt.count() / 1000));
+        // lets the server fall back to TCP, if the multicast chunks don't arrive
+        if (multicast_)
+            info.setMulticastChunks(multicastChunks_.exchange(0));
+        clientConnection_->send(&info);
+    }
 }
 
 
@@ -221,6 +394,7 @@ void Controller::worker()
     {
         try
         {
+            xruns_ = 0;
             clientConnection_->start();
 
             string macAddress = clientConnection_->getMacAddress();
@@ -229,25 +403,22 @@ void Controller::worker()
 
             /// Say hello to the server
             msg::Hello hello(macAddress, hostId_, instance_);
+            hello.setMulticast(multicast_);
+            std::vector<std::string> codecs{"pcm"};
+#if defined(HAS_OGG) && (defined(HAS_TREMOR) || defined(HAS_VORBIS))
+            codecs.push_back("ogg");
+#endif
+#if defined(HAS_FLAC)
+            codecs.push_back("flac");
+#endif
+#if defined(HAS_OPUS)
+            codecs.push_back("opus");
+#endif
+            hello.setCodecs(codecs);
             clientConnection_->send(&hello);
 
             /// Do initial time sync with the server
-            msg::Time timeReq;
-            for (size_t n = 0; n < 50 && active_; ++n)
-            {
-                if (async_exception_)
-                {
-                    LOG(DEBUG) << "Async exception: " << async_exception_->what() << "\n";
-                    throw SnapException(async_exception_->what());
-                }
-
-                shared_ptr<msg::Time> reply = clientConnection_->sendReq<msg::Time>(&timeReq, chronos::msec(2000));
-                if (reply)
-                {
-                    TimeProvider::getInstance().setDiff(reply->latency, reply->received - reply->sent);
-                    chronos::usleep(100);
-                }
-            }
+            initialTimeSync();
             LOG(INFO) << "diff to server [ms]: " << (float)TimeProvider::getInstance().getDiffToServer<chronos::usec>().count() / 1000.f << "\n";
 
             /// Main loop
@@ -264,8 +435,9 @@ void Controller::worker()
                     }
                 }
 
-                if (sendTimeSyncMessage(5000))
+                if (sendTimeSyncMessage())
                     LOG(DEBUG) << "time sync main loop\n";
+                reportClientInfo();
             }
         }
         catch (const std::exception& e)
@@ -273,9 +445,18 @@ void Controller::worker()
             async_exception_ = nullptr;
             SLOG(ERROR) << "Exception in Controller::worker(): " << e.what() << endl;
             clientConnection_->stop();
-            player_.reset();
-            stream_.reset();
-            decoder_.reset();
+            multicastReceiver_->setGroup("", 0);
+            {
+                // the decoder thread uses them with the lock held, pending chunks belong to the old connection
+                std::lock_guard<std::mutex> lock(receiveMutex_);
+                ++codecGeneration_;
+                DecodeJob job;
+                while (decodeQueue_.try_pop(job, std::chrono::microseconds(0)))
+                    ;
+                player_.reset();
+                stream_.reset();
+                decoder_.reset();
+            }
             for (size_t n = 0; (n < 10) && active_; ++n)
                 chronos::sleep(100);
         }
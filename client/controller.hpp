@@ -19,6 +19,11 @@
 #ifndef CONTROLLER_H
 #define CONTROLLER_H
 
+#ifndef ESP_PLATFORM
+#include "common/snap_queue.h"
+#else
+#include <snap_queue.h>
+#endif
 #include "decoder/decoder.hpp"
 #include "message/message.hpp"
 #include "message/server_settings.hpp"
@@ -37,6 +42,7 @@
 #endif
 #include "client_connection.hpp"
 #include "metadata.hpp"
+#include "multicast_receiver.hpp"
 #include "stream.hpp"
 
 #ifdef ESP_PLATFORM
@@ -55,31 +61,68 @@ class Controller : public MessageReceiver
 public:
     Controller(const std::string& clientId, size_t instance, std::shared_ptr<MetadataAdapter> meta);
     void start(const PcmDevice& pcmDevice, const std::string& host, size_t port, int latency);
+    /// Must be called before start
+    void setSyncMode(SyncMode mode);
+    /// Must be called before start
+    void setPlayerSettings(const PlayerSettings& settings);
+    /// Must be called before start, see Stream::setFastStart
+    void setFastStart(bool fastStart);
+    /// Must be called before start. Ask the server for the audio via multicast
+    void setMulticast(bool multicast);
     void stop();
 
     /// Implementation of MessageReceiver.
-    /// ClientConnection passes messages from the server through these callbacks
+    /// ClientConnection passes messages from the server through these callbacks,
+    /// "connection" is nullptr for chunks received by the MulticastReceiver
     void onMessageReceived(ClientConnection* connection, const msg::BaseMessage& baseMessage, char* buffer) override;
+    void onChunkReceived(ClientConnection* connection, std::shared_ptr<msg::PcmChunk> chunk) override;
 
     /// Implementation of MessageReceiver.
     /// Used for async exception reporting
     void onException(ClientConnection* connection, shared_exception_ptr exception) override;
     void worker();
+    /// Decodes the received chunks and feeds them to the stream
+    void decoderWorker();
 
 private:
-    bool sendTimeSyncMessage(long after = 1000);
+    /// Chunk to be decoded, "generation" identifies the codec header it belongs to
+    struct DecodeJob
+    {
+        std::shared_ptr<msg::PcmChunk> chunk;
+        size_t generation;
+    };
+
+    /// Max. number of chunks waiting for the decoder
+    static constexpr size_t max_decode_queue = 50;
+    /// Initial time sync: requests per burst, max. number of bursts and time to wait for the replies of a burst
+    static constexpr size_t sync_burst_size = 16;
+    static constexpr size_t max_sync_bursts = 5;
+    static constexpr long sync_burst_timeout_ms = 500;
+
+    /// Send a time sync request, if the TimeProvider's sync interval has passed
+    bool sendTimeSyncMessage();
+    /// Send bursts of time sync requests without waiting for the replies, until the TimeProvider's estimate has converged
+    void initialTimeSync();
+    /// Log new xruns of the player and report them to the server, together with the buffer health and the round trip time
+    void reportClientInfo();
     std::string hostId_;
     std::string meta_callback_;
     size_t instance_;
     std::atomic<bool> active_;
     #ifdef ESP_PLATFORM
     TaskHandle_t controllerTask_;
-    #else    
+    TaskHandle_t decoderTask_;
+    #else
     std::thread controllerThread_;
+    std::thread decoderThread_;
     #endif
     SampleFormat sampleFormat_;
     PcmDevice pcmDevice_;
     int latency_;
+    SyncMode syncMode_;
+    bool fastStart_;
+    bool multicast_;
+    PlayerSettings playerSettings_;
     std::unique_ptr<ClientConnection> clientConnection_;
     std::shared_ptr<Stream> stream_;
     std::unique_ptr<decoder::Decoder> decoder_;
@@ -88,7 +131,22 @@ private:
     std::shared_ptr<msg::ServerSettings> serverSettings_;
     std::shared_ptr<msg::StreamTags> streamTags_;
     std::shared_ptr<msg::CodecHeader> headerChunk_;
+    /// Serializes the decoder thread and the handling of the server's messages
     std::mutex receiveMutex_;
+    Queue<DecodeJob> decodeQueue_;
+    /// Incremented for every codec header
+    std::atomic<size_t> codecGeneration_;
+    std::unique_ptr<MulticastReceiver> multicastReceiver_;
+    /// Multicast group has changed, drop multicast chunks until the codec header of the new stream arrived
+    std::atomic<bool> awaitCodecHeader_;
+    /// Xruns of the current connection, the player is recreated for every codec header and counts from 0
+    uint32_t xruns_;
+    /// Xruns of the current player that are already included in xruns_
+    uint32_t playerXruns_;
+    /// Min. time between decoding and playout of a chunk since the last report [ms], max() if no chunk has been decoded
+    std::atomic<int> minBufferMs_;
+    /// Chunks received from the multicast group since the last report
+    std::atomic<int> multicastChunks_;
 
     shared_exception_ptr async_exception_;
 };
@@ -21,12 +21,15 @@
 
 #include <algorithm>
 #include <deque>
+#include <vector>
 
 
 /// Size limited queue
 /**
  * Size limited queue with basic statistic functions:
  * median, mean, percentile
+ * A sorted copy of the elements is maintained on add, so that median and
+ * percentile are simple lookups instead of sorting the whole buffer per call.
  */
 template <class T>
 class DoubleBuffer
@@ -34,41 +37,39 @@ class DoubleBuffer
 public:
     DoubleBuffer(size_t size = 10) : bufferSize(size)
     {
+        sorted.reserve(size + 1);
     }
 
+    /// Binary search for the insert position, the windows are small enough
+    /// (<= 500 elements) that shifting the sorted vector is cheaper than a tree or heap
     inline void add(const T& element)
     {
         buffer.push_back(element);
-        if (buffer.size() > bufferSize)
-            buffer.pop_front();
-    }
-
-    inline void add(T&& element)
-    {
-        buffer.push_back(std::move(element));
-        if (buffer.size() > bufferSize)
+        sorted.insert(std::upper_bound(sorted.begin(), sorted.end(), element), element);
+        while (buffer.size() > bufferSize)
+        {
+            sorted.erase(std::lower_bound(sorted.begin(), sorted.end(), buffer.front()));
             buffer.pop_front();
+        }
     }
 
     /// Median as mean over N values around the median
     T median(unsigned int mean = 1) const
     {
-        if (buffer.empty())
+        if (sorted.empty())
             return 0;
-        std::deque<T> tmpBuffer(buffer.begin(), buffer.end());
-        std::sort(tmpBuffer.begin(), tmpBuffer.end());
-        if ((mean <= 1) || (tmpBuffer.size() < mean))
-            return tmpBuffer[tmpBuffer.size() / 2];
+        if ((mean <= 1) || (sorted.size() < mean))
+            return sorted[sorted.size() / 2];
         else
         {
-            unsigned int low = tmpBuffer.size() / 2;
+            unsigned int low = sorted.size() / 2;
             unsigned int high = low;
             low -= mean / 2;
             high += mean / 2;
             T result((T)0);
             for (unsigned int i = low; i <= high; ++i)
             {
-                result += tmpBuffer[i];
+                result += sorted[i];
             }
             return result / mean;
         }
@@ -86,11 +87,10 @@ public:
 
     T percentile(unsigned int percentile) const
     {
-        if (buffer.empty())
+        if (sorted.empty())
             return 0;
-        std::deque<T> tmpBuffer(buffer.begin(), buffer.end());
-        std::sort(tmpBuffer.begin(), tmpBuffer.end());
-        return tmpBuffer[(size_t)(tmpBuffer.size() * ((float)percentile / (float)100))];
+        size_t idx = (size_t)(sorted.size() * ((float)percentile / (float)100));
+        return sorted[std::min(idx, sorted.size() - 1)];
     }
 
     inline bool full() const
@@ -101,6 +101,7 @@ public:
     inline void clear()
     {
         buffer.clear();
+        sorted.clear();
     }
 
     inline size_t size() const
@@ -116,6 +117,7 @@ public:
     void setSize(size_t size)
     {
         bufferSize = size;
+        sorted.reserve(size + 1);
     }
 
     const std::deque<T>& getBuffer() const
@@ -126,6 +128,8 @@ public:
 private:
     size_t bufferSize;
     std::deque<T> buffer;
+    /// The elements of "buffer" in ascending order
+    std::vector<T> sorted;
 };
 
 
@@ -0,0 +1,148 @@
+/***
+    This file is part of snapcast
+    Copyright (C) 2014-2019  Johannes Pohl
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include "multicast_receiver.hpp"
+#ifndef ESP_PLATFORM
+#include "common/aixlog.hpp"
+#else
+#include <aixlog.hpp>
+#endif
+
+
+using namespace std;
+
+
+MulticastReceiver::MulticastReceiver(MessageReceiver* receiver)
+    : work_(ASIO_NS::make_work_guard(io_context_)), socket_(io_context_), buffer_(65536), messageReceiver_(receiver), port_(0), generation_(0)
+{
+    thread_ = thread([this] { io_context_.run(); });
+}
+
+
+MulticastReceiver::~MulticastReceiver()
+{
+    stop();
+}
+
+
+bool MulticastReceiver::setGroup(const std::string& address, uint16_t port)
+{
+    if ((address == address_) && (port == port_))
+        return false;
+
+    address_ = address;
+    port_ = port;
+    ASIO_NS::post(io_context_, [this, address, port] {
+        leave();
+        if (!address.empty())
+            join(address, port);
+    });
+    return true;
+}
+
+
+void MulticastReceiver::stop()
+{
+    work_.reset();
+    io_context_.stop();
+    if (thread_.joinable())
+        thread_.join();
+}
+
+
+void MulticastReceiver::join(const std::string& address, uint16_t port)
+{
+    try
+    {
+        auto group = ASIO_NS::ip::make_address(address);
+        udp::endpoint endpoint(group.is_v6() ? udp::v6() : udp::v4(), port);
+        socket_.open(endpoint.protocol());
+        socket_.set_option(udp::socket::reuse_address(true));
+        socket_.bind(endpoint);
+        socket_.set_option(ASIO_NS::ip::multicast::join_group(group));
+        decoder_.reset();
+        ++generation_;
+        LOG(INFO) << "Joined multicast group " << address << ", port: " << port << "\n";
+        receive();
+    }
+    catch (const std::exception& e)
+    {
+        LOG(ERROR) << "Error joining multicast group " << address << ", port: " << port << ": " << e.what() << "\n";
+        leave();
+    }
+}
+
+
+void MulticastReceiver::leave()
+{
+    if (!socket_.is_open())
+        return;
+    LOG(INFO) << "Leaving multicast group\n";
+#ifndef ESP_PLATFORM
+    boost::system::error_code ec;
+#else
+    asio::error_code ec;
+#endif
+    socket_.close(ec);
+}
+
+
+void MulticastReceiver::receive()
+{
+    socket_.async_receive_from(ASIO_NS::buffer(buffer_), sender_, [this, generation = generation_](const auto& ec, size_t length) {
+        if (generation != generation_)
+            return;
+        if (ec)
+        {
+            if (ec != ASIO_NS::error::operation_aborted)
+                LOG(ERROR) << "Error receiving multicast datagram: " << ec.message() << "\n";
+            return;
+        }
+
+        size_t lost = decoder_.lost();
+        decoder_.decode(buffer_.data(), length, [this](char* data, size_t size) {
+            msg::BaseMessage baseMessage;
+            if (size < msg::BaseMessage::min_header_size)
+                return;
+            size_t headerSize = msg::BaseMessage::headerSize(data);
+            if (size < headerSize)
+                return;
+            baseMessage.deserialize(data);
+            if ((baseMessage.type != message_type::kWireChunk) || (headerSize + baseMessage.size != size) || (baseMessage.size < sizeof(tv) + sizeof(uint32_t)))
+                return;
+            tv timestamp;
+            uint32_t payloadSize;
+            msg::BufferReader reader(data + headerSize, data + size, baseMessage.version);
+            reader.read(timestamp);
+            reader.read(payloadSize);
+            if (payloadSize != reader.left())
+                return;
+            auto chunk = chunkPool_.get(payloadSize);
+            chunk->deserialize(data);
+            chunk->timestamp = timestamp;
+            memcpy(chunk->payload, reader.skip(payloadSize), payloadSize);
+            tv t;
+            chunk->received = t;
+            if (messageReceiver_ != nullptr)
+                messageReceiver_->onChunkReceived(nullptr, std::move(chunk));
+        });
+        if (decoder_.lost() != lost)
+            LOG(INFO) << "Lost multicast datagrams: " << decoder_.lost() << ", recovered: " << decoder_.recovered() << "\n";
+        receive();
+    });
+}
@@ -0,0 +1,74 @@
+/***
+    This file is part of snapcast
+    Copyright (C) 2014-2019  Johannes Pohl
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#ifndef MULTICAST_RECEIVER_H
+#define MULTICAST_RECEIVER_H
+
+#ifndef ESP_PLATFORM
+#include "common/multicast.hpp"
+#else
+#include <multicast.hpp>
+#endif
+#include "client_connection.hpp"
+#include <string>
+#include <thread>
+#include <vector>
+
+
+using ASIO_NS::ip::udp;
+
+
+/// Receives the audio chunks of a stream from a multicast group
+/**
+ * Runs its own io_context thread. Datagrams are reordered and lost ones are
+ * recovered from the parity datagrams (see mcast::Decoder), the reassembled
+ * chunks are passed to the MessageReceiver with a nullptr connection.
+ */
+class MulticastReceiver
+{
+public:
+    MulticastReceiver(MessageReceiver* receiver);
+    ~MulticastReceiver();
+
+    /// Leave the current group and join "address":"port", an empty address just leaves the group
+    /// @return true if the group has changed
+    bool setGroup(const std::string& address, uint16_t port);
+    void stop();
+
+private:
+    void join(const std::string& address, uint16_t port);
+    void leave();
+    void receive();
+
+    ASIO_NS::io_context io_context_;
+    ASIO_NS::executor_work_guard<ASIO_NS::io_context::executor_type> work_;
+    udp::socket socket_;
+    udp::endpoint sender_;
+    std::vector<char> buffer_;
+    mcast::Decoder decoder_;
+    ChunkPool chunkPool_;
+    MessageReceiver* messageReceiver_;
+    std::string address_;
+    uint16_t port_;
+    /// Incremented on every join, handlers of a previous socket are ignored
+    size_t generation_;
+    std::thread thread_;
+};
+
+
+#endif
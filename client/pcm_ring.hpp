@@ -0,0 +1,193 @@
+/***
+    This file is part of snapcast
+    Copyright (C) 2014-2019  Johannes Pohl
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#ifndef PCM_RING_H
+#define PCM_RING_H
+
+#ifndef ESP_PLATFORM
+#include "common/sample_format.hpp"
+#include "common/time_defs.hpp"
+#else
+#include <sample_format.hpp>
+#include <time_defs.hpp>
+#endif
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+
+/// Preallocated lock free single producer, single consumer ring of PCM frames
+/**
+ * Each written block of frames (i.e. a decoded chunk) is stored as a segment together
+ * with the server time of its first frame, so the time of every frame is known.
+ * Frame positions are free running counters, capacities are rounded up to powers of two.
+ * "write" must only be called by the producer, all other methods only by the consumer.
+ * Neither of them locks or allocates, except for "waitForData" which must not be used
+ * in the audio callback.
+ */
+class PcmRing
+{
+public:
+    PcmRing(const SampleFormat& format, size_t capacityFrames, size_t maxSegments)
+        : format_(format), buffer_(roundUp(capacityFrames) * format.frameSize), segments_(roundUp(maxSegments)), writePos_(0), readPos_(0),
+          segmentWrite_(0), segmentRead_(0), waiting_(false)
+    {
+    }
+
+    /// Append "frames" frames, the first one is to be played at server time "start"
+    /// @return false if the ring is full, nothing is written then
+    bool write(const void* data, size_t frames, const chronos::time_point_clk& start)
+    {
+        if (frames == 0)
+            return true;
+        size_t writePos = writePos_.load(std::memory_order_relaxed);
+        size_t segmentWrite = segmentWrite_.load(std::memory_order_relaxed);
+        if ((writePos + frames - readPos_.load(std::memory_order_acquire) > capacity()) ||
+            (segmentWrite - segmentRead_.load(std::memory_order_acquire) >= segments_.size()))
+            return false;
+
+        size_t offset = writePos & (capacity() - 1);
+        size_t first = std::min(frames, capacity() - offset);
+        memcpy(buffer_.data() + offset * format_.frameSize, data, first * format_.frameSize);
+        memcpy(buffer_.data(), static_cast<const char*>(data) + first * format_.frameSize, (frames - first) * format_.frameSize);
+
+        Segment& segment = segments_[segmentWrite & (segments_.size() - 1)];
+        segment.begin = writePos;
+        segment.end = writePos + frames;
+        segment.start = start;
+        segmentWrite_.store(segmentWrite + 1, std::memory_order_release);
+        // sequentially consistent with "waiting_", so that a waiting consumer is always notified
+        writePos_.store(writePos + frames);
+
+        if (waiting_.load())
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            cv_.notify_one();
+        }
+        return true;
+    }
+
+    /// Number of frames that can be read
+    size_t available() const
+    {
+        return writePos_.load(std::memory_order_acquire) - readPos_.load(std::memory_order_relaxed);
+    }
+
+    /// Get the server time of the next frame to be read
+    /// @return false if the ring is empty
+    bool front(chronos::time_point_clk& start) const
+    {
+        if (available() == 0)
+            return false;
+
+        size_t readPos = readPos_.load(std::memory_order_relaxed);
+        size_t segmentRead = segmentRead_.load(std::memory_order_relaxed);
+        while (!contains(segments_[segmentRead & (segments_.size() - 1)], readPos))
+            ++segmentRead;
+        const Segment& segment = segments_[segmentRead & (segments_.size() - 1)];
+        start = segment.start + std::chrono::duration_cast<chronos::clk::duration>(chronos::nsec((chronos::nsec::rep)((readPos - segment.begin) / format_.nsRate())));
+        return true;
+    }
+
+    /// Read up to "frames" frames into "out", nullptr discards them
+    /// @return number of frames read
+    size_t read(void* out, size_t frames)
+    {
+        frames = std::min(frames, available());
+        size_t readPos = readPos_.load(std::memory_order_relaxed);
+        if (out != nullptr)
+        {
+            size_t offset = readPos & (capacity() - 1);
+            size_t first = std::min(frames, capacity() - offset);
+            memcpy(out, buffer_.data() + offset * format_.frameSize, first * format_.frameSize);
+            memcpy(static_cast<char*>(out) + first * format_.frameSize, buffer_.data(), (frames - first) * format_.frameSize);
+        }
+        readPos += frames;
+
+        // release the segments that have been read completely
+        size_t segmentRead = segmentRead_.load(std::memory_order_relaxed);
+        size_t segmentWrite = segmentWrite_.load(std::memory_order_acquire);
+        while ((segmentRead != segmentWrite) && !contains(segments_[segmentRead & (segments_.size() - 1)], readPos))
+            ++segmentRead;
+        segmentRead_.store(segmentRead, std::memory_order_release);
+        readPos_.store(readPos, std::memory_order_release);
+        return frames;
+    }
+
+    /// Discard all frames
+    void clear()
+    {
+        read(nullptr, available());
+    }
+
+    /// Wait up to "ms" for frames to become available
+    bool waitForData(size_t ms)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        waiting_ = true;
+        bool result = cv_.wait_for(lock, std::chrono::milliseconds(ms), [this] { return writePos_.load() != readPos_.load(std::memory_order_relaxed); });
+        waiting_ = false;
+        return result;
+    }
+
+    /// Capacity in frames
+    size_t capacity() const
+    {
+        return buffer_.size() / format_.frameSize;
+    }
+
+private:
+    /// Frames [begin, end) start playing at "start"
+    struct Segment
+    {
+        size_t begin;
+        size_t end;
+        chronos::time_point_clk start;
+    };
+
+    /// Position "pos" is within [begin, end), works across the wrap around of the counters
+    static bool contains(const Segment& segment, size_t pos)
+    {
+        return pos - segment.begin < segment.end - segment.begin;
+    }
+
+    static size_t roundUp(size_t value)
+    {
+        size_t result(1);
+        while (result < value)
+            result <<= 1;
+        return result;
+    }
+
+    SampleFormat format_;
+    std::vector<char> buffer_;
+    std::vector<Segment> segments_;
+    std::atomic<size_t> writePos_;
+    std::atomic<size_t> readPos_;
+    std::atomic<size_t> segmentWrite_;
+    std::atomic<size_t> segmentRead_;
+    std::atomic<bool> waiting_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+};
+
+
+#endif
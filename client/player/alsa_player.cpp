@@ -20,13 +20,15 @@
 #include "common/aixlog.hpp"
 #include "common/snap_exception.hpp"
 #include "common/str_compat.hpp"
+#include <time.h>
 
 //#define BUFFER_TIME 120000
 #define PERIOD_TIME 30000
 
 using namespace std;
 
-AlsaPlayer::AlsaPlayer(const PcmDevice& pcmDevice, std::shared_ptr<Stream> stream) : Player(pcmDevice, stream), handle_(nullptr), buff_(nullptr)
+AlsaPlayer::AlsaPlayer(const PcmDevice& pcmDevice, std::shared_ptr<Stream> stream, const PlayerSettings& settings)
+    : Player(pcmDevice, stream, settings), handle_(nullptr), buff_(nullptr), mmap_(false), monotonicTstamp_(false)
 {
 }
 
@@ -58,7 +60,15 @@ void AlsaPlayer::initAlsa()
         throw SnapException("Can't fill params: " + string(snd_strerror(pcm)));
 
     /* Set parameters */
-    if ((pcm = snd_pcm_hw_params_set_access(handle_, params, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0)
+    mmap_ = false;
+    if (settings_.mmap)
+    {
+        if ((pcm = snd_pcm_hw_params_set_access(handle_, params, SND_PCM_ACCESS_MMAP_INTERLEAVED)) < 0)
+            LOG(WARNING) << "Can't set mmap interleaved mode: " << snd_strerror(pcm) << ", falling back to read/write mode\n";
+        else
+            mmap_ = true;
+    }
+    if (!mmap_ && ((pcm = snd_pcm_hw_params_set_access(handle_, params, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0))
         throw SnapException("Can't set interleaved mode: " + string(snd_strerror(pcm)));
 
     snd_pcm_format_t snd_pcm_format;
@@ -109,11 +119,18 @@ void AlsaPlayer::initAlsa()
         throw SnapException("Can't set rate: " + string(snd_strerror(pcm)));
 
     unsigned int period_time;
-    snd_pcm_hw_params_get_period_time_max(params, &period_time, nullptr);
-    if (period_time > PERIOD_TIME)
-        period_time = PERIOD_TIME;
+    if (settings_.periodMs != 0)
+    {
+        period_time = settings_.periodMs * 1000;
+    }
+    else
+    {
+        snd_pcm_hw_params_get_period_time_max(params, &period_time, nullptr);
+        if (period_time > PERIOD_TIME)
+            period_time = PERIOD_TIME;
+    }
 
-    unsigned int buffer_time = 4 * period_time;
+    unsigned int buffer_time = (settings_.bufferMs != 0) ? settings_.bufferMs * 1000 : 4 * period_time;
 
     snd_pcm_hw_params_set_period_time_near(handle_, params, &period_time, nullptr);
     snd_pcm_hw_params_set_buffer_time_near(handle_, params, &buffer_time, nullptr);
@@ -137,13 +154,18 @@ void AlsaPlayer::initAlsa()
 
     /* Allocate buffer to hold single period */
     snd_pcm_hw_params_get_period_size(params, &frames_, nullptr);
-    LOG(INFO) << "frames: " << frames_ << "\n";
+    LOG(INFO) << "frames: " << frames_ << ", mmap: " << mmap_ << "\n";
 
-    buff_size = frames_ * format.frameSize; // channels * 2 /* 2 -> sample size */;
-    buff_ = (char*)malloc(buff_size);
+    if (!mmap_)
+    {
+        buff_size = frames_ * format.frameSize; // channels * 2 /* 2 -> sample size */;
+        buff_ = (char*)malloc(buff_size);
+    }
 
     snd_pcm_hw_params_get_period_time(params, &tmp, nullptr);
     LOG(DEBUG) << "period time: " << tmp << "\n";
+    snd_pcm_hw_params_get_buffer_time(params, &tmp, nullptr);
+    LOG(DEBUG) << "buffer time: " << tmp << "\n";
 
     snd_pcm_sw_params_t* swparams;
     snd_pcm_sw_params_alloca(&swparams);
@@ -152,6 +174,12 @@ void AlsaPlayer::initAlsa()
     snd_pcm_sw_params_set_avail_min(handle_, swparams, frames_);
     snd_pcm_sw_params_set_start_threshold(handle_, swparams, frames_);
     //	snd_pcm_sw_params_set_stop_threshold(pcm_handle, swparams, frames_);
+    // timestamp the status, so that the delay can be extrapolated to the time it's used
+    snd_pcm_sw_params_set_tstamp_mode(handle_, swparams, SND_PCM_TSTAMP_ENABLE);
+    monotonicTstamp_ = false;
+#if SND_LIB_VERSION >= 0x01001d
+    monotonicTstamp_ = (snd_pcm_sw_params_set_tstamp_type(handle_, swparams, SND_PCM_TSTAMP_TYPE_MONOTONIC) == 0);
+#endif
     snd_pcm_sw_params(handle_, swparams);
 }
 
@@ -193,10 +221,138 @@ void AlsaPlayer::stop()
 }
 
 
-void AlsaPlayer::worker()
+chronos::usec AlsaPlayer::getDelay()
 {
-    snd_pcm_sframes_t pcm;
+    snd_pcm_status_t* status;
+    snd_pcm_status_alloca(&status);
     snd_pcm_sframes_t framesDelay;
+    if (snd_pcm_status(handle_, status) < 0)
+    {
+        snd_pcm_delay(handle_, &framesDelay);
+        return chronos::usec((chronos::usec::rep)(1000 * (double)framesDelay / stream_->getFormat().msRate()));
+    }
+
+    framesDelay = snd_pcm_status_get_delay(status);
+    chronos::usec delay((chronos::usec::rep)(1000 * (double)framesDelay / stream_->getFormat().msRate()));
+    if (monotonicTstamp_ && (snd_pcm_status_get_state(status) == SND_PCM_STATE_RUNNING))
+    {
+        // the delay was valid at the status' timestamp, the DAC continued playing since then
+        snd_htimestamp_t tstamp;
+        snd_pcm_status_get_htstamp(status, &tstamp);
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        chronos::usec elapsed((now.tv_sec - tstamp.tv_sec) * 1000000 + (now.tv_nsec - tstamp.tv_nsec) / 1000);
+        if ((elapsed.count() > 0) && (elapsed < delay))
+            delay -= elapsed;
+    }
+    //		LOG(INFO) << "delay: " << framesDelay << ", delay[ms]: " << delay.count() / 1000 << "\n";
+    return delay;
+}
+
+
+void AlsaPlayer::recover(int err)
+{
+    if (err == -EPIPE)
+        LOG(ERROR) << "XRUN #" << ++xruns_ << "\n";
+    else
+        LOG(ERROR) << "PCM error: " << snd_strerror(err) << "\n";
+    if ((err = snd_pcm_recover(handle_, err, 1)) < 0)
+    {
+        LOG(ERROR) << "ERROR. Can't recover PCM device: " << snd_strerror(err) << "\n";
+        uninitAlsa();
+    }
+}
+
+
+int AlsaPlayer::waitAvail()
+{
+    // timeout after two periods
+    return snd_pcm_wait(handle_, (int)(2 * frames_ / stream_->getFormat().msRate()) + 1);
+}
+
+
+bool AlsaPlayer::writeRw()
+{
+    snd_pcm_sframes_t pcm;
+    if (!stream_->getPlayerChunk(buff_, getDelay(), frames_))
+        return false;
+
+    adjustVolume(buff_, frames_);
+    if ((pcm = snd_pcm_writei(handle_, buff_, frames_)) < 0)
+        recover(pcm);
+    return true;
+}
+
+
+bool AlsaPlayer::writeMmap()
+{
+    snd_pcm_sframes_t avail = snd_pcm_avail_update(handle_);
+    if (avail < 0)
+    {
+        recover(avail);
+        return true;
+    }
+
+    if (avail < (snd_pcm_sframes_t)frames_)
+    {
+        int err = waitAvail();
+        if (err < 0)
+            recover(err);
+        return true;
+    }
+
+    const snd_pcm_channel_area_t* areas;
+    snd_pcm_uframes_t offset;
+    snd_pcm_uframes_t frames = frames_;
+    int err = snd_pcm_mmap_begin(handle_, &areas, &offset, &frames);
+    if (err < 0)
+    {
+        recover(err);
+        return true;
+    }
+
+    // interleaved: all channels share the first area
+    char* buffer = static_cast<char*>(areas[0].addr) + (areas[0].first + offset * areas[0].step) / 8;
+    if (!stream_->getPlayerChunk(buffer, getDelay(), frames))
+    {
+        snd_pcm_mmap_commit(handle_, offset, 0);
+        return false;
+    }
+
+    adjustVolume(buffer, frames);
+    // a short commit is no error, the rest of the rendered frames is committed once the device accepts them
+    snd_pcm_uframes_t done = 0;
+    while (done < frames)
+    {
+        snd_pcm_sframes_t committed = snd_pcm_mmap_commit(handle_, offset + done, frames - done);
+        if (committed < 0)
+        {
+            recover(committed);
+            return true;
+        }
+        done += committed;
+        // unlike snd_pcm_writei, committing doesn't apply the start threshold
+        if (snd_pcm_state(handle_) == SND_PCM_STATE_PREPARED)
+            snd_pcm_start(handle_);
+        if (done == frames)
+            break;
+        if ((err = waitAvail()) < 0)
+        {
+            recover(err);
+            return true;
+        }
+        if (err == 0)
+        {
+            LOG(ERROR) << "Timeout committing " << frames - done << " frames\n";
+            return true;
+        }
+    }
+    return true;
+}
+
+
+void AlsaPlayer::worker()
+{
     long lastChunkTick = chronos::getTickCount();
 
     while (active_)
@@ -210,29 +366,15 @@ void AlsaPlayer::worker()
             catch (const std::exception& e)
             {
                 LOG(ERROR) << "Exception in initAlsa: " << e.what() << endl;
+                uninitAlsa();
                 chronos::sleep(100);
+                continue;
             }
         }
 
-        //		snd_pcm_avail_delay(handle_, &framesAvail, &framesDelay);
-        snd_pcm_delay(handle_, &framesDelay);
-        chronos::usec delay((chronos::usec::rep)(1000 * (double)framesDelay / stream_->getFormat().msRate()));
-        //		LOG(INFO) << "delay: " << framesDelay << ", delay[ms]: " << delay.count() / 1000 << "\n";
-
-        if (stream_->getPlayerChunk(buff_, delay, frames_))
+        if (mmap_ ? writeMmap() : writeRw())
         {
             lastChunkTick = chronos::getTickCount();
-            adjustVolume(buff_, frames_);
-            if ((pcm = snd_pcm_writei(handle_, buff_, frames_)) == -EPIPE)
-            {
-                LOG(ERROR) << "XRUN\n";
-                snd_pcm_prepare(handle_);
-            }
-            else if (pcm < 0)
-            {
-                LOG(ERROR) << "ERROR. Can't write to PCM device: " << snd_strerror(pcm) << "\n";
-                uninitAlsa();
-            }
         }
         else
         {
@@ -26,11 +26,13 @@
 /// Audio Player
 /**
  * Audio player implementation using Alsa
+ * In mmap mode the stream is rendered directly into the DMA buffer, the player
+ * polls the PCM until a period is free instead of blocking in snd_pcm_writei.
  */
 class AlsaPlayer : public Player
 {
 public:
-    AlsaPlayer(const PcmDevice& pcmDevice, std::shared_ptr<Stream> stream);
+    AlsaPlayer(const PcmDevice& pcmDevice, std::shared_ptr<Stream> stream, const PlayerSettings& settings = PlayerSettings());
     ~AlsaPlayer() override;
 
     /// Set audio volume in range [0..1]
@@ -46,10 +48,22 @@ protected:
 private:
     void initAlsa();
     void uninitAlsa();
+    /// Time until a frame written now is played, from the timestamped device status
+    chronos::usec getDelay();
+    /// Play a period, return false if no chunk is available
+    bool writeRw();
+    bool writeMmap();
+    void recover(int err);
+    /// Wait until a period is free (avail_min), return 1 if so, 0 on timeout or a negative error code
+    int waitAvail();
 
     snd_pcm_t* handle_;
     snd_pcm_uframes_t frames_;
     char* buff_;
+    /// Access mode is SND_PCM_ACCESS_MMAP_INTERLEAVED
+    bool mmap_;
+    /// Status timestamps are taken from CLOCK_MONOTONIC
+    bool monotonicTstamp_;
 };
 
 
@@ -16,8 +16,14 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 ***/
 
+#include <algorithm>
 #include <cmath>
 #include <iostream>
+#if !defined(IS_BIG_ENDIAN) && (defined(__SSE2__) || defined(__AVX2__))
+#include <immintrin.h>
+#elif !defined(IS_BIG_ENDIAN) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #ifndef ESP_PLATFORM
 #include "common/aixlog.hpp"
@@ -25,13 +31,16 @@
 #include <aixlog.hpp>
 #endif
 #include "player.hpp"
+#ifndef ESP_PLATFORM
+#include "realtime.hpp"
+#endif
 
 
 using namespace std;
 
 
-Player::Player(const PcmDevice& pcmDevice, std::shared_ptr<Stream> stream)
-    : active_(false), stream_(stream), pcmDevice_(pcmDevice), volume_(1.0), muted_(false), volCorrection_(1.0)
+Player::Player(const PcmDevice& pcmDevice, std::shared_ptr<Stream> stream, const PlayerSettings& settings)
+    : active_(false), xruns_(0), stream_(stream), settings_(settings), pcmDevice_(pcmDevice), volume_(1.0), muted_(false), volCorrection_(1.0), gain_(0.)
 {
 }
 
@@ -49,7 +58,10 @@ void Player::start()
     #ifdef ESP_PLATFORM
     xTaskCreate(player_function, "player", 8192, this, 5, &player_task_);
     #else
-    playerThread_ = thread(&Player::worker, this);
+    playerThread_ = thread([this] {
+        realtime::setCurrentThread("player", settings_.rtPriority, settings_.cpu);
+        worker();
+    });
     #endif
 }
 
@@ -73,24 +85,138 @@ void Player::stop()
 }
 
 
+/// A full scale gain change is ramped over 5ms
+static constexpr double ramp_ms = 5.;
+
+
+/// Scale "count" little endian samples by the Q15 gain "gain"
+static void scale(int8_t* samples, size_t count, int32_t gain)
+{
+    for (size_t n = 0; n < count; ++n)
+        samples[n] = static_cast<int8_t>((samples[n] * gain) >> 15);
+}
+
+
+static void scale(int16_t* samples, size_t count, int32_t gain)
+{
+    size_t n = 0;
+#if !defined(IS_BIG_ENDIAN) && defined(__AVX2__)
+    const __m256i g = _mm256_set1_epi16(static_cast<int16_t>(gain));
+    for (; n + 16 <= count; n += 16)
+    {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(samples + n));
+        __m256i lo = _mm256_mullo_epi16(x, g);
+        __m256i hi = _mm256_mulhi_epi16(x, g);
+        __m256i p0 = _mm256_srai_epi32(_mm256_unpacklo_epi16(lo, hi), 15);
+        __m256i p1 = _mm256_srai_epi32(_mm256_unpackhi_epi16(lo, hi), 15);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(samples + n), _mm256_packs_epi32(p0, p1));
+    }
+#elif !defined(IS_BIG_ENDIAN) && defined(__SSE2__)
+    const __m128i g = _mm_set1_epi16(static_cast<int16_t>(gain));
+    for (; n + 8 <= count; n += 8)
+    {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(samples + n));
+        __m128i lo = _mm_mullo_epi16(x, g);
+        __m128i hi = _mm_mulhi_epi16(x, g);
+        __m128i p0 = _mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), 15);
+        __m128i p1 = _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), 15);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(samples + n), _mm_packs_epi32(p0, p1));
+    }
+#elif !defined(IS_BIG_ENDIAN) && defined(__ARM_NEON)
+    const int16x8_t g = vdupq_n_s16(static_cast<int16_t>(gain));
+    for (; n + 8 <= count; n += 8)
+        vst1q_s16(samples + n, vqdmulhq_s16(vld1q_s16(samples + n), g));
+#endif
+    for (; n < count; ++n)
+        samples[n] = endian::swap<int16_t>(static_cast<int16_t>((endian::swap<int16_t>(samples[n]) * gain) >> 15));
+}
+
+
+#if !defined(IS_BIG_ENDIAN) && defined(__SSE2__)
+/// Signed products of the even 32 bit lanes of "x" and the positive "g" as 64 bit lanes
+static inline __m128i mul_even(__m128i x, __m128i g)
+{
+#ifdef __SSE4_1__
+    return _mm_mul_epi32(x, g);
+#else
+    // the unsigned product of a negative sample is too large by g * 2^32
+    return _mm_sub_epi64(_mm_mul_epu32(x, g), _mm_slli_epi64(_mm_and_si128(_mm_srai_epi32(x, 31), g), 32));
+#endif
+}
+#endif
+
+
+/// Also used for 24 bit samples in 32 bit containers
+static void scale(int32_t* samples, size_t count, int32_t gain)
+{
+    size_t n = 0;
+    // 32 x 16 bit fixed point: the low 32 bits of the 64 bit products >> 15 are the scaled samples, rounded like the scalar ">> 15"
+#if !defined(IS_BIG_ENDIAN) && defined(__AVX2__)
+    const __m256i g = _mm256_set1_epi32(gain);
+    const __m256i even = _mm256_set1_epi64x(0xffffffff);
+    for (; n + 8 <= count; n += 8)
+    {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(samples + n));
+        __m256i p0 = _mm256_srli_epi64(_mm256_mul_epi32(x, g), 15);
+        __m256i p1 = _mm256_srli_epi64(_mm256_mul_epi32(_mm256_srli_epi64(x, 32), g), 15);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(samples + n), _mm256_or_si256(_mm256_and_si256(p0, even), _mm256_slli_epi64(p1, 32)));
+    }
+#elif !defined(IS_BIG_ENDIAN) && defined(__SSE2__)
+    const __m128i g = _mm_set1_epi32(gain);
+    const __m128i even = _mm_set_epi32(0, -1, 0, -1);
+    for (; n + 4 <= count; n += 4)
+    {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(samples + n));
+        __m128i p0 = _mm_srli_epi64(mul_even(x, g), 15);
+        __m128i p1 = _mm_srli_epi64(mul_even(_mm_srli_epi64(x, 32), g), 15);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(samples + n), _mm_or_si128(_mm_and_si128(p0, even), _mm_slli_epi64(p1, 32)));
+    }
+#elif !defined(IS_BIG_ENDIAN) && defined(__ARM_NEON)
+    const int32x4_t g = vdupq_n_s32(gain << 16);
+    for (; n + 4 <= count; n += 4)
+        vst1q_s32(samples + n, vqdmulhq_s32(vld1q_s32(samples + n), g));
+#endif
+    for (; n < count; ++n)
+        samples[n] = endian::swap<int32_t>(static_cast<int32_t>((static_cast<int64_t>(endian::swap<int32_t>(samples[n])) * gain) >> 15));
+}
+
+
+static void scale(char* buffer, size_t count, double gain, uint16_t sampleSize)
+{
+    // volume is in [0..1], Q15 can't represent 1 but it's a no-op anyway. Gains just below 1 would round up to 32768, which
+    // doesn't fit the 16 bit multipliers
+    if (gain >= 1.)
+        return;
+    int32_t q15 = std::min(static_cast<int32_t>(std::max(gain, 0.) * 32768. + 0.5), 32767);
+    if (sampleSize == 1)
+        scale(reinterpret_cast<int8_t*>(buffer), count, q15);
+    else if (sampleSize == 2)
+        scale(reinterpret_cast<int16_t*>(buffer), count, q15);
+    else if (sampleSize == 4)
+        scale(reinterpret_cast<int32_t*>(buffer), count, q15);
+}
+
+
 void Player::adjustVolume(char* buffer, size_t frames)
 {
     double volume = volume_;
     if (muted_)
         volume = 0.;
+    volume *= volCorrection_;
 
     const SampleFormat& sampleFormat = stream_->getFormat();
 
-    if ((volume < 1.0) || (volCorrection_ != 1.))
+    // ramp frame by frame towards the new volume
+    double step = 1000. / (ramp_ms * sampleFormat.rate);
+    size_t frame = 0;
+    for (; (gain_ != volume) && (frame < frames); ++frame)
     {
-        volume *= volCorrection_;
-        if (sampleFormat.sampleSize == 1)
-            adjustVolume<int8_t>(buffer, frames * sampleFormat.channels, volume);
-        else if (sampleFormat.sampleSize == 2)
-            adjustVolume<int16_t>(buffer, frames * sampleFormat.channels, volume);
-        else if (sampleFormat.sampleSize == 4)
-            adjustVolume<int32_t>(buffer, frames * sampleFormat.channels, volume);
+        gain_ = (gain_ < volume) ? std::min(gain_ + step, volume) : std::max(gain_ - step, volume);
+        scale(buffer + frame * sampleFormat.frameSize, sampleFormat.channels, gain_, sampleFormat.sampleSize);
     }
+
+    if (frame < frames)
+        scale(buffer + frame * sampleFormat.frameSize, (frames - frame) * sampleFormat.channels, gain_, sampleFormat.sampleSize);
 }
 
 
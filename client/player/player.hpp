@@ -35,6 +35,27 @@
 #include <vector>
 
 
+/// Buffer configuration of the audio device and scheduling of the audio path
+struct PlayerSettings
+{
+    PlayerSettings() : periodMs(0), bufferMs(0), mmap(false), rtPriority(0), rtDecoder(false), cpu(-1)
+    {
+    }
+
+    /// Period and buffer size, 0: the player's default
+    size_t periodMs;
+    size_t bufferMs;
+    /// Render directly into the device's buffer, if supported
+    bool mmap;
+    /// SCHED_FIFO priority of the player thread, 0: normal scheduling
+    int rtPriority;
+    /// Run the decoder thread with SCHED_FIFO, too (one below the player)
+    bool rtDecoder;
+    /// CPU the audio threads are pinned to, -1: no affinity
+    int cpu;
+};
+
+
 /// Audio Player
 /**
  * Abstract audio player implementation
@@ -42,7 +63,7 @@
 class Player
 {
 public:
-    Player(const PcmDevice& pcmDevice, std::shared_ptr<Stream> stream);
+    Player(const PcmDevice& pcmDevice, std::shared_ptr<Stream> stream, const PlayerSettings& settings = PlayerSettings());
     virtual ~Player();
 
     /// Set audio volume in range [0..1]
@@ -52,23 +73,24 @@ public:
     virtual void stop();
     virtual void worker() = 0;
 
+    /// Number of buffer underruns of the audio device since the player has been started
+    uint32_t getXruns() const
+    {
+        return xruns_;
+    }
+
 protected:
 
     void setVolume_poly(double volume, double exp);
     void setVolume_exp(double volume, double base);
 
-    template <typename T>
-    void adjustVolume(char* buffer, size_t count, double volume)
-    {
-        T* bufferT = (T*)buffer;
-        for (size_t n = 0; n < count; ++n)
-            bufferT[n] = endian::swap<T>(endian::swap<T>(bufferT[n]) * volume);
-    }
-
+    /// Apply volume and mute, gain changes are ramped to avoid clicks
     void adjustVolume(char* buffer, size_t frames);
 
     std::atomic<bool> active_;
+    std::atomic<uint32_t> xruns_;
     std::shared_ptr<Stream> stream_;
+    PlayerSettings settings_;
     #ifdef ESP_PLATFORM
     TaskHandle_t player_task_;
     #else
@@ -78,6 +100,8 @@ protected:
     double volume_;
     bool muted_;
     double volCorrection_;
+    /// Gain applied to the last frame, ramps towards volume_
+    double gain_;
 };
 
 
@@ -0,0 +1,98 @@
+/***
+    This file is part of snapcast
+    Copyright (C) 2014-2019  Johannes Pohl
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include "common/aixlog.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <sys/mman.h>
+
+
+/// Helpers to keep page faults and preemption off the audio path
+namespace realtime
+{
+
+/// Stack that is touched by prefaultStack, must cover the deepest call chain of the audio path
+static constexpr size_t prefault_stack_size = 64 * 1024;
+
+
+/// Lock all current and future pages into RAM. Future mappings (e.g. the PCM ring) are faulted in when they are created
+inline bool lockMemory()
+{
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+    {
+        LOG(WARNING) << "Failed to lock memory: " << strerror(errno) << "\n";
+        return false;
+    }
+    LOG(INFO) << "Memory locked\n";
+    return true;
+}
+
+
+/// Touch the calling thread's stack, so that it is resident (and locked) before the first deadline
+inline void prefaultStack()
+{
+    char stack[prefault_stack_size];
+    volatile char* page = stack;
+    for (size_t n = 0; n < prefault_stack_size; n += 4096)
+        page[n] = 0;
+}
+
+
+/// Run the calling thread with SCHED_FIFO "priority" (0: don't change) and pin it to "cpu" (-1: don't pin)
+inline void setCurrentThread(const std::string& name, int priority, int cpu)
+{
+    if (priority > 0)
+    {
+        sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = std::min(std::max(priority, sched_get_priority_min(SCHED_FIFO)), sched_get_priority_max(SCHED_FIFO));
+        int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (err != 0)
+            LOG(WARNING) << "Failed to set " << name << " thread to SCHED_FIFO " << param.sched_priority << ": " << strerror(err) << "\n";
+        else
+            LOG(INFO) << "Running " << name << " thread with SCHED_FIFO " << param.sched_priority << "\n";
+        prefaultStack();
+    }
+
+    if (cpu >= 0)
+    {
+#ifdef __linux__
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(cpu, &cpuset);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+        if (err != 0)
+            LOG(WARNING) << "Failed to pin " << name << " thread to CPU " << cpu << ": " << strerror(err) << "\n";
+        else
+            LOG(INFO) << "Pinned " << name << " thread to CPU " << cpu << "\n";
+#else
+        LOG(WARNING) << "CPU affinity is not supported on this platform\n";
+#endif
+    }
+}
+}
+
+
+#endif
@@ -0,0 +1,214 @@
+/***
+    This file is part of snapcast
+    Copyright (C) 2014-2019  Johannes Pohl
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include "resampler.hpp"
+#ifndef ESP_PLATFORM
+#include "common/snap_exception.hpp"
+#include "common/str_compat.hpp"
+#else
+#include <snap_exception.hpp>
+#include <str_compat.hpp>
+#endif
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+
+static constexpr double pi = 3.14159265358979323846;
+
+
+Resampler::Resampler(const SampleFormat& format, size_t maxFrames) : format_(format), maxFrames_(maxFrames), capacity_(0), size_(0), pos_(0.)
+{
+    if ((format_.sampleSize != 1) && (format_.sampleSize != 2) && (format_.sampleSize != 4))
+        throw SnapException("Resampler: unsupported sample size: " + cpt::to_string(format_.sampleSize));
+
+    // Blackman windowed sinc, for phase p the filter is centered between tap taps/2 - 1 and taps/2
+    filter_.resize((phases + 1) * taps);
+    for (size_t p = 0; p <= phases; ++p)
+    {
+        double frac = (double)p / phases;
+        double sum = 0.;
+        for (size_t k = 0; k < taps; ++k)
+        {
+            double d = (double)k - (double)(taps / 2 - 1) - frac;
+            double sinc = (d == 0.) ? 1. : std::sin(pi * d) / (pi * d);
+            double window = 0.42 + 0.5 * std::cos(2. * pi * d / taps) + 0.08 * std::cos(4. * pi * d / taps);
+            filter_[p * taps + k] = sinc * window;
+            sum += sinc * window;
+        }
+        // unity gain for all phases
+        for (size_t k = 0; k < taps; ++k)
+            filter_[p * taps + k] /= sum;
+    }
+    coefficients_.resize(taps);
+    reserve(static_cast<size_t>(std::ceil(maxFrames * (1. + max_deviation))) + format_.rate * max_correction_ms / 1000 + taps + 1);
+    reset();
+}
+
+
+void Resampler::reset()
+{
+    // start with taps/2 - 1 frames of silence, so that the first output frame is the first input frame
+    size_ = taps / 2 - 1;
+    for (size_t c = 0; c < format_.channels; ++c)
+        std::fill_n(history_.begin() + c * capacity_, size_, 0);
+    pos_ = size_;
+}
+
+
+void Resampler::reserve(size_t frames)
+{
+    if (input_.size() < frames * format_.frameSize)
+        input_.resize(frames * format_.frameSize);
+    if (frames <= capacity_)
+        return;
+
+    std::vector<int32_t> history(frames * format_.channels);
+    for (size_t c = 0; c < format_.channels; ++c)
+        std::copy_n(history_.begin() + c * capacity_, size_, history.begin() + c * frames);
+    history_.swap(history);
+    capacity_ = frames;
+}
+
+
+void Resampler::append(size_t frames)
+{
+    if (format_.sampleSize == 1)
+        deinterleave<int8_t>(frames);
+    else if (format_.sampleSize == 2)
+        deinterleave<int16_t>(frames);
+    else
+        deinterleave<int32_t>(frames);
+    size_ += frames;
+}
+
+
+void Resampler::render(char* out, unsigned long frames, double ratio)
+{
+    if (format_.sampleSize == 1)
+        interleave<int8_t>(out, frames, ratio);
+    else if (format_.sampleSize == 2)
+        interleave<int16_t>(out, frames, ratio);
+    else
+        interleave<int32_t>(out, frames, ratio);
+
+    // keep the frames needed for the next output frame
+    size_t drop = std::min((size_t)std::floor(pos_) - (taps / 2 - 1), size_);
+    for (size_t c = 0; c < format_.channels; ++c)
+    {
+        int32_t* channel = history_.data() + c * capacity_;
+        memmove(channel, channel + drop, (size_ - drop) * sizeof(int32_t));
+    }
+    size_ -= drop;
+    pos_ -= drop;
+}
+
+
+template <typename T>
+void Resampler::deinterleave(size_t frames)
+{
+    const T* in = (const T*)input_.data();
+    for (size_t c = 0; c < format_.channels; ++c)
+    {
+        int32_t* channel = history_.data() + c * capacity_ + size_;
+        for (size_t n = 0; n < frames; ++n)
+            channel[n] = in[n * format_.channels + c];
+    }
+}
+
+
+template <typename T>
+static inline T toSample(float value)
+{
+    // float can't represent max() of 32 bit samples, the clamping is done in double precision
+    double rounded = std::round(static_cast<double>(value));
+    if (rounded >= static_cast<double>(std::numeric_limits<T>::max()))
+        return std::numeric_limits<T>::max();
+    if (rounded <= static_cast<double>(std::numeric_limits<T>::min()))
+        return std::numeric_limits<T>::min();
+    return static_cast<T>(rounded);
+}
+
+
+/// Dot product of 16 samples and coefficients
+static inline float dot16(const int32_t* x, const float* c)
+{
+#if defined(__AVX2__)
+    __m256 sum = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(x))), _mm256_loadu_ps(c));
+    sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(x + 8))), _mm256_loadu_ps(c + 8)));
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    return _mm_cvtss_f32(_mm_add_ss(s, _mm_shuffle_ps(s, s, 1)));
+#elif defined(__SSE2__)
+    __m128 s = _mm_setzero_ps();
+    for (size_t k = 0; k < 16; k += 4)
+        s = _mm_add_ps(s, _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x + k))), _mm_loadu_ps(c + k)));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    return _mm_cvtss_f32(_mm_add_ss(s, _mm_shuffle_ps(s, s, 1)));
+#elif defined(__ARM_NEON)
+    float32x4_t s = vdupq_n_f32(0.f);
+    for (size_t k = 0; k < 16; k += 4)
+        s = vmlaq_f32(s, vcvtq_f32_s32(vld1q_s32(x + k)), vld1q_f32(c + k));
+    float32x2_t s2 = vadd_f32(vget_low_f32(s), vget_high_f32(s));
+    return vget_lane_f32(vpadd_f32(s2, s2), 0);
+#else
+    float sum[4] = {0.f, 0.f, 0.f, 0.f};
+    for (size_t k = 0; k < 16; k += 4)
+        for (size_t j = 0; j < 4; ++j)
+            sum[j] += x[k + j] * c[k + j];
+    return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+#endif
+}
+
+
+template <typename T>
+void Resampler::interleave(char* out, unsigned long frames, double ratio)
+{
+    static_assert(taps == 16, "dot16 is unrolled for 16 taps");
+    T* output = (T*)out;
+    float* coefficients = coefficients_.data();
+    for (size_t n = 0; n < frames; ++n, pos_ += ratio)
+    {
+        size_t idx = (size_t)pos_;
+        double frac = pos_ - idx;
+        if (frac == 0.)
+        {
+            // integer position, i.e. no resampling
+            for (size_t c = 0; c < format_.channels; ++c)
+                output[n * format_.channels + c] = static_cast<T>(history_[c * capacity_ + idx]);
+            continue;
+        }
+
+        double phase = frac * phases;
+        size_t p = (size_t)phase;
+        float weight = phase - p;
+        const float* low = filter_.data() + p * taps;
+        const float* high = low + taps;
+        for (size_t k = 0; k < taps; ++k)
+            coefficients[k] = low[k] + weight * (high[k] - low[k]);
+
+        size_t first = idx - (taps / 2 - 1);
+        for (size_t c = 0; c < format_.channels; ++c)
+            output[n * format_.channels + c] = toSample<T>(dot16(history_.data() + c * capacity_ + first, coefficients));
+    }
+}
@@ -0,0 +1,107 @@
+/***
+    This file is part of snapcast
+    Copyright (C) 2014-2019  Johannes Pohl
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+#ifndef ESP_PLATFORM
+#include "common/sample_format.hpp"
+#else
+#include <sample_format.hpp>
+#endif
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+
+/// Fractional resampler for interleaved PCM, used to play slightly faster or slower
+/**
+ * Windowed-sinc interpolation with a polyphase filter bank: the filter for a
+ * fractional position is linearly interpolated between the two nearest phases.
+ * The input is kept as deinterleaved 32 bit integer history, so that the filter
+ * runs over contiguous memory (SSE2/AVX2/NEON kernels) in single precision, i.e.
+ * interpolated 32 bit samples have 24 bit precision.
+ * At a ratio of exactly 1 the samples are passed through unmodified.
+ * All buffers are allocated upfront for up to "maxFrames" output frames per call,
+ * with a rate deviation of up to max_deviation plus max_correction_ms, and are reused afterwards.
+ */
+class Resampler
+{
+public:
+    /// Max. deviation of the ratio from 1, not counting the correction
+    static constexpr double max_deviation = 0.01;
+    /// Max. correction per call (see Stream::getNextPlayerChunk) [ms]
+    static constexpr size_t max_correction_ms = 10;
+
+    Resampler(const SampleFormat& format, size_t maxFrames);
+
+    /// Drop the history, must be called whenever the input is not continuous
+    void reset();
+
+    /// Render "frames" output frames, consuming "ratio" input frames per output frame
+    /**
+     * read(void* to, unsigned long frames) is called to read interleaved input frames
+     * @return position of the first output frame relative to the first frame read by this call [frames]
+     */
+    template <typename Read>
+    double resample(void* outputBuffer, unsigned long frames, double ratio, Read&& read)
+    {
+        size_t before = size_;
+        size_t needed = (size_t)std::floor(pos_ + (frames - 1) * ratio) + taps / 2 + 1;
+        // read at least one frame, to get a time reference
+        size_t toRead = (needed > size_) ? needed - size_ : 1;
+        // no allocation on the player thread: the buffers are sized for the worst case
+        assert((frames <= maxFrames_) && (size_ + toRead <= capacity_));
+        reserve(size_ + toRead);
+        read(input_.data(), toRead);
+        append(toRead);
+        double offset = pos_ - before;
+        render((char*)outputBuffer, frames, ratio);
+        return offset;
+    }
+
+private:
+    static constexpr size_t taps = 16;
+    static constexpr size_t phases = 64;
+
+    void reserve(size_t frames);
+    void append(size_t frames);
+    void render(char* out, unsigned long frames, double ratio);
+
+    template <typename T>
+    void deinterleave(size_t frames);
+    template <typename T>
+    void interleave(char* out, unsigned long frames, double ratio);
+
+    SampleFormat format_;
+    /// (phases + 1) filters of "taps" coefficients
+    std::vector<float> filter_;
+    /// Deinterleaved input history, "capacity_" frames per channel
+    std::vector<int32_t> history_;
+    std::vector<char> input_;
+    std::vector<float> coefficients_;
+    size_t maxFrames_;
+    size_t capacity_;
+    size_t size_;
+    /// Position of the next output frame in the history
+    double pos_;
+};
+
+
+#endif
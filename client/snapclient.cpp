@@ -35,6 +35,7 @@
 #include "common/str_compat.hpp"
 #include "common/utils.hpp"
 #include "metadata.hpp"
+#include "realtime.hpp"
 
 
 using namespace std;
@@ -84,6 +85,8 @@ int main(int argc, char** argv)
         size_t port(1704);
         int latency(0);
         size_t instance(1);
+        string syncMode("threshold");
+        PlayerSettings playerSettings;
 
         OptionParser op("Allowed options");
         auto helpSwitch = op.add<Switch>("", "help", "produce help message");
@@ -93,6 +96,9 @@ int main(int argc, char** argv)
 #if defined(HAS_ALSA)
         auto listSwitch = op.add<Switch>("l", "list", "list pcm devices");
         /*auto soundcardValue =*/op.add<Value<string>>("s", "soundcard", "index or name of the soundcard", "default", &soundcard);
+        /*auto periodValue =*/op.add<Value<size_t>>("", "period_time", "period time of the soundcard [ms], 0: default", 0, &playerSettings.periodMs);
+        /*auto bufferValue =*/op.add<Value<size_t>>("", "buffer_time", "buffer time of the soundcard [ms], 0: default", 0, &playerSettings.bufferMs);
+        auto mmapSwitch = op.add<Switch>("", "mmap", "write directly into the soundcard's buffer");
 #endif
         auto metaStderr = op.add<Switch>("e", "mstderr", "send metadata to stderr");
         // auto metaHook =       op.add<Value<string>>("m", "mhook", "script to call on meta tags", "", &meta_script);
@@ -106,10 +112,21 @@ int main(int argc, char** argv)
         /*auto latencyValue =*/op.add<Value<int>>("", "latency", "latency of the soundcard", 0, &latency);
         /*auto instanceValue =*/op.add<Value<size_t>>("i", "instance", "instance id", 1, &instance);
         auto hostIdValue = op.add<Value<string>>("", "hostID", "unique host id", "");
+        /*auto syncValue =*/op.add<Value<string>>("", "sync", "sync mode: threshold|servo", syncMode, &syncMode);
+        auto fastStartSwitch = op.add<Switch>("", "fast_start", "start the playout sample accurately as soon as the time sync has converged");
+        auto multicastSwitch = op.add<Switch>("", "multicast", "receive the audio via multicast, if the server offers it (falls back to TCP)");
+        /*auto rtPriorityValue =*/op.add<Value<int>>("", "rt_priority", "SCHED_FIFO priority of the player thread [1..99], locks the memory. 0: off", 0,
+                                                     &playerSettings.rtPriority);
+        auto rtDecoderSwitch = op.add<Switch>("", "rt_decoder", "run the decoder thread with SCHED_FIFO, one below the player");
+        /*auto cpuValue =*/op.add<Value<int>>("", "cpu", "pin the player and decoder thread to this CPU, -1: off", -1, &playerSettings.cpu);
 
         try
         {
             op.parse(argc, argv);
+            if ((syncMode != "threshold") && (syncMode != "servo"))
+                throw std::invalid_argument("invalid sync mode: " + syncMode);
+            if ((playerSettings.rtPriority < 0) || (playerSettings.rtPriority > 99))
+                throw std::invalid_argument("invalid rt priority: " + cpt::to_string(playerSettings.rtPriority));
         }
         catch (const std::invalid_argument& e)
         {
@@ -260,6 +277,17 @@ int main(int argc, char** argv)
 
             std::unique_ptr<Controller> controller(new Controller(hostIdValue->value(), instance, meta));
             LOG(INFO) << "Latency: " << latency << "\n";
+            controller->setSyncMode((syncMode == "servo") ? SyncMode::servo : SyncMode::threshold);
+            controller->setFastStart(fastStartSwitch->is_set());
+            controller->setMulticast(multicastSwitch->is_set());
+#if defined(HAS_ALSA)
+            playerSettings.mmap = mmapSwitch->is_set();
+#endif
+            playerSettings.rtDecoder = rtDecoderSwitch->is_set();
+            // lock after daemonizing, the lock is not inherited by the child
+            if ((playerSettings.rtPriority > 0) || playerSettings.rtDecoder)
+                realtime::lockMemory();
+            controller->setPlayerSettings(playerSettings);
             controller->start(pcmDevice, host, port, latency);
             signal_handler.wait();
             controller->stop();
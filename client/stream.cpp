@@ -32,32 +32,38 @@ using namespace std;
 namespace cs = chronos;
 
 
-Stream::Stream(const SampleFormat& sampleFormat)
-    : format_(sampleFormat), sleep_(0), median_(0), shortMedian_(0), lastUpdate_(0), playedFrames_(0), bufferMs_(cs::msec(500))
+Stream::Stream(const SampleFormat& sampleFormat, size_t bufferMs)
+    : format_(sampleFormat), syncMode_(SyncMode::threshold), fastStart_(false), playing_(false), sleep_(0),
+      // chunks arrive up to "bufferMs" ahead of playout, plus 1s headroom. A segment per ms is enough for any chunk size
+      chunks_(sampleFormat, sampleFormat.rate * (bufferMs + 1000) / 1000, bufferMs + 1000), overflow_(false),
+      // player periods of up to 500ms
+      resampler_(sampleFormat, sampleFormat.rate / 2), median_(0), shortMedian_(0), lastUpdate_(0), rateRatio_(1.), bufferMs_(cs::msec(500))
 {
     buffer_.setSize(500);
     shortBuffer_.setSize(100);
-    miniBuffer_.setSize(20);
+    miniBuffer_.setSize(ClockServo::hard_correction_window);
     //	cardBuffer_.setSize(50);
+    setRealSampleRate(format_.rate);
+}
+
+
+void Stream::setRealSampleRate(double sampleRate)
+{
+    // e.g. 48000 / 47999.2: read 1.0000167 frames per played frame
+    rateRatio_ = format_.rate / sampleRate;
+}
 
-    /*
-    48000     x
-    ------- = -----
-    47999,2   x - 1
 
-    x = 1,000016667 / (1,000016667 - 1)
-    */
+void Stream::setSyncMode(SyncMode mode)
+{
+    syncMode_ = mode;
     setRealSampleRate(format_.rate);
 }
 
 
-void Stream::setRealSampleRate(double sampleRate)
+void Stream::setFastStart(bool fastStart)
 {
-    if (sampleRate == format_.rate)
-        correctAfterXFrames_ = 0;
-    else
-        correctAfterXFrames_ = round((format_.rate / sampleRate) / (format_.rate / sampleRate - 1.));
-    //	LOG(DEBUG) << "Correct after X: " << correctAfterXFrames_ << " (Real rate: " << sampleRate << ", rate: " << format_.rate << ")\n";
+    fastStart_ = fastStart;
 }
 
 
@@ -70,34 +76,36 @@ void Stream::setBufferLen(size_t bufferLenMs)
 
 void Stream::clearChunks()
 {
-    while (chunks_.size() > 0)
-        chunks_.pop();
+    chunks_.clear();
+    resampler_.reset();
     resetBuffers();
 }
 
 
-void Stream::addChunk(msg::PcmChunk* chunk)
+void Stream::addChunk(const msg::PcmChunk& chunk)
 {
-    while (chunks_.size() * chunk->duration<cs::msec>().count() > 10000)
-        chunks_.pop();
-    chunks_.push(shared_ptr<msg::PcmChunk>(chunk));
-    //	LOG(DEBUG) << "new chunk: " << chunk->duration<cs::msec>().count() << ", Chunks: " << chunks_.size() << "\n";
+    // the player discards late frames, so new ones will fit again
+    bool overflow = !chunks_.write(chunk.payload, chunk.getFrameCount(), chunk.start());
+    if (overflow && !overflow_)
+        LOG(WARNING) << "Stream buffer full, dropping chunks\n";
+    overflow_ = overflow;
+    //	LOG(DEBUG) << "new chunk: " << chunk.duration<cs::msec>().count() << ", Chunks: " << cs::duration<cs::msec>(bufferedDuration()) << "\n";
 }
 
 
-bool Stream::waitForChunk(size_t ms) const
+bool Stream::waitForChunk(size_t ms)
 {
-    return chunks_.wait_for(std::chrono::milliseconds(ms));
+    return chunks_.waitForData(ms);
 }
 
 
 
 cs::time_point_clk Stream::getSilentPlayerChunk(void* outputBuffer, unsigned long framesPerBuffer)
 {
-    if (!chunk_)
-        chunk_ = chunks_.pop();
-    cs::time_point_clk tp = chunk_->start();
+    cs::time_point_clk tp;
+    chunks_.front(tp);
     memset(outputBuffer, 0, framesPerBuffer * format_.frameSize);
+    resampler_.reset();
     return tp;
 }
 
@@ -140,49 +148,71 @@ time_point_clk Stream::seek(long ms)
 */
 
 
-cs::time_point_clk Stream::getNextPlayerChunk(void* outputBuffer, const cs::usec& timeout, unsigned long framesPerBuffer)
+bool Stream::startPlayerChunk(void* outputBuffer, const cs::usec& age, unsigned long framesPerBuffer)
 {
-    if (!chunk_ && !chunks_.try_pop(chunk_, timeout))
-        throw 0;
+    // an offset from a few time syncs would be corrected later by an audible jump: play silence until the estimate has converged
+    cs::nsec bufferDuration = cs::nsec(cs::nsec::rep(framesPerBuffer / format_.nsRate()));
+    if (!TimeProvider::getInstance().isConverged() || (age < -bufferDuration))
+    {
+        getSilentPlayerChunk(outputBuffer, framesPerBuffer);
+        return true;
+    }
 
-    cs::time_point_clk tp = chunk_->start();
-    char* buffer = (char*)outputBuffer;
-    unsigned long read = 0;
-    while (read < framesPerBuffer)
+    if (age.count() > 0)
     {
-        read += chunk_->readFrames(buffer + read * format_.frameSize, framesPerBuffer - read);
-        if (chunk_->isEndOfChunk() && !chunks_.try_pop(chunk_, timeout))
-            throw 0;
+        // late: discard exactly the frames that should have been played already
+        chunks_.read(nullptr, (size_t)(age.count() * format_.usRate()));
+        getNextPlayerChunk(outputBuffer, framesPerBuffer);
     }
-    return tp;
+    else
+    {
+        // early by less than a period: the period starts with silence, the first frame is played exactly at its time
+        size_t silent = std::min((size_t)(-age.count() * format_.usRate()), (size_t)framesPerBuffer);
+        memset(outputBuffer, 0, silent * format_.frameSize);
+        if (silent < framesPerBuffer)
+            getNextPlayerChunk(static_cast<char*>(outputBuffer) + silent * format_.frameSize, framesPerBuffer - silent);
+    }
+
+    LOG(INFO) << "Started playout, age: " << cs::duration<cs::msec>(age) << " ms\n";
+    resampler_.reset();
+    resetBuffers();
+    sleep_ = cs::usec(0);
+    playing_ = true;
+    return true;
 }
 
 
-cs::time_point_clk Stream::getNextPlayerChunk(void* outputBuffer, const cs::usec& timeout, unsigned long framesPerBuffer, long framesCorrection)
+cs::time_point_clk Stream::getNextPlayerChunk(void* outputBuffer, unsigned long framesPerBuffer)
 {
-    if (framesCorrection == 0)
-        return getNextPlayerChunk(outputBuffer, timeout, framesPerBuffer);
-
-    long toRead = framesPerBuffer + framesCorrection;
-    char* buffer = (char*)malloc(toRead * format_.frameSize);
-    cs::time_point_clk tp = getNextPlayerChunk(buffer, timeout, toRead);
-
-    float factor = (float)toRead / framesPerBuffer; //(float)(framesPerBuffer*channels_);
-                                                    //	if (abs(framesCorrection) > 1)
-                                                    //		LOG(INFO) << "correction: " << framesCorrection << ", factor: " << factor << "\n";
-    float idx = 0;
-    for (size_t n = 0; n < framesPerBuffer; ++n)
-    {
-        size_t index(floor(idx)); // = (int)(ceil(n*factor));
-        memcpy((char*)outputBuffer + n * format_.frameSize, buffer + index * format_.frameSize, format_.frameSize);
-        idx += factor;
-    }
-    free(buffer);
+    cs::time_point_clk tp;
+    if ((chunks_.available() < framesPerBuffer) || !chunks_.front(tp))
+        throw 0;
 
+    chunks_.read(outputBuffer, framesPerBuffer);
     return tp;
 }
 
 
+cs::time_point_clk Stream::getNextPlayerChunk(void* outputBuffer, unsigned long framesPerBuffer, double framesCorrection)
+{
+    // framesPerBuffer (scaled by the sample rate deviation) + framesCorrection frames are played in framesPerBuffer frames
+    double ratio = (framesPerBuffer * rateRatio_ + framesCorrection) / framesPerBuffer;
+    //	if (abs(framesCorrection) > 1)
+    //		LOG(INFO) << "correction: " << framesCorrection << ", ratio: " << ratio << "\n";
+    cs::time_point_clk tp;
+    double offset = resampler_.resample(outputBuffer, framesPerBuffer, ratio,
+                                        [&](void* buffer, unsigned long frames) { tp = getNextPlayerChunk(buffer, frames); });
+    // the resampler delays the output, "offset" frames relative to the first frame read
+    return tp + std::chrono::duration_cast<cs::clk::duration>(cs::nsec((cs::nsec::rep)(offset / format_.nsRate())));
+}
+
+
+
+cs::nsec Stream::bufferedDuration() const
+{
+    return cs::nsec((cs::nsec::rep)(chunks_.available() / format_.nsRate()));
+}
+
 
 void Stream::updateBuffers(int age)
 {
@@ -207,25 +237,40 @@ bool Stream::getPlayerChunk(void* outputBuffer, const cs::usec& outputBufferDacT
     {
         LOG(INFO) << "outputBufferDacTime > bufferMs: " << cs::duration<cs::msec>(outputBufferDacTime) << " > " << cs::duration<cs::msec>(bufferMs_) << "\n";
         sleep_ = cs::usec(0);
+        resampler_.reset();
+        playing_ = false;
         return false;
     }
 
-    if (!chunk_ && !chunks_.try_pop(chunk_, outputBufferDacTime))
+    cs::time_point_clk start;
+    if (!chunks_.front(start))
     {
         // LOG(INFO) << "no chunks available\n";
         sleep_ = cs::usec(0);
+        resampler_.reset();
+        playing_ = false;
         return false;
     }
 
-    playedFrames_ += framesPerBuffer;
-
     /// we have a chunk
     /// age = chunk age (server now - rec time: some positive value) - buffer (e.g. 1000ms) + time to DAC
     /// age = 0 => play now
     /// age < 0 => play in -age
     /// age > 0 => too old
-    cs::usec age = std::chrono::duration_cast<cs::usec>(TimeProvider::serverNow() - chunk_->start()) - bufferMs_ + outputBufferDacTime;
+    cs::usec age = std::chrono::duration_cast<cs::usec>(TimeProvider::serverNow() - start) - bufferMs_ + outputBufferDacTime;
     //	LOG(INFO) << "age: " << age.count() / 1000 << "\n";
+    if (fastStart_ && !playing_)
+    {
+        try
+        {
+            return startPlayerChunk(outputBuffer, age, framesPerBuffer);
+        }
+        catch (int e)
+        {
+            return false;
+        }
+    }
+
     if ((sleep_.count() == 0) && (cs::abs(age) > cs::msec(200)))
     {
         LOG(INFO) << "age > 200: " << cs::duration<cs::msec>(age) << "\n";
@@ -246,7 +291,7 @@ bool Stream::getPlayerChunk(void* outputBuffer, const cs::usec& outputBufferDacT
             if (sleep_ < -bufferDuration / 2)
             {
                 LOG(INFO) << "sleep < -bufferDuration/2: " << cs::duration<cs::msec>(sleep_) << " < " << -cs::duration<cs::msec>(bufferDuration) / 2 << ", ";
-                // We're early: not enough chunks_. play silence. Reference chunk_ is the oldest (front) one
+                // We're early: not enough chunks_. play silence. Reference is the oldest (front) frame
                 sleep_ = chrono::duration_cast<cs::usec>(TimeProvider::serverNow() - getSilentPlayerChunk(outputBuffer, framesPerBuffer) - bufferMs_ +
                                                          outputBufferDacTime);
                 LOG(INFO) << "sleep: " << cs::duration<cs::msec>(sleep_) << "\n";
@@ -256,33 +301,31 @@ bool Stream::getPlayerChunk(void* outputBuffer, const cs::usec& outputBufferDacT
             else if (sleep_ > bufferDuration / 2)
             {
                 LOG(INFO) << "sleep > bufferDuration/2: " << cs::duration<cs::msec>(sleep_) << " > " << cs::duration<cs::msec>(bufferDuration) / 2 << "\n";
-                // We're late: discard oldest chunks
-                while (sleep_ > chunk_->duration<cs::usec>())
+                // We're late: discard the oldest frames
+                LOG(INFO) << "discarding: " << cs::duration<cs::msec>(sleep_) << ", buffered: " << cs::duration<cs::msec>(bufferedDuration())
+                          << ", out: " << cs::duration<cs::msec>(outputBufferDacTime) << ", needed: " << cs::duration<cs::msec>(bufferDuration) << "\n";
+                chunks_.read(nullptr, (size_t)(sleep_.count() * format_.usRate()));
+                resampler_.reset();
+                if (!chunks_.front(start))
                 {
-                    LOG(INFO) << "sleep > chunkDuration: " << cs::duration<cs::msec>(sleep_) << " > " << chunk_->duration<cs::msec>().count()
-                              << ", chunks: " << chunks_.size() << ", out: " << cs::duration<cs::msec>(outputBufferDacTime)
-                              << ", needed: " << cs::duration<cs::msec>(bufferDuration) << "\n";
-                    sleep_ = std::chrono::duration_cast<cs::usec>(TimeProvider::serverNow() - chunk_->start() - bufferMs_ + outputBufferDacTime);
-                    if (!chunks_.try_pop(chunk_, outputBufferDacTime))
-                    {
-                        LOG(INFO) << "no chunks available\n";
-                        chunk_ = nullptr;
-                        sleep_ = cs::usec(0);
-                        return false;
-                    }
+                    LOG(INFO) << "no chunks available\n";
+                    sleep_ = cs::usec(0);
+                    return false;
                 }
+                sleep_ = std::chrono::duration_cast<cs::usec>(TimeProvider::serverNow() - start - bufferMs_ + outputBufferDacTime);
             }
 
             // out of sync, can be corrected by playing faster/slower
-            if (sleep_ < -cs::usec(100))
+            const cs::usec step(ClockServo::hard_correction_step_us);
+            if (sleep_ < -step)
             {
-                sleep_ += cs::usec(100);
-                correction = -cs::usec(100);
+                sleep_ += step;
+                correction = -step;
             }
-            else if (sleep_ > cs::usec(100))
+            else if (sleep_ > step)
             {
-                sleep_ -= cs::usec(100);
-                correction = cs::usec(100);
+                sleep_ -= step;
+                correction = step;
             }
             else
             {
@@ -293,54 +336,67 @@ bool Stream::getPlayerChunk(void* outputBuffer, const cs::usec& outputBufferDacT
         }
 
         // framesCorrection = number of frames to be read more or less to get in-sync
-        long framesCorrection = correction.count() * format_.usRate();
-
-        // sample rate correction
-        if ((correctAfterXFrames_ != 0) && (playedFrames_ >= (unsigned long)abs(correctAfterXFrames_)))
-        {
-            framesCorrection += (correctAfterXFrames_ > 0) ? 1 : -1;
-            playedFrames_ -= abs(correctAfterXFrames_);
-        }
+        double framesCorrection = correction.count() * format_.usRate();
 
         age = std::chrono::duration_cast<cs::usec>(TimeProvider::serverNow() -
-                                                   getNextPlayerChunk(outputBuffer, outputBufferDacTime, framesPerBuffer, framesCorrection) - bufferMs_ +
+                                                   getNextPlayerChunk(outputBuffer, framesPerBuffer, framesCorrection) - bufferMs_ +
                                                    outputBufferDacTime);
 
-        setRealSampleRate(format_.rate);
-        if (sleep_.count() == 0)
+        if (syncMode_ == SyncMode::servo)
         {
-            if (buffer_.full())
+            if (sleep_.count() == 0)
             {
-                if (cs::usec(abs(median_)) > cs::msec(1))
+                // only gross errors are corrected with a hard jump, everything else is slewed by the servo
+                if (ClockServo::needsHardCorrection(miniBuffer_))
                 {
-                    LOG(INFO) << "pBuffer->full() && (abs(median_) > 1): " << median_ << "\n";
-                    sleep_ = cs::usec(median_);
+                    LOG(INFO) << "pMiniBuffer->full() && (abs(pMiniBuffer->median()) > 5): " << miniBuffer_.median() << "\n";
+                    sleep_ = cs::usec(miniBuffer_.median());
+                    servo_.reset();
                 }
-                // else if (cs::usec(median_) > cs::usec(300))
-                // {
-                //     setRealSampleRate(format_.rate - format_.rate / 1000);
-                // }
-                // else if (cs::usec(median_) < -cs::usec(300))
-                // {
-                //     setRealSampleRate(format_.rate + format_.rate / 1000);
-                // }
-            }
-            else if (shortBuffer_.full())
-            {
-                if (cs::usec(abs(shortMedian_)) > cs::msec(5))
+                else
                 {
-                    LOG(INFO) << "pShortBuffer->full() && (abs(shortMedian_) > 5): " << shortMedian_ << "\n";
-                    sleep_ = cs::usec(shortMedian_);
+                    rateRatio_ = servo_.update(age.count(), bufferDuration.count() / 1000000000.);
                 }
-                // else
-                // {
-                //     setRealSampleRate(format_.rate + -shortMedian_ / 100);
-                // }
             }
-            else if (miniBuffer_.full() && (cs::usec(abs(miniBuffer_.median())) > cs::msec(50)))
+        }
+        else
+        {
+            setRealSampleRate(format_.rate);
+            if (sleep_.count() == 0)
             {
-                LOG(INFO) << "pMiniBuffer->full() && (abs(pMiniBuffer->mean()) > 50): " << miniBuffer_.median() << "\n";
-                sleep_ = cs::usec((cs::msec::rep)miniBuffer_.mean());
+                if (buffer_.full())
+                {
+                    if (cs::usec(abs(median_)) > cs::msec(1))
+                    {
+                        LOG(INFO) << "pBuffer->full() && (abs(median_) > 1): " << median_ << "\n";
+                        sleep_ = cs::usec(median_);
+                    }
+                    // else if (cs::usec(median_) > cs::usec(300))
+                    // {
+                    //     setRealSampleRate(format_.rate - format_.rate / 1000);
+                    // }
+                    // else if (cs::usec(median_) < -cs::usec(300))
+                    // {
+                    //     setRealSampleRate(format_.rate + format_.rate / 1000);
+                    // }
+                }
+                else if (shortBuffer_.full())
+                {
+                    if (cs::usec(abs(shortMedian_)) > cs::msec(5))
+                    {
+                        LOG(INFO) << "pShortBuffer->full() && (abs(shortMedian_) > 5): " << shortMedian_ << "\n";
+                        sleep_ = cs::usec(shortMedian_);
+                    }
+                    // else
+                    // {
+                    //     setRealSampleRate(format_.rate + -shortMedian_ / 100);
+                    // }
+                }
+                else if (miniBuffer_.full() && (cs::usec(abs(miniBuffer_.median())) > cs::msec(50)))
+                {
+                    LOG(INFO) << "pMiniBuffer->full() && (abs(pMiniBuffer->mean()) > 50): " << miniBuffer_.median() << "\n";
+                    sleep_ = cs::usec((cs::msec::rep)miniBuffer_.mean());
+                }
             }
         }
 
@@ -355,7 +411,7 @@ bool Stream::getPlayerChunk(void* outputBuffer, const cs::usec& outputBufferDacT
                           << "\n";
             }
         }
-        else if (shortBuffer_.full())
+        else if ((syncMode_ == SyncMode::threshold) && shortBuffer_.full())
         {
             if (cs::usec(shortMedian_) > cs::usec(100))
                 setRealSampleRate(format_.rate * 0.9999);
@@ -374,6 +430,8 @@ bool Stream::getPlayerChunk(void* outputBuffer, const cs::usec& outputBufferDacT
             shortMedian_ = shortBuffer_.median();
             LOG(INFO) << "Chunk: " << age.count() / 100 << "\t" << miniBuffer_.median() / 100 << "\t" << shortMedian_ / 100 << "\t" << median_ / 100 << "\t"
                       << buffer_.size() << "\t" << cs::duration<cs::msec>(outputBufferDacTime) << "\n";
+            if (syncMode_ == SyncMode::servo)
+                LOG(DEBUG) << "Rate correction: " << servo_.ppm() << " ppm\n";
             // LOG(INFO) << "Chunk: " << age.count()/1000 << "\t" << miniBuffer_.median()/1000 << "\t" << shortMedian_/1000 << "\t" << median_/1000 << "\t" <<
             // buffer_.size() << "\t" << cs::duration<cs::msec>(outputBufferDacTime) << "\n";
         }
@@ -382,6 +440,8 @@ bool Stream::getPlayerChunk(void* outputBuffer, const cs::usec& outputBufferDacT
     catch (int e)
     {
         sleep_ = cs::usec(0);
+        resampler_.reset();
+        playing_ = false;
         return false;
     }
 }
@@ -20,19 +20,30 @@
 #define STREAM_H
 
 #ifndef ESP_PLATFORM
-#include "common/queue.h"
 #include "common/sample_format.hpp"
 #else
-#include <snap_queue.h>
 #include <sample_format.hpp>
 #endif
 #include "double_buffer.hpp"
 #include "message/message.hpp"
 #include "message/pcm_chunk.hpp"
+#include "clock_servo.hpp"
+#include "pcm_ring.hpp"
+#include "resampler.hpp"
 #include <deque>
 #include <memory>
 
 
+/// How the playout is kept in sync with the server
+enum class SyncMode
+{
+    /// Hard jumps when the median age exceeds thresholds, plus a fixed +/-0.01% rate nudge
+    threshold,
+    /// Continuous rate correction by a PI loop, hard jumps only for gross errors
+    servo
+};
+
+
 /// Time synchronized audio stream
 /**
  * Queue with PCM data.
@@ -41,10 +52,11 @@
 class Stream
 {
 public:
-    Stream(const SampleFormat& format);
+    /// "bufferMs": the server's buffer, the stream's capacity is derived from it
+    Stream(const SampleFormat& format, size_t bufferMs);
 
-    /// Adds PCM data to the queue
-    void addChunk(msg::PcmChunk* chunk);
+    /// Adds PCM data to the queue, the chunk is copied
+    void addChunk(const msg::PcmChunk& chunk);
     void clearChunks();
 
     /// Get PCM data, which will be played out in "outputBufferDacTime" time
@@ -54,39 +66,56 @@ public:
     /// "Server buffer": playout latency, e.g. 1000ms
     void setBufferLen(size_t bufferLenMs);
 
+    void setSyncMode(SyncMode mode);
+
+    /// Start sample accurately once the time sync has converged, instead of slewing into sync at 100us per period
+    void setFastStart(bool fastStart);
+
     const SampleFormat& getFormat() const
     {
         return format_;
     }
 
-    bool waitForChunk(size_t ms) const;
+    bool waitForChunk(size_t ms);
 
 private:
-    chronos::time_point_clk getNextPlayerChunk(void* outputBuffer, const chronos::usec& timeout, unsigned long framesPerBuffer);
-    chronos::time_point_clk getNextPlayerChunk(void* outputBuffer, const chronos::usec& timeout, unsigned long framesPerBuffer, long framesCorrection);
+    chronos::time_point_clk getNextPlayerChunk(void* outputBuffer, unsigned long framesPerBuffer);
+    chronos::time_point_clk getNextPlayerChunk(void* outputBuffer, unsigned long framesPerBuffer, double framesCorrection);
     chronos::time_point_clk getSilentPlayerChunk(void* outputBuffer, unsigned long framesPerBuffer);
+    /// Play silence until the first frame is due at "age", then start the playout with it
+    bool startPlayerChunk(void* outputBuffer, const chronos::usec& age, unsigned long framesPerBuffer);
     chronos::time_point_clk seek(long ms);
     //	time_point_ms seekTo(const time_point_ms& to);
     void updateBuffers(int age);
     void resetBuffers();
+    /// Duration of the buffered frames
+    chronos::nsec bufferedDuration() const;
     void setRealSampleRate(double sampleRate);
 
     SampleFormat format_;
+    SyncMode syncMode_;
+    bool fastStart_;
+    /// Playout is running, i.e. the stream has been started and did not run dry since
+    bool playing_;
 
     chronos::usec sleep_;
 
-    Queue<std::shared_ptr<msg::PcmChunk>> chunks_;
+    /// Decoded PCM, written by the Controller and read by the player without locking
+    PcmRing chunks_;
+    /// chunks_ was full when the last chunk was added
+    bool overflow_;
     //	DoubleBuffer<chronos::usec::rep> cardBuffer;
     DoubleBuffer<chronos::usec::rep> miniBuffer_;
     DoubleBuffer<chronos::usec::rep> buffer_;
     DoubleBuffer<chronos::usec::rep> shortBuffer_;
-    std::shared_ptr<msg::PcmChunk> chunk_;
+    Resampler resampler_;
 
     int median_;
     int shortMedian_;
     time_t lastUpdate_;
-    unsigned long playedFrames_;
-    long correctAfterXFrames_;
+    /// Input frames per output frame to compensate the deviation of the DAC's sample rate
+    double rateRatio_;
+    ClockServo servo_;
     chronos::msec bufferMs_;
 };
 
@@ -22,57 +22,134 @@
 #else
 #include <aixlog.hpp>
 #endif
+#include <algorithm>
+#include <vector>
 
 
-TimeProvider::TimeProvider() : diffToServer_(0)
+/// Max. number of time sync samples
+static constexpr size_t max_samples = 64;
+/// Min. number of filtered samples and their min. time span to estimate the drift
+static constexpr size_t min_fit_samples = 8;
+static constexpr chronos::sec min_fit_span(60);
+/// Clamp the drift to +/-500ppm
+static constexpr double max_drift = 500.;
+/// Error of a sample beyond its round trip time uncertainty that is considered a jump of the clocks [us]
+static constexpr double jump_threshold = 10000.;
+/// Samples within +/-500us of the prediction double the sync interval, samples off by more than 1ms halve it
+static constexpr double good_error = 500.;
+static constexpr double bad_error = 1000.;
+static constexpr int min_sync_interval = 1000;
+static constexpr int max_sync_interval = 30000;
+
+
+TimeProvider::TimeProvider() : model_(new Model{chronos::clk::now(), 0., 0., false, 0}), syncInterval_(min_sync_interval), rtt_(-1)
 {
-    diffBuffer_.setSize(200);
-    #ifdef ESP_PLATFORM
-    mutex_ = xSemaphoreCreateMutex();
-    #endif
 }
 
 
 void TimeProvider::setDiff(const tv& c2s, const tv& s2c)
 {
-    //	tv latency = c2s - s2c;
-    //	double diff = (latency.sec * 1000. + latency.usec / 1000.) / 2.;
-    double diff = ((double)c2s.sec / 2. - (double)s2c.sec / 2.) * 1000. + ((double)c2s.usec / 2. - (double)s2c.usec / 2.) / 1000.;
-    setDiffToServer(diff);
+    Sample sample;
+    sample.time = chronos::clk::now();
+    sample.diff = (double)(c2s.nsec - s2c.nsec) / 2000.;
+    sample.rtt = std::max<chronos::usec::rep>((c2s.nsec + s2c.nsec) / 1000, 0);
+    rtt_ = sample.rtt;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    double error = sample.diff - std::atomic_load(&model_)->at(sample.time);
+    // the true offset is within +/-rtt/2 of the sample's offset
+    if (!samples_.empty() && (std::abs(error) > sample.rtt / 2. + jump_threshold))
+    {
+        LOG(INFO) << "Time offset to server jumped by " << error / 1000. << " ms. Clearing time buffer\n";
+        samples_.clear();
+        syncInterval_ = min_sync_interval;
+    }
+
+    samples_.push_back(sample);
+    while (samples_.size() > max_samples)
+        samples_.pop_front();
+
+    chronos::usec::rep maxRtt = fit(sample.time);
+    auto model = std::atomic_load(&model_);
+    if (!model->fitted)
+        syncInterval_ = min_sync_interval;
+    else if ((sample.rtt <= maxRtt) && (std::abs(error) < good_error))
+        syncInterval_ = std::min(2 * syncInterval_.load(), max_sync_interval);
+    else if ((sample.rtt <= maxRtt) && (std::abs(error) > bad_error))
+        syncInterval_ = std::max(syncInterval_.load() / 2, min_sync_interval);
+
+    LOG(DEBUG) << "Time sync - rtt: " << sample.rtt << ", error: " << error << ", diff: " << model->diff / 1000. << " ms, drift: " << model->drift
+               << " ppm, interval: " << syncInterval_ << " ms\n";
 }
 
 
-void TimeProvider::setDiffToServer(double ms)
+chronos::usec::rep TimeProvider::fit(const chronos::time_point_clk& now)
 {
-    static int32_t lastTimeSync = 0;
-    timeval now;
-    chronos::systemtimeofday(&now);
-    #ifdef ESP_PLATFORM
-    if(xSemaphoreTake(mutex_, 10/portTICK_PERIOD_MS) != pdTRUE){
-        LOG(ERROR) << "Could not lock access to server time diff\n";
-        return;
+    // use the samples with the lower half of the round trip times, they have the smallest error
+    std::vector<chronos::usec::rep> rtts;
+    for (const auto& sample : samples_)
+        rtts.push_back(sample.rtt);
+    auto median = rtts.begin() + (rtts.size() - 1) / 2;
+    std::nth_element(rtts.begin(), median, rtts.end());
+    chronos::usec::rep maxRtt = *median;
+
+    std::vector<const Sample*> used;
+    for (const auto& sample : samples_)
+    {
+        if (sample.rtt <= maxRtt)
+            used.push_back(&sample);
     }
-    #endif
-    /// clear diffBuffer if last update is older than a minute
-    if (!diffBuffer_.empty() && (std::abs(now.tv_sec - lastTimeSync) > 60))
+
+    Model model{now, 0., std::atomic_load(&model_)->drift, false, samples_.size()};
+    if ((used.size() >= min_fit_samples) && (used.back()->time - used.front()->time >= min_fit_span))
+    {
+        // least squares fit of diff = model.diff + model.drift * (time - now)
+        double meanX(0.), meanY(0.);
+        for (const auto* sample : used)
+        {
+            meanX += std::chrono::duration<double>(sample->time - now).count();
+            meanY += sample->diff;
+        }
+        meanX /= used.size();
+        meanY /= used.size();
+        double sxx(0.), sxy(0.);
+        for (const auto* sample : used)
+        {
+            double x = std::chrono::duration<double>(sample->time - now).count() - meanX;
+            sxx += x * x;
+            sxy += x * (sample->diff - meanY);
+        }
+        model.drift = std::max(-max_drift, std::min(max_drift, sxy / sxx));
+        model.diff = meanY - model.drift * meanX;
+        model.fitted = true;
+    }
+    else
     {
-        LOG(INFO) << "Last time sync older than a minute. Clearing time buffer\n";
-        diffToServer_ = ms * 1000;
-        diffBuffer_.clear();
+        // not enough history for a regression: the sample with the lowest round trip time has the smallest error bound (+/-rtt/2),
+        // its offset is extrapolated with the last known drift
+        const Sample* best = *std::min_element(used.begin(), used.end(), [](const Sample* a, const Sample* b) { return a->rtt < b->rtt; });
+        model.diff = best->diff + model.drift * std::chrono::duration<double>(now - best->time).count();
     }
-    lastTimeSync = now.tv_sec;
-
-    diffBuffer_.add(ms * 1000);
-    diffToServer_ = diffBuffer_.median(3);
-    #ifdef ESP_PLATFORM
-    xSemaphoreGive(mutex_);
-    #endif
-    //	LOG(INFO) << "setDiffToServer: " << ms << ", diff: " << diffToServer_ / 1000.f << "\n";
+
+    std::atomic_store(&model_, std::shared_ptr<const Model>(new Model(model)));
+    return maxRtt;
+}
+
+
+void TimeProvider::reset()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    samples_.clear();
+    syncInterval_ = min_sync_interval;
+    auto model = std::atomic_load(&model_);
+    std::atomic_store(&model_, std::shared_ptr<const Model>(new Model{model->reference, model->diff, model->drift, false, 0}));
 }
 
-/*
-long TimeProvider::getPercentileDiffToServer(size_t percentile)
+
+void TimeProvider::setDiffToServer(double ms)
 {
-        return diffBuffer.percentile(percentile);
+    std::lock_guard<std::mutex> lock(mutex_);
+    samples_.clear();
+    syncInterval_ = min_sync_interval;
+    std::atomic_store(&model_, std::shared_ptr<const Model>(new Model{chronos::clk::now(), ms * 1000., 0., false, 0}));
 }
-*/
@@ -23,13 +23,13 @@
 #include "common/time_defs.hpp"
 #else
 #include <time_defs.hpp>
-#include <freertos/freertos.h>
-#include <freertos/semphr.h>
 #endif
-#include "double_buffer.hpp"
 #include "message/message.hpp"
 #include <atomic>
 #include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
 
 
 /// Provides local and server time
@@ -37,6 +37,11 @@
  * Stores time difference to the server
  * Returns server's local system time.
  * Clients are using the server time to play audio in sync, independent of the client's system time
+ *
+ * Time sync samples are filtered NTP style: only the samples with the lowest round trip times
+ * are used, the offset and the frequency offset (drift) of the local clock are estimated by a
+ * linear regression over them. The server time is extrapolated between two time syncs,
+ * so the sync interval can grow while the estimate is good.
  */
 class TimeProvider
 {
@@ -47,19 +52,42 @@ public:
         return instance;
     }
 
+    /// Discard the time sync history, the offset and drift estimates are kept until new samples arrive
+    void reset();
+    /// Set the offset to the server, discards the time sync history
     void setDiffToServer(double ms);
+    /// Add a time sync sample, "c2s": client to server latency, "s2c": server to client latency, both including the clock offset
     void setDiff(const tv& c2s, const tv& s2c);
 
     template <typename T>
     inline T getDiffToServer() const
     {
-        return std::chrono::duration_cast<T>(chronos::usec(diffToServer_));
+        return std::chrono::duration_cast<T>(chronos::usec(diffToServer(chronos::clk::now())));
     }
 
-    /*	chronos::usec::rep getDiffToServer();
-            chronos::usec::rep getPercentileDiffToServer(size_t percentile);
-            long getDiffToServerMs();
-    */
+    /// Recommended interval until the next time sync
+    chronos::msec getSyncInterval() const
+    {
+        return chronos::msec(syncInterval_.load());
+    }
+
+    /// Enough samples since the last reset to position the playout on the offset estimate
+    bool isConverged() const
+    {
+        return std::atomic_load(&model_)->samples >= min_converged_samples;
+    }
+
+    /// Round trip time of the last time sync, -1 if there was none yet
+    chronos::usec getRtt() const
+    {
+        return chronos::usec(rtt_.load());
+    }
+
+    /// Estimated frequency offset of the local clock [ppm]
+    double getDrift() const
+    {
+        return std::atomic_load(&model_)->drift;
+    }
 
     template <typename T>
     static T sinceEpoche(const chronos::time_point_clk& point)
@@ -69,7 +97,7 @@ public:
 
     static chronos::time_point_clk toTimePoint(const tv& timeval)
     {
-        return chronos::time_point_clk(chronos::usec(timeval.usec) + chronos::sec(timeval.sec));
+        return chronos::time_point_clk(std::chrono::duration_cast<chronos::clk::duration>(chronos::nsec(timeval.nsec)));
     }
 
     inline static chronos::time_point_clk now()
@@ -79,21 +107,61 @@ public:
 
     inline static chronos::time_point_clk serverNow()
     {
-        return chronos::clk::now() + TimeProvider::getInstance().getDiffToServer<chronos::usec>();
+        chronos::time_point_clk now = chronos::clk::now();
+        return now + chronos::usec(TimeProvider::getInstance().diffToServer(now));
     }
 
+    /// Min. number of samples, until the estimate is considered to be converged
+    static constexpr size_t min_converged_samples = 8;
+
 private:
     TimeProvider();
     TimeProvider(TimeProvider const&);   // Don't Implement
     void operator=(TimeProvider const&); // Don't implement
 
-    DoubleBuffer<chronos::usec::rep> diffBuffer_;
-    #ifndef ESP_PLATFORM
-    std::atomic<chronos::usec::rep> diffToServer_;
-    #else
-        SemaphoreHandle_t mutex_;
-        chronos::usec::rep diffToServer_;
-    #endif
+    /// Time sync measurement
+    struct Sample
+    {
+        chronos::time_point_clk time;
+        /// Offset to the server [us]
+        double diff;
+        /// Round trip time [us]
+        chronos::usec::rep rtt;
+    };
+
+    /// Offset to the server at "reference", changing with "drift"
+    struct Model
+    {
+        chronos::time_point_clk reference;
+        /// [us]
+        double diff;
+        /// [ppm], i.e. us per s
+        double drift;
+        /// Drift has been estimated by linear regression
+        bool fitted;
+        /// Number of samples the estimate is based on
+        size_t samples;
+
+        double at(const chronos::time_point_clk& time) const
+        {
+            return diff + drift * std::chrono::duration<double>(time - reference).count();
+        }
+    };
+
+    chronos::usec::rep diffToServer(const chronos::time_point_clk& time) const
+    {
+        return static_cast<chronos::usec::rep>(std::atomic_load(&model_)->at(time));
+    }
+
+    /// Estimate model_ from samples_, returns the max. round trip time of the samples used
+    chronos::usec::rep fit(const chronos::time_point_clk& now);
+
+    std::mutex mutex_;
+    std::deque<Sample> samples_;
+    /// Read by the player without locking, replaced as a whole (use std::atomic_load/store)
+    std::shared_ptr<const Model> model_;
+    std::atomic<int> syncInterval_;
+    std::atomic<chronos::usec::rep> rtt_;
 };
 
 
@@ -0,0 +1,88 @@
+/***
+    This file is part of snapcast
+    Copyright (C) 2014-2019  Johannes Pohl
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#ifndef CLIENT_INFO_MSG_H
+#define CLIENT_INFO_MSG_H
+
+#include "json_message.hpp"
+
+
+namespace msg
+{
+
+/// Playback statistics, sent by the client to the server
+/**
+ * Only sent to servers that speak protocol v3, older servers drop the connection on unknown message types
+ */
+class ClientInfo : public JsonMessage
+{
+public:
+    ClientInfo() : JsonMessage(message_type::kClientInfo)
+    {
+    }
+
+    ~ClientInfo() override = default;
+
+    /// Number of buffer underruns of the audio device since the client connected
+    uint32_t getXruns() const
+    {
+        return get("xruns", 0u);
+    }
+
+    void setXruns(uint32_t xruns)
+    {
+        msg["xruns"] = xruns;
+    }
+
+    /// Min. time [ms] between the arrival of a chunk and its playout since the last report, -1 if unknown
+    int getBufferMs() const
+    {
+        return get("buffer", -1);
+    }
+
+    void setBufferMs(int bufferMs)
+    {
+        msg["buffer"] = bufferMs;
+    }
+
+    /// Round trip time [ms] of the last time sync, -1 if unknown
+    int getRtt() const
+    {
+        return get("rtt", -1);
+    }
+
+    void setRtt(int rtt)
+    {
+        msg["rtt"] = rtt;
+    }
+
+    /// Number of chunks received from the multicast group since the last report, -1 if the client doesn't receive via multicast
+    int getMulticastChunks() const
+    {
+        return get("multicastChunks", -1);
+    }
+
+    void setMulticastChunks(int chunks)
+    {
+        msg["multicastChunks"] = chunks;
+    }
+};
+}
+
+
+#endif
@@ -42,10 +42,10 @@ public:
         free(payload);
     }
 
-    void read(std::istream& stream) override
+    void read(BufferReader& reader) override
     {
-        readVal(stream, codec);
-        readVal(stream, &payload, payloadSize);
+        reader.read(codec);
+        reader.read(&payload, payloadSize);
     }
 
     uint32_t getSize() const override
@@ -58,10 +58,10 @@ public:
     std::string codec;
 
 protected:
-    void doserialize(std::ostream& stream) const override
+    void doserialize(BufferWriter& writer) const override
     {
-        writeVal(stream, codec);
-        writeVal(stream, payload, payloadSize);
+        writer.write(codec);
+        writer.write(payload, payloadSize);
     }
 };
 } // namespace msg
@@ -28,6 +28,7 @@
 #endif
 #include "json_message.hpp"
 #include <string>
+#include <vector>
 
 
 namespace msg
@@ -50,7 +51,7 @@ public:
         msg["Arch"] = ::getArch();
         msg["Instance"] = instance;
         msg["ID"] = id;
-        msg["SnapStreamProtocolVersion"] = 2;
+        msg["SnapStreamProtocolVersion"] = protocol_v3;
     }
 
     ~Hello() override = default;
@@ -95,6 +96,28 @@ public:
         return get("SnapStreamProtocolVersion", 1);
     }
 
+    /// The client is able to receive the audio via multicast
+    bool isMulticast() const
+    {
+        return get("Multicast", false);
+    }
+
+    void setMulticast(bool multicast)
+    {
+        msg["Multicast"] = multicast;
+    }
+
+    /// Codecs the client is able to decode, the server picks the first of the stream's codecs that is in this list
+    std::vector<std::string> getCodecs() const
+    {
+        return get("Codecs", std::vector<std::string>());
+    }
+
+    void setCodecs(const std::vector<std::string>& codecs)
+    {
+        msg["Codecs"] = codecs;
+    }
+
     std::string getId() const
     {
         return get("ID", getMacAddress());
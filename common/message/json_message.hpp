@@ -42,11 +42,12 @@ public:
 
     ~JsonMessage() override = default;
 
-    void read(std::istream& stream) override
+    void read(BufferReader& reader) override
     {
-        std::string s;
-        readVal(stream, s);
-        msg = json::parse(s);
+        uint32_t size;
+        reader.read(size);
+        const char* data = reader.skip(size);
+        msg = json::parse(data, data + size);
     }
 
     uint32_t getSize() const override
@@ -58,9 +59,9 @@ public:
 
 
 protected:
-    void doserialize(std::ostream& stream) const override
+    void doserialize(BufferWriter& writer) const override
     {
-        writeVal(stream, msg.dump());
+        writer.write(msg.dump());
     }
 
     template <typename T>
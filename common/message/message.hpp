@@ -21,39 +21,20 @@
 
 #ifndef ESP_PLATFORM
 #include "common/endian.hpp"
+#include "common/snap_exception.hpp"
 #include "common/time_defs.hpp"
 #else
 #include <endian.hpp>
+#include <snap_exception.hpp>
 #include <time_defs.hpp>
 #endif
 #include <cstdlib>
 #include <cstring>
-#include <iostream>
-#include <streambuf>
+#include <memory>
+#include <string>
 #include <sys/time.h>
 #include <vector>
 
-/*
-template<typename CharT, typename TraitsT = std::char_traits<CharT> >
-class vectorwrapbuf : public std::basic_streambuf<CharT, TraitsT>
-{
-public:
-        vectorwrapbuf(std::vector<CharT> &vec)
-        {
-                this->setg(vec.data(), vec.data(), vec.data() + vec.size());
-        }
-};
-*/
-
-struct membuf : public std::basic_streambuf<char>
-{
-    membuf(char* begin, char* end)
-    {
-        this->setg(begin, begin, end);
-    }
-};
-
-
 enum message_type
 {
     kBase = 0,
@@ -63,53 +44,46 @@ enum message_type
     kTime = 4,
     kHello = 5,
     kStreamTags = 6,
+    kClientInfo = 7,
 
     kFirst = kBase,
-    kLast = kStreamTags
+    kLast = kClientInfo
 };
 
 
 
+/// Time stamp or duration with nanosecond resolution, in the domain of chronos::clk (monotonic)
 struct tv
 {
-    tv()
+    tv() : nsec(std::chrono::duration_cast<chronos::nsec>(chronos::clk::now().time_since_epoch()).count())
     {
-        timeval t;
-        chronos::systemtimeofday(&t);
-        sec = t.tv_sec;
-        usec = t.tv_usec;
     }
-    tv(timeval tv) : sec(tv.tv_sec), usec(tv.tv_usec){};
-    tv(int32_t _sec, int32_t _usec) : sec(_sec), usec(_usec){};
+    tv(timeval tv) : nsec(static_cast<int64_t>(tv.tv_sec) * 1000000000 + static_cast<int64_t>(tv.tv_usec) * 1000){};
+    tv(int32_t _sec, int32_t _usec) : nsec(static_cast<int64_t>(_sec) * 1000000000 + static_cast<int64_t>(_usec) * 1000){};
+    explicit tv(chronos::nsec ns) : nsec(ns.count()){};
 
-    int32_t sec;
-    int32_t usec;
+    /// Full seconds, rounded towards -infinity, i.e. usec() is always positive
+    int64_t sec() const
+    {
+        return (nsec >= 0) ? nsec / 1000000000 : -((-nsec - 1) / 1000000000) - 1;
+    }
+
+    int32_t usec() const
+    {
+        return static_cast<int32_t>((nsec - sec() * 1000000000) / 1000);
+    }
 
     tv operator+(const tv& other) const
     {
-        tv result(*this);
-        result.sec += other.sec;
-        result.usec += other.usec;
-        if (result.usec > 1000000)
-        {
-            result.sec += result.usec / 1000000;
-            result.usec %= 1000000;
-        }
-        return result;
+        return tv(chronos::nsec(nsec + other.nsec));
     }
 
     tv operator-(const tv& other) const
     {
-        tv result(*this);
-        result.sec -= other.sec;
-        result.usec -= other.usec;
-        while (result.usec < 0)
-        {
-            result.sec -= 1;
-            result.usec += 1000000;
-        }
-        return result;
+        return tv(chronos::nsec(nsec - other.nsec));
     }
+
+    int64_t nsec;
 };
 
 namespace msg
@@ -117,195 +91,390 @@ namespace msg
 
 const size_t max_size = 1000000;
 
-struct BaseMessage;
+/// v2: 26 byte header, time stamps as 32 bit sec/usec
+const int protocol_v2 = 2;
+/// v3: compact header, time stamps as 64 bit nanoseconds
+const int protocol_v3 = 3;
+/// Set in the type field of v3 headers, so that both versions can be told apart on receive
+const uint16_t compact_header = 0x8000;
 
-using message_ptr = std::shared_ptr<msg::BaseMessage>;
 
-struct BaseMessage
+/// Writes little endian values into a preallocated buffer
+class BufferWriter
 {
-    BaseMessage() : type(kBase), id(0), refersTo(0)
+public:
+    BufferWriter(char* begin, char* end, int version = protocol_v2) : pos_(begin), end_(end), version_(version)
     {
     }
 
-    BaseMessage(message_type type_) : type(type_), id(0), refersTo(0)
+    /// Protocol version, determines the encoding of time stamps
+    int version() const
     {
+        return version_;
     }
 
-    virtual ~BaseMessage() = default;
-
-    virtual void read(std::istream& stream)
+    void write(bool val)
     {
-        readVal(stream, type);
-        readVal(stream, id);
-        readVal(stream, refersTo);
-        readVal(stream, sent.sec);
-        readVal(stream, sent.usec);
-        readVal(stream, received.sec);
-        readVal(stream, received.usec);
-        readVal(stream, size);
+        write(static_cast<char>(val ? 1 : 0));
     }
 
-    void deserialize(char* payload)
+    void write(char val)
     {
-        membuf databuf(payload, payload + BaseMessage::getSize());
-        std::istream is(&databuf);
-        read(is);
+        put(&val, sizeof(char));
     }
 
-    void deserialize(const BaseMessage& baseMessage, char* payload)
+    void write(uint16_t val)
     {
-        type = baseMessage.type;
-        id = baseMessage.id;
-        refersTo = baseMessage.refersTo;
-        sent = baseMessage.sent;
-        received = baseMessage.received;
-        size = baseMessage.size;
-        membuf databuf(payload, payload + size);
-        std::istream is(&databuf);
-        read(is);
+        val = SWAP_16(val);
+        put(&val, sizeof(uint16_t));
     }
 
-    virtual void serialize(std::ostream& stream) const
+    void write(int16_t val)
     {
-        writeVal(stream, type);
-        writeVal(stream, id);
-        writeVal(stream, refersTo);
-        writeVal(stream, sent.sec);
-        writeVal(stream, sent.usec);
-        writeVal(stream, received.sec);
-        writeVal(stream, received.usec);
-        size = getSize();
-        writeVal(stream, size);
-        doserialize(stream);
+        write(static_cast<uint16_t>(val));
     }
 
-    virtual uint32_t getSize() const
+    void write(uint32_t val)
     {
-        return 3 * sizeof(uint16_t) + 2 * sizeof(tv) + sizeof(uint32_t);
-    };
-
-    uint16_t type;
-    mutable uint16_t id;
-    uint16_t refersTo;
-    tv received;
-    mutable tv sent;
-    mutable uint32_t size;
+        val = SWAP_32(val);
+        put(&val, sizeof(uint32_t));
+    }
 
-protected:
-    void writeVal(std::ostream& stream, const bool& val) const
+    void write(int32_t val)
     {
-        char c = val ? 1 : 0;
-        writeVal(stream, c);
+        write(static_cast<uint32_t>(val));
     }
 
-    void writeVal(std::ostream& stream, const char& val) const
+    void write(int64_t val)
     {
-        stream.write(reinterpret_cast<const char*>(&val), sizeof(char));
+        val = SWAP_64(val);
+        put(&val, sizeof(int64_t));
     }
 
-    void writeVal(std::ostream& stream, const uint16_t& val) const
+    void write(const tv& val)
     {
-        uint16_t v = SWAP_16(val);
-        stream.write(reinterpret_cast<const char*>(&v), sizeof(uint16_t));
+        if (version_ >= protocol_v3)
+        {
+            write(val.nsec);
+        }
+        else
+        {
+            write(static_cast<int32_t>(val.sec()));
+            write(val.usec());
+        }
     }
 
-    void writeVal(std::ostream& stream, const int16_t& val) const
+    /// Length prefixed blob
+    void write(const char* payload, uint32_t size)
     {
-        uint16_t v = SWAP_16(val);
-        stream.write(reinterpret_cast<const char*>(&v), sizeof(int16_t));
+        write(size);
+        put(payload, size);
     }
 
-    void writeVal(std::ostream& stream, const uint32_t& val) const
+    void write(const std::string& val)
     {
-        uint32_t v = SWAP_32(val);
-        stream.write(reinterpret_cast<const char*>(&v), sizeof(uint32_t));
+        write(val.data(), static_cast<uint32_t>(val.size()));
     }
 
-    void writeVal(std::ostream& stream, const int32_t& val) const
+    /// Number of bytes left in the buffer
+    size_t left() const
     {
-        uint32_t v = SWAP_32(val);
-        stream.write(reinterpret_cast<const char*>(&v), sizeof(int32_t));
+        return end_ - pos_;
     }
 
-    void writeVal(std::ostream& stream, const char* payload, const uint32_t& size) const
+private:
+    void put(const void* data, size_t size)
     {
-        writeVal(stream, size);
-        stream.write(payload, size);
+        if (size > left())
+            throw SnapException("message buffer too small");
+        memcpy(pos_, data, size);
+        pos_ += size;
     }
 
-    void writeVal(std::ostream& stream, const std::string& val) const
+    char* pos_;
+    char* end_;
+    int version_;
+};
+
+
+/// Reads little endian values in place from a received buffer
+class BufferReader
+{
+public:
+    BufferReader(const char* begin, const char* end, int version = protocol_v2) : pos_(begin), end_(end), version_(version)
     {
-        uint32_t size = val.size();
-        writeVal(stream, val.c_str(), size);
     }
 
+    /// Protocol version, determines the encoding of time stamps
+    int version() const
+    {
+        return version_;
+    }
 
-
-    void readVal(std::istream& stream, bool& val) const
+    void read(bool& val)
     {
         char c;
-        readVal(stream, c);
+        read(c);
         val = (c != 0);
     }
 
-    void readVal(std::istream& stream, char& val) const
+    void read(char& val)
     {
-        stream.read(reinterpret_cast<char*>(&val), sizeof(char));
+        get(&val, sizeof(char));
     }
 
-    void readVal(std::istream& stream, uint16_t& val) const
+    void read(uint16_t& val)
     {
-        stream.read(reinterpret_cast<char*>(&val), sizeof(uint16_t));
+        get(&val, sizeof(uint16_t));
         val = SWAP_16(val);
     }
 
-    void readVal(std::istream& stream, int16_t& val) const
+    void read(int16_t& val)
     {
-        stream.read(reinterpret_cast<char*>(&val), sizeof(int16_t));
-        val = SWAP_16(val);
+        uint16_t v;
+        read(v);
+        val = static_cast<int16_t>(v);
     }
 
-    void readVal(std::istream& stream, uint32_t& val) const
+    void read(uint32_t& val)
     {
-        stream.read(reinterpret_cast<char*>(&val), sizeof(uint32_t));
+        get(&val, sizeof(uint32_t));
         val = SWAP_32(val);
     }
 
-    void readVal(std::istream& stream, int32_t& val) const
+    void read(int32_t& val)
     {
-        stream.read(reinterpret_cast<char*>(&val), sizeof(int32_t));
-        val = SWAP_32(val);
+        uint32_t v;
+        read(v);
+        val = static_cast<int32_t>(v);
+    }
+
+    void read(int64_t& val)
+    {
+        get(&val, sizeof(int64_t));
+        val = SWAP_64(val);
+    }
+
+    void read(tv& val)
+    {
+        if (version_ >= protocol_v3)
+        {
+            read(val.nsec);
+        }
+        else
+        {
+            int32_t sec, usec;
+            read(sec);
+            read(usec);
+            val = tv(sec, usec);
+        }
+    }
+
+    /// Length prefixed blob, copied into the (re)allocated "payload"
+    void read(char** payload, uint32_t& size)
+    {
+        uint32_t len;
+        read(len);
+        const char* data = skip(len);
+        *payload = (char*)realloc(*payload, len);
+        memcpy(*payload, data, len);
+        size = len;
+    }
+
+    void read(std::string& val)
+    {
+        uint32_t len;
+        read(len);
+        const char* data = skip(len);
+        val.assign(data, len);
     }
 
-    void readVal(std::istream& stream, char** payload, uint32_t& size) const
+    /// Advance by "size" bytes, returns a pointer to the skipped bytes
+    const char* skip(size_t size)
     {
-        readVal(stream, size);
-        *payload = (char*)realloc(*payload, size);
-        stream.read(*payload, size);
+        if (size > left())
+            throw SnapException("message too short");
+        const char* data = pos_;
+        pos_ += size;
+        return data;
     }
 
-    void readVal(std::istream& stream, std::string& val) const
+    /// Number of bytes left in the buffer
+    size_t left() const
     {
-        uint32_t size;
-        readVal(stream, size);
-        val.resize(size);
-        stream.read(&val[0], size);
+        return end_ - pos_;
     }
 
+private:
+    void get(void* data, size_t size)
+    {
+        memcpy(data, skip(size), size);
+    }
 
-    virtual void doserialize(std::ostream& /*stream*/) const {};
+    const char* pos_;
+    const char* end_;
+    int version_;
 };
 
 
-struct SerializedMessage
+struct BaseMessage;
+
+using message_ptr = std::shared_ptr<msg::BaseMessage>;
+
+struct BaseMessage
 {
-    ~SerializedMessage()
+    /// Serialized size of the v2 header, the largest one
+    static constexpr uint32_t header_size = 3 * sizeof(uint16_t) + 4 * sizeof(int32_t) + sizeof(uint32_t);
+    /// Serialized size of the v3 header of a WireChunk, the smallest one. Enough to tell the actual size by "headerSize(data)"
+    static constexpr uint32_t min_header_size = sizeof(uint16_t) + sizeof(uint32_t) + sizeof(int64_t);
+
+    BaseMessage() : type(kBase), id(0), refersTo(0), version(protocol_v2)
+    {
+    }
+
+    BaseMessage(message_type type_) : type(type_), id(0), refersTo(0), version(protocol_v2)
+    {
+    }
+
+    virtual ~BaseMessage() = default;
+
+    /// Size of the header of a message of "type" in protocol "version"
+    /**
+     * v2: type, id, refersTo, sent, received, size
+     * v3: type | compact_header, size, sent [, id, refersTo]
+     * v3 drops the "received" time stamp, which is set by the receiver anyway,
+     * and id and refersTo of WireChunks, which are never requests or responses.
+     */
+    static uint32_t headerSize(uint16_t type, int version)
+    {
+        if (version < protocol_v3)
+            return header_size;
+        return (type == message_type::kWireChunk) ? min_header_size : min_header_size + 2 * sizeof(uint16_t);
+    }
+
+    /// Size of the serialized header starting at "data", that must hold at least min_header_size bytes
+    static uint32_t headerSize(const char* data)
+    {
+        uint16_t type;
+        memcpy(&type, data, sizeof(uint16_t));
+        type = SWAP_16(type);
+        if ((type & compact_header) == 0)
+            return header_size;
+        return headerSize(type & ~compact_header, protocol_v3);
+    }
+
+    /// Read the header, the version is detected from the type field
+    virtual void read(BufferReader& reader)
+    {
+        reader.read(type);
+        if ((type & compact_header) != 0)
+        {
+            version = protocol_v3;
+            type &= ~compact_header;
+            reader.read(size);
+            reader.read(sent.nsec);
+            id = 0;
+            refersTo = 0;
+            if (type != message_type::kWireChunk)
+            {
+                reader.read(id);
+                reader.read(refersTo);
+            }
+        }
+        else
+        {
+            version = protocol_v2;
+            int32_t sec, usec;
+            reader.read(id);
+            reader.read(refersTo);
+            reader.read(sec);
+            reader.read(usec);
+            sent = tv(sec, usec);
+            reader.read(sec);
+            reader.read(usec);
+            received = tv(sec, usec);
+            reader.read(size);
+        }
+    }
+
+    /// Deserialize the header, "payload" must hold headerSize(payload) bytes
+    void deserialize(char* payload)
     {
-        free(buffer);
+        BufferReader reader(payload, payload + headerSize(payload));
+        BaseMessage::read(reader);
+    }
+
+    void deserialize(const BaseMessage& baseMessage, char* payload)
+    {
+        type = baseMessage.type;
+        id = baseMessage.id;
+        refersTo = baseMessage.refersTo;
+        sent = baseMessage.sent;
+        received = baseMessage.received;
+        size = baseMessage.size;
+        version = baseMessage.version;
+        BufferReader reader(payload, payload + size, version);
+        read(reader);
+    }
+
+    /// Serialize header and body in the writer's protocol version, "writer" must have room for headerSize(type, version) + getSize() bytes
+    virtual void serialize(BufferWriter& writer) const
+    {
+        serializeBase(writer);
+        doserialize(writer);
+    }
+
+    /// Serialize header and body into a new buffer
+    std::vector<char> serialize(int version = protocol_v2) const
+    {
+        std::vector<char> buffer(headerSize(type, version) + getSize());
+        BufferWriter writer(buffer.data(), buffer.data() + buffer.size(), version);
+        serialize(writer);
+        return buffer;
+    }
+
+    virtual uint32_t getSize() const
+    {
+        return header_size;
+    };
+
+    uint16_t type;
+    mutable uint16_t id;
+    uint16_t refersTo;
+    tv received;
+    mutable tv sent;
+    mutable uint32_t size;
+    /// Protocol version of the received header
+    int version;
+
+protected:
+    /// Serialize the BaseMessage header only, i.e. without the message body
+    void serializeBase(BufferWriter& writer) const
+    {
+        size = getSize();
+        if (writer.version() >= protocol_v3)
+        {
+            writer.write(static_cast<uint16_t>(type | compact_header));
+            writer.write(size);
+            writer.write(sent.nsec);
+            if (type != message_type::kWireChunk)
+            {
+                writer.write(id);
+                writer.write(refersTo);
+            }
+        }
+        else
+        {
+            writer.write(type);
+            writer.write(id);
+            writer.write(refersTo);
+            writer.write(sent);
+            writer.write(received);
+            writer.write(size);
+        }
     }
 
-    BaseMessage message;
-    char* buffer;
+    virtual void doserialize(BufferWriter& /*writer*/) const {};
 };
 }
 
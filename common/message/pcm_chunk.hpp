@@ -82,6 +82,12 @@ public:
         return result;
     }
 
+    /// Rewind to the first frame, used when the chunk is recycled
+    void rewind()
+    {
+        idx_ = 0;
+    }
+
     int seek(int frames)
     {
         if ((frames < 0) && (-frames > (int)idx_))
@@ -97,8 +103,8 @@ public:
 
     chronos::time_point_clk start() const override
     {
-        return chronos::time_point_clk(chronos::sec(timestamp.sec) + chronos::usec(timestamp.usec) +
-                                       chronos::usec((chronos::usec::rep)(1000000. * ((double)idx_ / (double)format.rate))));
+        return WireChunk::start() +
+               std::chrono::duration_cast<chronos::clk::duration>(chronos::nsec((chronos::nsec::rep)(1000000000. * ((double)idx_ / (double)format.rate))));
     }
 
     inline chronos::time_point_clk end() const
@@ -58,6 +58,21 @@ public:
         return get("muted", false);
     }
 
+    /// Multicast group of the client's stream, empty if the audio is sent via TCP
+    std::string getMulticastAddress()
+    {
+        if (!msg.count("multicast") || !msg["multicast"].is_object())
+            return "";
+        return msg["multicast"].value("address", "");
+    }
+
+    uint16_t getMulticastPort()
+    {
+        if (!msg.count("multicast") || !msg["multicast"].is_object())
+            return 0;
+        return msg["multicast"].value("port", 0);
+    }
+
 
 
     void setBufferMs(int32_t bufferMs)
@@ -79,6 +94,11 @@ public:
     {
         msg["muted"] = muted;
     }
+
+    void setMulticast(const std::string& address, uint16_t port)
+    {
+        msg["multicast"] = {{"address", address}, {"port", port}};
+    }
 };
 }
 
@@ -33,10 +33,9 @@ public:
 
     ~Time() override = default;
 
-    void read(std::istream& stream) override
+    void read(BufferReader& reader) override
     {
-        readVal(stream, latency.sec);
-        readVal(stream, latency.usec);
+        reader.read(latency);
     }
 
     uint32_t getSize() const override
@@ -47,10 +46,9 @@ public:
     tv latency;
 
 protected:
-    void doserialize(std::ostream& stream) const override
+    void doserialize(BufferWriter& writer) const override
     {
-        writeVal(stream, latency.sec);
-        writeVal(stream, latency.usec);
+        writer.write(latency);
     }
 };
 }
@@ -28,8 +28,6 @@
 #include <chrono>
 #include <cstdlib>
 #include <cstring>
-#include <iostream>
-#include <streambuf>
 #include <vector>
 
 
@@ -60,11 +58,10 @@ public:
         free(payload);
     }
 
-    void read(std::istream& stream) override
+    void read(BufferReader& reader) override
     {
-        readVal(stream, timestamp.sec);
-        readVal(stream, timestamp.usec);
-        readVal(stream, &payload, payloadSize);
+        reader.read(timestamp);
+        reader.read(&payload, payloadSize);
     }
 
     uint32_t getSize() const override
@@ -72,9 +69,23 @@ public:
         return sizeof(tv) + sizeof(int32_t) + payloadSize;
     }
 
+    /// Size of the serialized message without the payload bytes
+    uint32_t getHeaderSize(int version = protocol_v2) const
+    {
+        return headerSize(type, version) + sizeof(tv) + sizeof(int32_t);
+    }
+
+    /// Serialize everything but the payload bytes, which can be sent straight from "payload"
+    void serializeHeader(BufferWriter& writer) const
+    {
+        serializeBase(writer);
+        writer.write(timestamp);
+        writer.write(payloadSize);
+    }
+
     virtual chronos::time_point_clk start() const
     {
-        return chronos::time_point_clk(chronos::sec(timestamp.sec) + chronos::usec(timestamp.usec));
+        return chronos::time_point_clk(std::chrono::duration_cast<chronos::clk::duration>(chronos::nsec(timestamp.nsec)));
     }
 
     tv timestamp;
@@ -82,11 +93,10 @@ public:
     char* payload;
 
 protected:
-    void doserialize(std::ostream& stream) const override
+    void doserialize(BufferWriter& writer) const override
     {
-        writeVal(stream, timestamp.sec);
-        writeVal(stream, timestamp.usec);
-        writeVal(stream, payload, payloadSize);
+        writer.write(timestamp);
+        writer.write(payload, payloadSize);
     }
 };
 } // namespace msg
@@ -0,0 +1,399 @@
+/***
+    This file is part of snapcast
+    Copyright (C) 2014-2019  Johannes Pohl
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#ifndef MULTICAST_H
+#define MULTICAST_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <vector>
+
+
+/// Datagram framing of the multicast audio transport
+/**
+ * Serialized messages are split into datagrams of at most kMaxPayload bytes.
+ * Every datagram has a sequence number. After "fecGroup" data datagrams an
+ * XOR parity datagram is sent, that allows to recover one lost datagram of the group.
+ *
+ * Datagram layout (little endian):
+ *   uint32 seq        data: sequence number, parity: seq of the first protected datagram
+ *   uint8  kind       kData or kParity
+ *   uint8  count      parity: number of protected datagrams, data: 0
+ *   uint16 fragment   index of the fragment within the message   \
+ *   uint16 fragments  number of fragments of the message          | XOR protected
+ *   uint16 length     payload length                              |
+ *   payload                                                      /
+ */
+namespace mcast
+{
+
+static constexpr size_t kHeaderSize = 6;
+static constexpr size_t kFragmentHeaderSize = 6;
+static constexpr size_t kMaxPayload = 1200;
+static constexpr size_t kMaxFecGroup = 255;
+
+enum Kind : uint8_t
+{
+    kData = 0,
+    kParity = 1
+};
+
+
+inline void putUint16(char* p, uint16_t value)
+{
+    p[0] = static_cast<char>(value & 0xff);
+    p[1] = static_cast<char>(value >> 8);
+}
+
+inline void putUint32(char* p, uint32_t value)
+{
+    putUint16(p, value & 0xffff);
+    putUint16(p + 2, value >> 16);
+}
+
+inline uint16_t getUint16(const char* p)
+{
+    return static_cast<uint16_t>(static_cast<uint8_t>(p[0]) | (static_cast<uint8_t>(p[1]) << 8));
+}
+
+inline uint32_t getUint32(const char* p)
+{
+    return getUint16(p) | (static_cast<uint32_t>(getUint16(p + 2)) << 16);
+}
+
+/// Signed distance a - b of two sequence numbers, handles wrap around
+inline int32_t distance(uint32_t a, uint32_t b)
+{
+    return static_cast<int32_t>(a - b);
+}
+
+
+/// Splits messages into datagrams and adds XOR parity datagrams
+class Encoder
+{
+public:
+    /// One parity datagram protects "fecGroup" data datagrams, 0 disables FEC
+    explicit Encoder(size_t fecGroup = 4) : fecGroup_(std::min(fecGroup, kMaxFecGroup)), seq_(0), first_(0), protected_(0)
+    {
+    }
+
+    /// Split a serialized message into datagrams, "send(const char* data, size_t size)" is called for each of them
+    template <typename Send>
+    void encode(const char* data, size_t size, Send&& send)
+    {
+        size_t fragments = std::max<size_t>((size + kMaxPayload - 1) / kMaxPayload, 1);
+        for (size_t n = 0; n < fragments; ++n)
+        {
+            size_t offset = n * kMaxPayload;
+            size_t length = std::min(kMaxPayload, size - offset);
+            datagram_.resize(kHeaderSize + kFragmentHeaderSize + length);
+            char* p = datagram_.data();
+            putUint32(p, seq_);
+            p[4] = kData;
+            p[5] = 0;
+            putUint16(p + 6, static_cast<uint16_t>(n));
+            putUint16(p + 8, static_cast<uint16_t>(fragments));
+            putUint16(p + 10, static_cast<uint16_t>(length));
+            if (length > 0)
+                memcpy(p + kHeaderSize + kFragmentHeaderSize, data + offset, length);
+            send(datagram_.data(), datagram_.size());
+            if (fecGroup_ > 0)
+                protect(send);
+            ++seq_;
+        }
+    }
+
+private:
+    template <typename Send>
+    void protect(Send&& send)
+    {
+        if (protected_ == 0)
+        {
+            parity_.assign(kHeaderSize, 0);
+            first_ = seq_;
+        }
+        if (parity_.size() < datagram_.size())
+            parity_.resize(datagram_.size(), 0);
+        for (size_t n = kHeaderSize; n < datagram_.size(); ++n)
+            parity_[n] ^= datagram_[n];
+
+        if (++protected_ == fecGroup_)
+        {
+            putUint32(parity_.data(), first_);
+            parity_[4] = kParity;
+            parity_[5] = static_cast<char>(protected_);
+            send(parity_.data(), parity_.size());
+            protected_ = 0;
+        }
+    }
+
+    size_t fecGroup_;
+    uint32_t seq_;
+    uint32_t first_;
+    size_t protected_;
+    std::vector<char> datagram_;
+    std::vector<char> parity_;
+};
+
+
+/// Reorders datagrams, recovers lost ones using the parity datagrams and reassembles the messages
+class Decoder
+{
+public:
+    Decoder()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        packets_.clear();
+        parity_.clear();
+        synced_ = false;
+        window_ = kMinWindow;
+    }
+
+    /// Feed a datagram, complete messages are passed in order to "onMessage(char* data, size_t size)"
+    template <typename OnMessage>
+    void decode(const char* data, size_t size, OnMessage&& onMessage)
+    {
+        if (size < kHeaderSize + kFragmentHeaderSize)
+            return;
+        uint32_t seq = getUint32(data);
+        uint8_t kind = static_cast<uint8_t>(data[4]);
+        uint8_t count = static_cast<uint8_t>(data[5]);
+        if ((kind == kData) && (size != kHeaderSize + kFragmentHeaderSize + getUint16(data + 10)))
+            return;
+        if ((kind == kParity) && (count == 0))
+            return;
+        if ((kind != kData) && (kind != kParity))
+            return;
+
+        // first datagram or the sender has been restarted
+        if (!synced_ || (std::abs(distance(seq, last_)) > kResyncDistance))
+        {
+            reset();
+            synced_ = true;
+            next_ = seq;
+            last_ = seq;
+        }
+
+        if (kind == kData)
+        {
+            if (distance(seq, last_) > 0)
+                last_ = seq;
+            if (distance(seq, next_) >= -window_)
+                packets_[seq].assign(data + kHeaderSize, data + size);
+        }
+        else
+        {
+            window_ = (2 * count > kMinWindow) ? 2 * count : kMinWindow;
+            if (distance(seq + count - 1, last_) > 0)
+                last_ = seq + count - 1;
+            if (distance(seq + count, next_) > 0)
+            {
+                Parity& parity = parity_[seq];
+                parity.count = count;
+                parity.data.assign(data + kHeaderSize, data + size);
+            }
+        }
+
+        recover();
+        deliver(onMessage);
+        // give up waiting for datagrams that are missing for too long. The window starts after the message that is being
+        // reassembled, so that messages with more fragments than the window are not dropped while they arrive
+        while (distance(last_, messageEnd()) >= window_)
+        {
+            skip();
+            deliver(onMessage);
+        }
+        prune();
+    }
+
+    /// Number of datagrams restored from parity
+    size_t recovered() const
+    {
+        return recovered_;
+    }
+
+    /// Number of data datagrams that were lost and could not be restored
+    size_t lost() const
+    {
+        return lost_;
+    }
+
+private:
+    static constexpr int32_t kMinWindow = 8;
+    static constexpr int32_t kResyncDistance = 1000;
+
+    struct Parity
+    {
+        uint8_t count;
+        std::vector<char> data;
+    };
+
+    static uint16_t fragment(const std::vector<char>& packet)
+    {
+        return getUint16(packet.data());
+    }
+
+    static uint16_t fragments(const std::vector<char>& packet)
+    {
+        return getUint16(packet.data() + 2);
+    }
+
+    void recover()
+    {
+        for (auto it = parity_.begin(); it != parity_.end();)
+        {
+            uint32_t missing(0);
+            size_t missingCount(0);
+            for (uint32_t seq = it->first; seq != it->first + it->second.count; ++seq)
+            {
+                if (packets_.find(seq) == packets_.end())
+                {
+                    missing = seq;
+                    ++missingCount;
+                }
+            }
+
+            if (missingCount > 1)
+            {
+                ++it;
+                continue;
+            }
+
+            if ((missingCount == 1) && (distance(missing, next_) >= 0))
+            {
+                std::vector<char> packet(it->second.data);
+                for (uint32_t seq = it->first; seq != it->first + it->second.count; ++seq)
+                {
+                    if (seq == missing)
+                        continue;
+                    const auto& data = packets_[seq];
+                    for (size_t n = 0; n < std::min(data.size(), packet.size()); ++n)
+                        packet[n] ^= data[n];
+                }
+                size_t size = kFragmentHeaderSize + getUint16(packet.data() + 4);
+                if (size <= packet.size())
+                {
+                    packet.resize(size);
+                    packets_[missing] = std::move(packet);
+                    ++recovered_;
+                }
+            }
+            it = parity_.erase(it);
+        }
+    }
+
+    template <typename OnMessage>
+    void deliver(OnMessage&& onMessage)
+    {
+        while (true)
+        {
+            auto it = packets_.find(next_);
+            if (it == packets_.end())
+                return;
+
+            // tail of a message, whose head has been lost
+            uint16_t count = fragments(it->second);
+            if ((fragment(it->second) != 0) || (count == 0))
+            {
+                ++next_;
+                continue;
+            }
+
+            message_.clear();
+            for (uint32_t seq = next_; seq != next_ + count; ++seq)
+            {
+                auto packet = packets_.find(seq);
+                if (packet == packets_.end())
+                    return;
+                message_.insert(message_.end(), packet->second.begin() + kFragmentHeaderSize, packet->second.end());
+            }
+            next_ += count;
+            onMessage(message_.data(), message_.size());
+        }
+    }
+
+    /// Sequence number after the message next_ belongs to, as far as its received fragments tell, next_ if none is received
+    uint32_t messageEnd() const
+    {
+        uint32_t end = next_;
+        for (const auto& packet : packets_)
+        {
+            uint32_t first = packet.first - fragment(packet.second);
+            if ((distance(packet.first, next_) >= 0) && (distance(first, next_) <= 0) && (distance(first + fragments(packet.second), end) > 0))
+                end = first + fragments(packet.second);
+        }
+        return end;
+    }
+
+    /// Continue with the next message after next_
+    void skip()
+    {
+        uint32_t next = last_ + 1;
+        for (const auto& packet : packets_)
+        {
+            if ((distance(packet.first, next_) > 0) && (distance(packet.first, next) < 0) && (fragment(packet.second) == 0))
+                next = packet.first;
+        }
+        for (uint32_t seq = next_; seq != next; ++seq)
+        {
+            if (packets_.find(seq) == packets_.end())
+                ++lost_;
+        }
+        next_ = next;
+    }
+
+    /// Remove datagrams that are too old to be needed for recovery
+    void prune()
+    {
+        for (auto it = packets_.begin(); it != packets_.end();)
+        {
+            if (distance(it->first, next_) < -window_)
+                it = packets_.erase(it);
+            else
+                ++it;
+        }
+        for (auto it = parity_.begin(); it != parity_.end();)
+        {
+            if (distance(it->first + it->second.count, next_) <= 0)
+                it = parity_.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    std::map<uint32_t, std::vector<char>> packets_;
+    std::map<uint32_t, Parity> parity_;
+    std::vector<char> message_;
+    bool synced_;
+    uint32_t next_{0};
+    uint32_t last_{0};
+    int32_t window_;
+    size_t recovered_{0};
+    size_t lost_{0};
+};
+}
+
+
+#endif
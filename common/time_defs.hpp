@@ -33,7 +33,10 @@
 #endif
 namespace chronos
 {
-typedef std::chrono::system_clock clk;
+/// Time base of the protocol's time stamps and of the time sync: monotonic, so that steps of the system time
+/// don't disturb the playout or the drift estimation. Server and client clocks have different epochs, that's
+/// what the time sync measures.
+typedef std::chrono::steady_clock clk;
 typedef std::chrono::time_point<clk> time_point_clk;
 typedef std::chrono::seconds sec;
 typedef std::chrono::milliseconds msec;
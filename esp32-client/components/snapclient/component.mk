@@ -10,9 +10,12 @@ COMPONENT_PRIV_INCLUDEDIRS  := ../../../common/ ../../../client/ ../libflac/
 COMPONENT_OBJS := ../../../client/player/player.o  \
 					../../../client/controller.o \
 					../../../client/client_connection.o \
+					../../../client/multicast_receiver.o \
 					$(SNAP_CLIENT)/player/esp32_player.o \
 					$(SNAP_CLIENT)/time_provider.o \
 					$(SNAP_CLIENT)/stream.o \
+					$(SNAP_CLIENT)/resampler.o \
+					$(SNAP_CLIENT)/clock_servo.o \
 					$(SNAP_COMMON)/sample_format.o \
 					./esp32-workaround.o \
 					$(SNAP_CLIENT)/decoder/pcm_decoder.o \
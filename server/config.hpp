@@ -217,7 +217,7 @@ struct Snapserver : public Snapcast
 
 struct ClientInfo
 {
-    ClientInfo(const std::string& _clientId = "") : id(_clientId), connected(false)
+    ClientInfo(const std::string& _clientId = "") : id(_clientId), connected(false), xruns(0)
     {
         lastSeen.tv_sec = 0;
         lastSeen.tv_usec = 0;
@@ -244,6 +244,7 @@ struct ClientInfo
         j["lastSeen"]["sec"] = lastSeen.tv_sec;
         j["lastSeen"]["usec"] = lastSeen.tv_usec;
         j["connected"] = connected;
+        j["xruns"] = xruns;
         return j;
     }
 
@@ -253,6 +254,8 @@ struct ClientInfo
     ClientConfig config;
     timeval lastSeen;
     bool connected;
+    /// Buffer underruns reported by the client for the current connection
+    uint32_t xruns;
 };
 
 
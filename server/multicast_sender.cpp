@@ -0,0 +1,58 @@
+/***
+    This file is part of snapcast
+    Copyright (C) 2014-2019  Johannes Pohl
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include "multicast_sender.hpp"
+#include "common/aixlog.hpp"
+#include "common/snap_exception.hpp"
+
+using namespace std;
+
+
+MulticastSender::MulticastSender(boost::asio::io_context& io_context, const std::string& address, size_t port, size_t fecGroup)
+    : socket_(io_context), encoder_(fecGroup), error_(false), messages_(0)
+{
+    boost::asio::ip::address group = boost::asio::ip::make_address(address);
+    if (!group.is_multicast())
+        throw SnapException("Not a multicast address: " + address);
+    endpoint_ = udp::endpoint(group, port);
+    socket_.open(endpoint_.protocol());
+    socket_.set_option(boost::asio::ip::multicast::hops(1));
+    socket_.set_option(boost::asio::ip::multicast::enable_loopback(true));
+    LOG(INFO) << "Multicast sender for address: " << address << ", port: " << port << ", FEC group: " << fecGroup << "\n";
+}
+
+
+void MulticastSender::send(const msg::BaseMessage& message)
+{
+    // Only clients that support the compact header can join multicast groups
+    buffer_.resize(msg::BaseMessage::headerSize(message.type, msg::protocol_v3) + message.getSize());
+    msg::BufferWriter writer(buffer_.data(), buffer_.data() + buffer_.size(), msg::protocol_v3);
+    message.serialize(writer);
+
+    encoder_.encode(buffer_.data(), buffer_.size(), [this](const char* data, size_t size) {
+        boost::system::error_code ec;
+        socket_.send_to(boost::asio::buffer(data, size), endpoint_, 0, ec);
+        // log only state changes, not every datagram
+        if (ec && !error_)
+            LOG(ERROR) << "Error sending to multicast group " << endpoint_ << ": " << ec.message() << "\n";
+        else if (!ec && error_)
+            LOG(INFO) << "Sending to multicast group " << endpoint_ << " recovered\n";
+        error_ = static_cast<bool>(ec);
+    });
+    ++messages_;
+}
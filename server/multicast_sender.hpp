@@ -0,0 +1,70 @@
+/***
+    This file is part of snapcast
+    Copyright (C) 2014-2019  Johannes Pohl
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#ifndef MULTICAST_SENDER_H
+#define MULTICAST_SENDER_H
+
+#include <atomic>
+#include <boost/asio.hpp>
+#include <string>
+#include <vector>
+
+#include "common/multicast.hpp"
+#include "message/message.hpp"
+
+
+using boost::asio::ip::udp;
+
+
+/// Publishes the audio chunks of one stream to a multicast group
+/**
+ * Messages are split into datagrams with sequence numbers and are protected
+ * by XOR parity datagrams (see mcast::Encoder).
+ * The clients join the group and receive the chunks only once per network,
+ * instead of one TCP copy per client.
+ */
+class MulticastSender
+{
+public:
+    MulticastSender(boost::asio::io_context& io_context, const std::string& address, size_t port, size_t fecGroup);
+
+    /// Publish "message", called from the stream reader thread
+    void send(const msg::BaseMessage& message);
+
+    const udp::endpoint& getEndpoint() const
+    {
+        return endpoint_;
+    }
+
+    /// Number of messages published so far
+    size_t getMessages() const
+    {
+        return messages_;
+    }
+
+private:
+    udp::socket socket_;
+    udp::endpoint endpoint_;
+    mcast::Encoder encoder_;
+    std::vector<char> buffer_;
+    bool error_;
+    std::atomic<size_t> messages_;
+};
+
+
+#endif
@@ -48,6 +48,12 @@ struct ServerSettings
         std::string sampleFormat{"48000:16:2"};
         size_t streamReadMs{20};
         bool sendAudioToMutedClients{false};
+        size_t sendQueueMs{0};
+        size_t shards{0};
+        size_t readerThreads{2};
+        std::string multicast{""};
+        size_t multicastPort{1706};
+        size_t multicastFec{4};
         std::vector<std::string> bind_to_address{{"0.0.0.0"}};
     };
 
@@ -24,6 +24,7 @@
 #ifdef HAS_DAEMON
 #include "common/daemon.hpp"
 #endif
+#include "common/multicast.hpp"
 #include "common/sample_format.hpp"
 #include "common/signal_handler.hpp"
 #include "common/snap_exception.hpp"
@@ -82,14 +83,26 @@ int main(int argc, char* argv[])
             &pcmStream);
         size_t num_threads = 2;
         conf.add<Value<size_t>>("", "server.threads", "number of server threads", num_threads, &num_threads);
+        conf.add<Value<size_t>>("", "stream.shards", "number of stream session shards, each with its own thread and acceptor (0 = disabled)",
+                                settings.stream.shards, &settings.stream.shards);
+        conf.add<Value<size_t>>("", "stream.reader_threads", "number of threads that read and encode the streams", settings.stream.readerThreads,
+                                &settings.stream.readerThreads);
 
         conf.add<Value<string>>("", "stream.sampleformat", "Default sample format", settings.stream.sampleFormat, &settings.stream.sampleFormat);
-        conf.add<Value<string>>("c", "stream.codec", "Default transport codec\n(flac|ogg|opus|pcm)[:options]\nType codec:? to get codec specific options",
+        conf.add<Value<string>>("c", "stream.codec", "Default transport codec\n(flac|ogg|opus|pcm)[:options]\nType codec:? to get codec specific options\nSeveral codecs: opus|pcm",
                                 settings.stream.codec, &settings.stream.codec);
         conf.add<Value<size_t>>("", "stream.stream_buffer", "Default stream read buffer [ms]", settings.stream.streamReadMs, &settings.stream.streamReadMs);
         conf.add<Value<int>>("b", "stream.buffer", "Buffer [ms]", settings.stream.bufferMs, &settings.stream.bufferMs);
         conf.add<Value<bool>>("", "stream.send_to_muted", "Send audio to muted clients", settings.stream.sendAudioToMutedClients,
                               &settings.stream.sendAudioToMutedClients);
+        conf.add<Value<size_t>>("", "stream.send_queue", "Max. queued audio per client [ms], older chunks are dropped (0 = buffer)",
+                                settings.stream.sendQueueMs, &settings.stream.sendQueueMs);
+        conf.add<Value<string>>("", "stream.multicast", "multicast group address for the audio (empty = disabled)", settings.stream.multicast,
+                                &settings.stream.multicast);
+        conf.add<Value<size_t>>("", "stream.multicast_port", "multicast port of the first stream, the following streams use the next ports",
+                                settings.stream.multicastPort, &settings.stream.multicastPort);
+        conf.add<Value<size_t>>("", "stream.multicast_fec", "number of datagrams protected by one parity datagram (0 = no FEC)",
+                                settings.stream.multicastFec, &settings.stream.multicastFec);
         auto stream_bind_to_address = conf.add<Value<string>>("", "stream.bind_to_address", "address for the server to listen on",
                                                               settings.stream.bind_to_address.front(), &settings.stream.bind_to_address[0]);
 
@@ -264,6 +277,15 @@ int main(int argc, char* argv[])
             settings.stream.bufferMs = 400;
         }
 
+        if (settings.stream.sendQueueMs == 0)
+            settings.stream.sendQueueMs = settings.stream.bufferMs;
+
+        if (settings.stream.multicastFec > mcast::kMaxFecGroup)
+        {
+            LOG(WARNING) << "Multicast FEC group is larger than " << mcast::kMaxFecGroup << ", changing to " << mcast::kMaxFecGroup << "\n";
+            settings.stream.multicastFec = mcast::kMaxFecGroup;
+        }
+
         boost::asio::io_context io_context;
         std::unique_ptr<StreamServer> streamServer(new StreamServer(io_context, settings));
         streamServer->start();
@@ -19,9 +19,11 @@
 #include "stream_server.hpp"
 #include "common/aixlog.hpp"
 #include "config.hpp"
+#include "message/client_info.hpp"
 #include "message/hello.hpp"
 #include "message/stream_tags.hpp"
 #include "message/time.hpp"
+#include <algorithm>
 #include <iostream>
 
 using namespace std;
@@ -29,7 +31,13 @@ using namespace std;
 using json = nlohmann::json;
 
 
-StreamServer::StreamServer(boost::asio::io_context& io_context, const ServerSettings& serverSettings) : io_context_(io_context), settings_(serverSettings)
+/// Reports of a multicast client in a row without a received chunk, before the client is switched to TCP
+static constexpr size_t max_multicast_misses = 3;
+
+
+StreamServer::StreamServer(boost::asio::io_context& io_context, const ServerSettings& serverSettings)
+    : sessions_(make_shared<session_list>()), routing_(make_shared<routing_table>()), multicastSenders_(make_shared<multicast_senders>()),
+      io_context_(io_context), settings_(serverSettings)
 {
 }
 
@@ -37,15 +45,176 @@ StreamServer::StreamServer(boost::asio::io_context& io_context, const ServerSett
 StreamServer::~StreamServer() = default;
 
 
-void StreamServer::cleanup()
+void StreamServer::cleanup(session_list& sessions) const
 {
-    auto new_end = std::remove_if(sessions_.begin(), sessions_.end(), [](std::weak_ptr<StreamSession> session) { return session.expired(); });
-    auto count = distance(new_end, sessions_.end());
+    auto new_end = std::remove_if(sessions.begin(), sessions.end(), [](const std::weak_ptr<StreamSession>& session) { return session.expired(); });
+    auto count = distance(new_end, sessions.end());
     if (count > 0)
     {
-        SLOG(ERROR) << "Removing " << count << " inactive session(s), active sessions: " << sessions_.size() - count << "\n";
-        sessions_.erase(new_end, sessions_.end());
+        SLOG(ERROR) << "Removing " << count << " inactive session(s), active sessions: " << sessions.size() - count << "\n";
+        sessions.erase(new_end, sessions.end());
+    }
+}
+
+
+void StreamServer::updateRouting()
+{
+    auto routing = make_shared<routing_table>();
+    std::lock_guard<std::mutex> mlock(routingMutex_);
+    PcmStreamPtr defaultStream = streamManager_ ? streamManager_->getDefaultStream() : nullptr;
+    auto sessions = std::atomic_load(&sessions_);
+    for (const auto& s : *sessions)
+    {
+        auto session = s.lock();
+        if (!session || session->multicast)
+            continue;
+
+        if (!settings_.stream.sendAudioToMutedClients)
+        {
+            GroupPtr group = Config::instance().getGroupFromClient(session->clientId);
+            if (group)
+            {
+                if (group->muted)
+                    continue;
+
+                std::lock_guard<std::recursive_mutex> lock(clientMutex_);
+                ClientInfoPtr client = group->getClient(session->clientId);
+                if (client && client->config.volume.muted)
+                    continue;
+            }
+        }
+
+        PcmStreamPtr stream = session->pcmStream() ? session->pcmStream() : defaultStream;
+        if (!stream)
+            continue;
+
+        size_t shard = 0;
+        for (size_t n = 0; n < shards_.size(); ++n)
+        {
+            if (&shards_[n]->io_context == &session->getIoContext())
+                shard = n;
+        }
+        // while switching along its ladder, the session receives the chunks of both encodings
+        for (size_t encoding : session->pcmStream() ? session->routedEncodings() : std::vector<size_t>{0})
+        {
+            auto& shardSessions = (*routing)[std::make_pair(stream.get(), encoding)];
+            shardSessions.resize(std::max<size_t>(shards_.size(), 1));
+            shardSessions[shard].push_back(session);
+        }
     }
+    std::atomic_store(&routing_, std::shared_ptr<const routing_table>(routing));
+}
+
+
+void StreamServer::setStream(StreamSession& session, const PcmStreamPtr& stream) const
+{
+    bool multicast = useMulticast(session, stream.get());
+    // the initial server settings are sent by the Hello handler
+    bool switchGroup = session.pcmStream() && (multicast || session.multicast);
+    session.multicast = multicast;
+    if (switchGroup)
+        sendServerSettings(session, stream.get());
+
+    size_t encoding = session.multicast ? 0 : stream->getEncoding(session.codecs);
+    session.sendAsync(stream->getMeta());
+    session.sendAsync(stream->getHeader(encoding));
+    session.setPcmStream(stream, encoding);
+}
+
+
+bool StreamServer::useMulticast(const StreamSession& session, const PcmStream* stream) const
+{
+    if (!session.multicastRequested)
+        return false;
+    // the group carries the stream's first encoding only, a client that can't decode it stays on TCP. No codecs means unknown
+    if (!session.codecs.empty() && (std::find(session.codecs.begin(), session.codecs.end(), stream->getCodec(0)) == session.codecs.end()))
+        return false;
+    auto senders = std::atomic_load(&multicastSenders_);
+    return (senders->find(stream) != senders->end());
+}
+
+
+void StreamServer::sendServerSettings(StreamSession& session, const PcmStream* stream) const
+{
+    ClientInfoPtr client = Config::instance().getClientInfo(session.clientId);
+    if (client == nullptr)
+        return;
+    GroupPtr group = Config::instance().getGroupFromClient(client);
+    auto serverSettings = make_shared<msg::ServerSettings>();
+    serverSettings->setBufferMs(settings_.stream.bufferMs);
+    serverSettings->setVolume(client->config.volume.percent);
+    serverSettings->setMuted(client->config.volume.muted || (group && group->muted));
+    serverSettings->setLatency(client->config.latency);
+    setMulticast(*serverSettings, session, stream);
+    session.sendAsync(serverSettings);
+}
+
+
+void StreamServer::setMulticast(msg::ServerSettings& serverSettings, const StreamSession& session, const PcmStream* stream) const
+{
+    if (!session.multicast)
+        return;
+    auto senders = std::atomic_load(&multicastSenders_);
+    auto sender = senders->find(stream);
+    if (sender != senders->end())
+        serverSettings.setMulticast(sender->second->getEndpoint().address().to_string(), sender->second->getEndpoint().port());
+}
+
+
+void StreamServer::addMulticastSender(const PcmStream* stream)
+{
+    if (settings_.stream.multicast.empty())
+        return;
+
+    std::lock_guard<std::mutex> lock(multicastMutex_);
+    auto senders = make_shared<multicast_senders>(*std::atomic_load(&multicastSenders_));
+    // every stream has its own port, the first free one starting at multicast_port
+    size_t port = settings_.stream.multicastPort;
+    auto used = [&senders](size_t port) {
+        return std::any_of(senders->begin(), senders->end(), [port](const multicast_senders::value_type& sender) { return sender.second->getEndpoint().port() == port; });
+    };
+    while (used(port))
+        ++port;
+    (*senders)[stream] = make_shared<MulticastSender>(io_context_, settings_.stream.multicast, port, settings_.stream.multicastFec);
+    std::atomic_store(&multicastSenders_, std::shared_ptr<const multicast_senders>(senders));
+}
+
+
+void StreamServer::removeMulticastSender(const PcmStream* stream)
+{
+    std::lock_guard<std::mutex> lock(multicastMutex_);
+    auto senders = make_shared<multicast_senders>(*std::atomic_load(&multicastSenders_));
+    if (senders->erase(stream) > 0)
+        std::atomic_store(&multicastSenders_, std::shared_ptr<const multicast_senders>(senders));
+}
+
+
+void StreamServer::checkMulticast(StreamSession& session, const msg::ClientInfo& clientInfo)
+{
+    if (!session.multicast || !session.pcmStream() || (clientInfo.getMulticastChunks() < 0))
+        return;
+
+    auto senders = std::atomic_load(&multicastSenders_);
+    auto sender = senders->find(session.pcmStream().get());
+    if (sender == senders->end())
+        return;
+
+    // chunks have been published since the last report, but none arrived
+    size_t sent = sender->second->getMessages();
+    if ((clientInfo.getMulticastChunks() == 0) && (sent > session.multicastSent))
+        ++session.multicastMisses;
+    else
+        session.multicastMisses = 0;
+    session.multicastSent = sent;
+
+    if (session.multicastMisses < max_multicast_misses)
+        return;
+
+    LOG(WARNING) << "Client " << session.clientId << " doesn't receive the multicast group, sending the audio via TCP\n";
+    session.multicastRequested = false;
+    session.multicastMisses = 0;
+    setStream(session, session.pcmStream());
+    updateRouting();
 }
 
 
@@ -59,8 +228,8 @@ void StreamServer::onMetaChanged(const PcmStream* pcmStream)
     const auto meta = pcmStream->getMeta();
     LOG(DEBUG) << "metadata = " << meta->msg.dump(3) << "\n";
 
-    std::lock_guard<std::recursive_mutex> mlock(sessionsMutex_);
-    for (auto s : sessions_)
+    auto sessions = std::atomic_load(&sessions_);
+    for (const auto& s : *sessions)
     {
         if (auto session = s.lock())
         {
@@ -88,51 +257,46 @@ void StreamServer::onStateChanged(const PcmStream* pcmStream, const ReaderState&
 }
 
 
-void StreamServer::onChunkRead(const PcmStream* pcmStream, msg::PcmChunk* chunk, double /*duration*/)
+void StreamServer::onChunkRead(const PcmStream* pcmStream, size_t encoding, msg::PcmChunk* chunk, double duration)
 {
     //	LOG(INFO) << "onChunkRead (" << pcmStream->getName() << "): " << duration << "ms\n";
-    bool isDefaultStream(pcmStream == streamManager_->getDefaultStream().get());
-    unique_ptr<msg::PcmChunk> chunk_ptr(chunk);
-
-    std::ostringstream oss;
+    std::shared_ptr<msg::PcmChunk> chunk_ptr(chunk);
     tv t;
     chunk_ptr->sent = t;
-    chunk_ptr->serialize(oss);
-    shared_const_buffer buffer(oss.str());
-
-    std::vector<std::shared_ptr<StreamSession>> sessions;
+    // the multicast group carries the first encoding only
+    if (encoding == 0)
     {
-        std::lock_guard<std::recursive_mutex> mlock(sessionsMutex_);
-        for (auto session : sessions_)
-            if (auto s = session.lock())
-                sessions.push_back(s);
+        auto senders = std::atomic_load(&multicastSenders_);
+        auto multicast = senders->find(pcmStream);
+        if (multicast != senders->end())
+            multicast->second->send(*chunk_ptr);
     }
 
-    for (auto session : sessions)
-    {
-        if (!settings_.stream.sendAudioToMutedClients)
-        {
-            GroupPtr group = Config::instance().getGroupFromClient(session->clientId);
-            if (group)
-            {
-                if (group->muted)
-                {
-                    continue;
-                }
-                else
-                {
-                    std::lock_guard<std::recursive_mutex> lock(clientMutex_);
-                    ClientInfoPtr client = group->getClient(session->clientId);
-                    if (client && client->config.volume.muted)
-                        continue;
-                }
-            }
-        }
+    auto routing = std::atomic_load(&routing_);
+    auto sessions = routing->find(std::make_pair(pcmStream, encoding));
+    if (sessions == routing->end())
+        return;
 
-        if (!session->pcmStream() && isDefaultStream) //->getName() == "default")
-            session->sendAsync(buffer);
-        else if (session->pcmStream().get() == pcmStream)
+    // Serialize the header once, the payload is shared by all sessions without copying
+    shared_const_buffer buffer(std::shared_ptr<const msg::WireChunk>(std::move(chunk_ptr)), duration, encoding);
+
+    if (shards_.empty())
+    {
+        for (const auto& session : sessions->second.front())
             session->sendAsync(buffer);
+        return;
+    }
+
+    // Shards are single threaded: post one handler per shard, that writes to all of its sessions
+    for (size_t n = 0; n < shards_.size(); ++n)
+    {
+        const auto* shardSessions = &sessions->second[n];
+        if (shardSessions->empty())
+            continue;
+        boost::asio::post(shards_[n]->io_context, [routing, shardSessions, buffer] {
+            for (const auto& session : *shardSessions)
+                session->send(buffer);
+        });
     }
 }
 
@@ -143,23 +307,35 @@ void StreamServer::onResync(const PcmStream* pcmStream, double ms)
 }
 
 
+void StreamServer::onEncodingChanged(StreamSession* /*streamSession*/)
+{
+    updateRouting();
+}
+
+
 void StreamServer::onDisconnect(StreamSession* streamSession)
 {
-    std::lock_guard<std::recursive_mutex> mlock(sessionsMutex_);
     session_ptr session = getStreamSession(streamSession);
 
     if (session == nullptr)
         return;
 
     LOG(INFO) << "onDisconnect: " << session->clientId << "\n";
-    LOG(DEBUG) << "sessions: " << sessions_.size() << "\n";
-    sessions_.erase(std::remove_if(sessions_.begin(), sessions_.end(),
-                                   [streamSession](std::weak_ptr<StreamSession> session) {
-                                       auto s = session.lock();
-                                       return s.get() == streamSession;
-                                   }),
-                    sessions_.end());
-    LOG(DEBUG) << "sessions: " << sessions_.size() << "\n";
+    {
+        std::lock_guard<std::mutex> mlock(sessionsMutex_);
+        auto sessions = make_shared<session_list>(*std::atomic_load(&sessions_));
+        LOG(DEBUG) << "sessions: " << sessions->size() << "\n";
+        sessions->erase(std::remove_if(sessions->begin(), sessions->end(),
+                                       [streamSession](const std::weak_ptr<StreamSession>& session) {
+                                           auto s = session.lock();
+                                           return s.get() == streamSession;
+                                       }),
+                        sessions->end());
+        cleanup(*sessions);
+        LOG(DEBUG) << "sessions: " << sessions->size() << "\n";
+        std::atomic_store(&sessions_, std::shared_ptr<const session_list>(sessions));
+    }
+    updateRouting();
 
     // notify controllers if not yet done
     ClientInfoPtr clientInfo = Config::instance().getClientInfo(session->clientId);
@@ -186,11 +362,10 @@ void StreamServer::onDisconnect(StreamSession* streamSession)
             // cout << "Notification: " << notification.dump() << "\n";
         }
     }
-    cleanup();
 }
 
 
-void StreamServer::ProcessRequest(const jsonrpcpp::request_ptr request, jsonrpcpp::entity_ptr& response, jsonrpcpp::notification_ptr& notification) const
+void StreamServer::ProcessRequest(const jsonrpcpp::request_ptr request, jsonrpcpp::entity_ptr& response, jsonrpcpp::notification_ptr& notification)
 {
     try
     {
@@ -207,9 +382,15 @@ void StreamServer::ProcessRequest(const jsonrpcpp::request_ptr request, jsonrpcp
             {
                 // clang-format off
                 // Request:  {"id":8,"jsonrpc":"2.0","method":"Client.GetStatus","params":{"id":"00:21:6a:7d:74:fc"}}
-                // Response: {"id":8,"jsonrpc":"2.0","result":{"client":{"config":{"instance":1,"latency":0,"name":"","volume":{"muted":false,"percent":74}},"connected":true,"host":{"arch":"x86_64","ip":"127.0.0.1","mac":"00:21:6a:7d:74:fc","name":"T400","os":"Linux Mint 17.3 Rosa"},"id":"00:21:6a:7d:74:fc","lastSeen":{"sec":1488026416,"usec":135973},"snapclient":{"name":"Snapclient","protocolVersion":2,"version":"0.10.0"}}}}
+                // Response: {"id":8,"jsonrpc":"2.0","result":{"client":{"config":{"instance":1,"latency":0,"name":"","volume":{"muted":false,"percent":74}},"connected":true,"host":{"arch":"x86_64","ip":"127.0.0.1","mac":"00:21:6a:7d:74:fc","name":"T400","os":"Linux Mint 17.3 Rosa"},"id":"00:21:6a:7d:74:fc","lastSeen":{"sec":1488026416,"usec":135973},"snapclient":{"name":"Snapclient","protocolVersion":2,"version":"0.10.0"}},"health":{"buffer":987,"encoding":0,"rtt":2,"switches":0},"queue":{"dropped":0,"ms":20,"size":1}}}
                 // clang-format on
                 result["client"] = clientInfo->toJson();
+                session_ptr session = getStreamSession(clientInfo->id);
+                if (session != nullptr)
+                {
+                    result["queue"] = session->getQueueStats();
+                    result["health"] = session->getHealth();
+                }
             }
             else if (request->method() == "Client.SetVolume")
             {
@@ -270,6 +451,7 @@ void StreamServer::ProcessRequest(const jsonrpcpp::request_ptr request, jsonrpcp
                     GroupPtr group = Config::instance().getGroupFromClient(clientInfo);
                     serverSettings->setMuted(clientInfo->config.volume.muted || group->muted);
                     serverSettings->setLatency(clientInfo->config.latency);
+                    setMulticast(*serverSettings, *session, session->pcmStream().get());
                     session->sendAsync(serverSettings);
                 }
             }
@@ -321,6 +503,7 @@ void StreamServer::ProcessRequest(const jsonrpcpp::request_ptr request, jsonrpcp
                         GroupPtr group = Config::instance().getGroupFromClient(client);
                         serverSettings->setMuted(client->config.volume.muted || group->muted);
                         serverSettings->setLatency(client->config.latency);
+                        setMulticast(*serverSettings, *session, session->pcmStream().get());
                         session->sendAsync(serverSettings);
                     }
                 }
@@ -347,11 +530,7 @@ void StreamServer::ProcessRequest(const jsonrpcpp::request_ptr request, jsonrpcp
                 {
                     session_ptr session = getStreamSession(client->id);
                     if (session && (session->pcmStream() != stream))
-                    {
-                        session->sendAsync(stream->getMeta());
-                        session->sendAsync(stream->getHeader());
-                        session->setPcmStream(stream);
-                    }
+                        setStream(*session, stream);
                 }
 
                 // Notify others
@@ -402,11 +581,7 @@ void StreamServer::ProcessRequest(const jsonrpcpp::request_ptr request, jsonrpcp
                     // assign new stream
                     session_ptr session = getStreamSession(client->id);
                     if (session && stream && (session->pcmStream() != stream))
-                    {
-                        session->sendAsync(stream->getMeta());
-                        session->sendAsync(stream->getHeader());
-                        session->setPcmStream(stream);
-                    }
+                        setStream(*session, stream);
                 }
 
                 if (group->empty())
@@ -426,11 +601,11 @@ void StreamServer::ProcessRequest(const jsonrpcpp::request_ptr request, jsonrpcp
             if (request->method().find("Server.GetRPCVersion") == 0)
             {
                 // Request:      {"id":8,"jsonrpc":"2.0","method":"Server.GetRPCVersion"}
-                // Response:     {"id":8,"jsonrpc":"2.0","result":{"major":2,"minor":0,"patch":0}}
+                // Response:     {"id":8,"jsonrpc":"2.0","result":{"major":2,"minor":1,"patch":0}}
                 // <major>: backwards incompatible change
                 result["major"] = 2;
                 // <minor>: feature addition to the API
-                result["minor"] = 0;
+                result["minor"] = 1;
                 // <patch>: bugfix release
                 result["patch"] = 0;
             }
@@ -466,7 +641,19 @@ void StreamServer::ProcessRequest(const jsonrpcpp::request_ptr request, jsonrpcp
         }
         else if (request->method().find("Stream.") == 0)
         {
-            if (request->method().find("Stream.SetMeta") == 0)
+            if (request->method() == "Stream.GetStatus")
+            {
+                // clang-format off
+                // Request:      {"id":4,"jsonrpc":"2.0","method":"Stream.GetStatus","params":{"id":"Spotify"}}
+                // Response:     {"id":4,"jsonrpc":"2.0","result":{"stream":{"cpu":{"percent":0.8,"usec":123456},"id":"Spotify","status":"playing","uri":{...}}}}
+                // clang-format on
+
+                PcmStreamPtr stream = streamManager_->getStream(request->params().get<std::string>("id"));
+                if (stream == nullptr)
+                    throw jsonrpcpp::InternalErrorException("Stream not found", request->id());
+                result["stream"] = stream->toJson();
+            }
+            else if (request->method().find("Stream.SetMeta") == 0)
             {
                 /// Request:      {"id":4,"jsonrpc":"2.0","method":"Stream.SetMeta","params":{"id":"Spotify",
                 ///                "meta": {"album": "some album", "artist": "some artist", "track": "some track"...}}}
@@ -504,6 +691,14 @@ void StreamServer::ProcessRequest(const jsonrpcpp::request_ptr request, jsonrpcp
                 PcmStreamPtr stream = streamManager_->addStream(streamUri);
                 if (stream == nullptr)
                     throw jsonrpcpp::InternalErrorException("Stream not created", request->id());
+                try
+                {
+                    addMulticastSender(stream.get());
+                }
+                catch (const std::exception& e)
+                {
+                    LOG(ERROR) << "Failed to create multicast sender for stream " << stream->getId() << ": " << e.what() << "\n";
+                }
                 stream->start(); // We start the stream, otherwise it would be silent
                 // Setup response
                 result["id"] = stream->getId();
@@ -521,7 +716,10 @@ void StreamServer::ProcessRequest(const jsonrpcpp::request_ptr request, jsonrpcp
 
                 // Find stream
                 string streamId = request->params().get("id");
+                PcmStreamPtr stream = streamManager_->getStream(streamId);
                 streamManager_->removeStream(streamId);
+                if (stream)
+                    removeMulticastSender(stream.get());
                 // Setup response
                 result["id"] = streamId;
             }
@@ -572,6 +770,7 @@ std::string StreamServer::onMessageReceived(ControlSession* controlSession, cons
         jsonrpcpp::request_ptr request = dynamic_pointer_cast<jsonrpcpp::Request>(entity);
         ProcessRequest(request, response, notification);
         Config::instance().save();
+        updateRouting();
         ////cout << "Request:      " << request->to_json().dump() << "\n";
         if (notification)
         {
@@ -604,6 +803,7 @@ std::string StreamServer::onMessageReceived(ControlSession* controlSession, cons
             }
         }
         Config::instance().save();
+        updateRouting();
         if (!notificationBatch.entities.empty())
             controlServer_->send(notificationBatch.to_json().dump(), controlSession);
         if (!responseBatch.entities.empty())
@@ -642,7 +842,10 @@ void StreamServer::onMessageReceived(StreamSession* streamSession, const msg::Ba
     {
         msg::Hello helloMsg;
         helloMsg.deserialize(baseMessage, buffer);
+        // All messages from now on are sent with the compact header, if the client supports it
+        streamSession->protocolVersion = (helloMsg.getProtocolVersion() >= msg::protocol_v3) ? msg::protocol_v3 : msg::protocol_v2;
         streamSession->clientId = helloMsg.getUniqueId();
+        streamSession->codecs = helloMsg.getCodecs();
         LOG(INFO) << "Hello from " << streamSession->clientId << ", host: " << helloMsg.getHostName() << ", v" << helloMsg.getVersion()
                   << ", ClientName: " << helloMsg.getClientName() << ", OS: " << helloMsg.getOS() << ", Arch: " << helloMsg.getArch()
                   << ", Protocol version: " << helloMsg.getProtocolVersion() << "\n";
@@ -659,12 +862,24 @@ void StreamServer::onMessageReceived(StreamSession* streamSession, const msg::Ba
 
         ClientInfoPtr client = group->getClient(streamSession->clientId);
 
+        // Assign and update stream
+        PcmStreamPtr stream = streamManager_->getStream(group->streamId);
+        if (!stream)
+        {
+            stream = streamManager_->getDefaultStream();
+            group->streamId = stream->getId();
+        }
+        LOG(DEBUG) << "Group: " << group->id << ", stream: " << group->streamId << "\n";
+        streamSession->multicastRequested = helloMsg.isMulticast();
+        streamSession->multicast = useMulticast(*streamSession, stream.get());
+
         LOG(DEBUG) << "request kServerSettings\n";
         auto serverSettings = make_shared<msg::ServerSettings>();
         serverSettings->setVolume(client->config.volume.percent);
         serverSettings->setMuted(client->config.volume.muted || group->muted);
         serverSettings->setLatency(client->config.latency);
         serverSettings->setBufferMs(settings_.stream.bufferMs);
+        setMulticast(*serverSettings, *streamSession, stream.get());
         serverSettings->refersTo = helloMsg.id;
         streamSession->sendAsync(serverSettings);
 
@@ -678,23 +893,15 @@ void StreamServer::onMessageReceived(StreamSession* streamSession, const msg::Ba
         client->snapclient.protocolVersion = helloMsg.getProtocolVersion();
         client->config.instance = helloMsg.getInstance();
         client->connected = true;
+        client->xruns = 0;
         chronos::systemtimeofday(&client->lastSeen);
 
-        // Assign and update stream
-        PcmStreamPtr stream = streamManager_->getStream(group->streamId);
-        if (!stream)
-        {
-            stream = streamManager_->getDefaultStream();
-            group->streamId = stream->getId();
-        }
-        LOG(DEBUG) << "Group: " << group->id << ", stream: " << group->streamId << "\n";
-
         Config::instance().save();
 
-        streamSession->sendAsync(stream->getMeta());
-        streamSession->setPcmStream(stream);
-        auto headerChunk = stream->getHeader();
-        streamSession->sendAsync(headerChunk);
+        setStream(*streamSession, stream);
+        LOG(INFO) << "Client " << streamSession->clientId << " receives stream " << stream->getId() << " as " << stream->getCodec(streamSession->encoding())
+                  << "\n";
+        updateRouting();
 
         if (newGroup)
         {
@@ -717,15 +924,28 @@ void StreamServer::onMessageReceived(StreamSession* streamSession, const msg::Ba
         //		cout << Config::instance().getServerStatus(streamManager_->toJson()).dump(4) << "\n";
         //		cout << group->toJson().dump(4) << "\n";
     }
+    else if (baseMessage.type == message_type::kClientInfo)
+    {
+        msg::ClientInfo infoMsg;
+        infoMsg.deserialize(baseMessage, buffer);
+        ClientInfoPtr client = Config::instance().getClientInfo(streamSession->clientId);
+        if (client == nullptr)
+            return;
+
+        if (infoMsg.getXruns() != client->xruns)
+            LOG(WARNING) << "Client " << client->id << " reports " << infoMsg.getXruns() << " xruns\n";
+        client->xruns = infoMsg.getXruns();
+        streamSession->reportHealth(infoMsg.getBufferMs(), infoMsg.getRtt());
+        checkMulticast(*streamSession, infoMsg);
+    }
 }
 
 
 
 session_ptr StreamServer::getStreamSession(StreamSession* streamSession) const
 {
-    std::lock_guard<std::recursive_mutex> mlock(sessionsMutex_);
-
-    for (auto session : sessions_)
+    auto sessions = std::atomic_load(&sessions_);
+    for (const auto& session : *sessions)
     {
         if (auto s = session.lock())
             if (s.get() == streamSession)
@@ -738,8 +958,8 @@ session_ptr StreamServer::getStreamSession(StreamSession* streamSession) const
 session_ptr StreamServer::getStreamSession(const std::string& clientId) const
 {
     //	LOG(INFO) << "getStreamSession: " << mac << "\n";
-    std::lock_guard<std::recursive_mutex> mlock(sessionsMutex_);
-    for (auto session : sessions_)
+    auto sessions = std::atomic_load(&sessions_);
+    for (const auto& session : *sessions)
     {
         if (auto s = session.lock())
             if (s->clientId == clientId)
@@ -749,21 +969,21 @@ session_ptr StreamServer::getStreamSession(const std::string& clientId) const
 }
 
 
-void StreamServer::startAccept()
+void StreamServer::startAccept(tcp::acceptor& acceptor, size_t shard)
 {
-    auto accept_handler = [this](error_code ec, tcp::socket socket) {
+    acceptor.async_accept([this, &acceptor, shard](error_code ec, tcp::socket socket) {
         if (!ec)
-            handleAccept(std::move(socket));
+        {
+            handleAccept(std::move(socket), shard);
+            startAccept(acceptor, shard);
+        }
         else
             LOG(ERROR) << "Error while accepting socket connection: " << ec.message() << "\n";
-    };
-
-    for (auto& acceptor : acceptor_)
-        acceptor->async_accept(accept_handler);
+    });
 }
 
 
-void StreamServer::handleAccept(tcp::socket socket)
+void StreamServer::handleAccept(tcp::socket socket, size_t shard)
 {
     try
     {
@@ -777,20 +997,73 @@ void StreamServer::handleAccept(tcp::socket socket)
         socket.set_option(tcp::no_delay(true));
 
         SLOG(NOTICE) << "StreamServer::NewConnection: " << socket.remote_endpoint().address().to_string() << endl;
-        shared_ptr<StreamSession> session = make_shared<StreamSession>(io_context_, this, std::move(socket));
+        boost::asio::io_context& ioc = shards_.empty() ? io_context_ : shards_[shard]->io_context;
+        shared_ptr<StreamSession> session = make_shared<StreamSession>(ioc, this, std::move(socket));
 
         session->setBufferMs(settings_.stream.bufferMs);
+        session->setMaxQueueMs(settings_.stream.sendQueueMs);
         session->start();
 
-        std::lock_guard<std::recursive_mutex> mlock(sessionsMutex_);
-        sessions_.emplace_back(session);
-        cleanup();
+        {
+            std::lock_guard<std::mutex> mlock(sessionsMutex_);
+            auto sessions = make_shared<session_list>(*std::atomic_load(&sessions_));
+            sessions->emplace_back(session);
+            cleanup(*sessions);
+            std::atomic_store(&sessions_, std::shared_ptr<const session_list>(sessions));
+        }
+        updateRouting();
     }
     catch (const std::exception& e)
     {
         SLOG(ERROR) << "Exception in StreamServer::handleAccept: " << e.what() << endl;
     }
-    startAccept();
+}
+
+
+void StreamServer::createAcceptors()
+{
+    for (const auto& address : settings_.stream.bind_to_address)
+    {
+        tcp::endpoint endpoint(boost::asio::ip::address::from_string(address), settings_.stream.port);
+        if (shards_.empty())
+        {
+            try
+            {
+                LOG(INFO) << "Creating stream acceptor for address: " << address << ", port: " << settings_.stream.port << "\n";
+                acceptor_.emplace_back(make_unique<tcp::acceptor>(io_context_, endpoint));
+                startAccept(*acceptor_.back(), 0);
+            }
+            catch (const boost::system::system_error& e)
+            {
+                LOG(ERROR) << "error creating TCP acceptor: " << e.what() << ", code: " << e.code() << "\n";
+            }
+            continue;
+        }
+
+#ifdef SO_REUSEPORT
+        // One acceptor per shard on the same port, the kernel distributes the connections
+        using reuse_port = boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+        for (size_t n = 0; n < shards_.size(); ++n)
+        {
+            try
+            {
+                LOG(INFO) << "Creating stream acceptor for address: " << address << ", port: " << settings_.stream.port << ", shard: " << n << "\n";
+                auto acceptor = make_unique<tcp::acceptor>(shards_[n]->io_context);
+                acceptor->open(endpoint.protocol());
+                acceptor->set_option(tcp::acceptor::reuse_address(true));
+                acceptor->set_option(reuse_port(true));
+                acceptor->bind(endpoint);
+                acceptor->listen();
+                acceptor_.push_back(std::move(acceptor));
+                startAccept(*acceptor_.back(), n);
+            }
+            catch (const boost::system::system_error& e)
+            {
+                LOG(ERROR) << "error creating TCP acceptor: " << e.what() << ", code: " << e.code() << "\n";
+            }
+        }
+#endif
+    }
 }
 
 
@@ -801,7 +1074,7 @@ void StreamServer::start()
         controlServer_.reset(new ControlServer(io_context_, settings_.tcp, settings_.http, this));
         controlServer_->start();
 
-        streamManager_.reset(new StreamManager(this, settings_.stream.sampleFormat, settings_.stream.codec, settings_.stream.streamReadMs));
+        streamManager_.reset(new StreamManager(this, settings_.stream.readerThreads, settings_.stream.sampleFormat, settings_.stream.codec, settings_.stream.streamReadMs));
         //	throw SnapException("xxx");
         for (const auto& streamUri : settings_.stream.pcmStreams)
         {
@@ -809,23 +1082,28 @@ void StreamServer::start()
             if (stream)
                 LOG(INFO) << "Stream: " << stream->getUri().toJson() << "\n";
         }
+
+        for (const auto& stream : streamManager_->getStreams())
+            addMulticastSender(stream.get());
         streamManager_->start();
 
-        for (const auto& address : settings_.stream.bind_to_address)
+#ifndef SO_REUSEPORT
+        if (settings_.stream.shards > 0)
         {
-            try
-            {
-                LOG(INFO) << "Creating stream acceptor for address: " << address << ", port: " << settings_.stream.port << "\n";
-                acceptor_.emplace_back(
-                    make_unique<tcp::acceptor>(io_context_, tcp::endpoint(boost::asio::ip::address::from_string(address), settings_.stream.port)));
-            }
-            catch (const boost::system::system_error& e)
-            {
-                LOG(ERROR) << "error creating TCP acceptor: " << e.what() << ", code: " << e.code() << "\n";
-            }
+            LOG(WARNING) << "SO_REUSEPORT is not supported, disabling stream shards\n";
+            settings_.stream.shards = 0;
         }
+#endif
+        for (size_t n = 0; n < settings_.stream.shards; ++n)
+            shards_.emplace_back(make_unique<Shard>());
 
-        startAccept();
+        createAcceptors();
+
+        for (auto& shard : shards_)
+        {
+            auto* ioc = &shard->io_context;
+            shard->thread = std::thread([ioc] { ioc->run(); });
+        }
     }
     catch (const std::exception& e)
     {
@@ -838,6 +1116,14 @@ void StreamServer::start()
 
 void StreamServer::stop()
 {
+    for (auto& shard : shards_)
+    {
+        shard->work.reset();
+        shard->io_context.stop();
+        if (shard->thread.joinable())
+            shard->thread.join();
+    }
+
     for (auto& acceptor : acceptor_)
         acceptor->cancel();
     acceptor_.clear();
@@ -845,6 +1131,7 @@ void StreamServer::stop()
     if (streamManager_)
     {
         streamManager_->stop();
+        std::atomic_store(&multicastSenders_, std::shared_ptr<const multicast_senders>(make_shared<multicast_senders>()));
         streamManager_ = nullptr;
     }
 
@@ -854,9 +1141,14 @@ void StreamServer::stop()
         controlServer_ = nullptr;
     }
 
-    std::lock_guard<std::recursive_mutex> mlock(sessionsMutex_);
-    cleanup();
-    for (auto s : sessions_)
+    auto sessions = make_shared<session_list>();
+    {
+        std::lock_guard<std::mutex> mlock(sessionsMutex_);
+        *sessions = *std::atomic_load(&sessions_);
+        cleanup(*sessions);
+        std::atomic_store(&sessions_, std::shared_ptr<const session_list>(sessions));
+    }
+    for (const auto& s : *sessions)
     {
         if (auto session = s.lock())
             session->stop();
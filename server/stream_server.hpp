@@ -20,6 +20,7 @@
 #define STREAM_SERVER_H
 
 #include <boost/asio.hpp>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <set>
@@ -31,9 +32,11 @@
 #include "common/sample_format.hpp"
 #include "control_server.hpp"
 #include "jsonrpcpp.hpp"
+#include "message/client_info.hpp"
 #include "message/codec_header.hpp"
 #include "message/message.hpp"
 #include "message/server_settings.hpp"
+#include "multicast_sender.hpp"
 #include "server_settings.hpp"
 #include "stream_session.hpp"
 #include "streamreader/stream_manager.hpp"
@@ -42,6 +45,11 @@
 using boost::asio::ip::tcp;
 using acceptor_ptr = std::unique_ptr<tcp::acceptor>;
 using session_ptr = std::shared_ptr<StreamSession>;
+using session_list = std::vector<std::weak_ptr<StreamSession>>;
+/// Sessions that receive the audio of a stream in one of its encodings, grouped by the shard they are running on
+using routing_table = std::map<std::pair<const PcmStream*, size_t>, std::vector<std::vector<session_ptr>>>;
+/// Multicast sender per stream
+using multicast_senders = std::map<const PcmStream*, std::shared_ptr<MulticastSender>>;
 
 
 /// Forwars PCM data to the connected clients
@@ -66,6 +74,7 @@ public:
     /// Clients call this when they receive a message. Implementation of MessageReceiver::onMessageReceived
     void onMessageReceived(StreamSession* connection, const msg::BaseMessage& baseMessage, char* buffer) override;
     void onDisconnect(StreamSession* connection) override;
+    void onEncodingChanged(StreamSession* connection) override;
 
     /// Implementation of ControllMessageReceiver::onMessageReceived, called by ControlServer::onMessageReceived
     std::string onMessageReceived(ControlSession* connection, const std::string& message) override;
@@ -73,20 +82,60 @@ public:
     /// Implementation of PcmListener
     void onMetaChanged(const PcmStream* pcmStream) override;
     void onStateChanged(const PcmStream* pcmStream, const ReaderState& state) override;
-    void onChunkRead(const PcmStream* pcmStream, msg::PcmChunk* chunk, double duration) override;
+    void onChunkRead(const PcmStream* pcmStream, size_t encoding, msg::PcmChunk* chunk, double duration) override;
     void onResync(const PcmStream* pcmStream, double ms) override;
 
 private:
-    void startAccept();
-    void handleAccept(tcp::socket socket);
+    /// io_context with its own thread, the stream sessions accepted on it stay on it
+    struct Shard
+    {
+        Shard() : work(boost::asio::make_work_guard(io_context))
+        {
+        }
+
+        boost::asio::io_context io_context;
+        boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work;
+        std::thread thread;
+    };
+
+    void startAccept(tcp::acceptor& acceptor, size_t shard);
+    void handleAccept(tcp::socket socket, size_t shard);
+    void createAcceptors();
     session_ptr getStreamSession(const std::string& mac) const;
     session_ptr getStreamSession(StreamSession* session) const;
-    void ProcessRequest(const jsonrpcpp::request_ptr request, jsonrpcpp::entity_ptr& response, jsonrpcpp::notification_ptr& notification) const;
-    void cleanup();
-
-    mutable std::recursive_mutex sessionsMutex_;
+    void ProcessRequest(const jsonrpcpp::request_ptr request, jsonrpcpp::entity_ptr& response, jsonrpcpp::notification_ptr& notification);
+    /// Remove expired sessions from "sessions"
+    void cleanup(session_list& sessions) const;
+    /// Rebuild and publish the stream => session routing, must be called whenever group/client/mute/stream assignments change
+    void updateRouting();
+    /// Let "session" receive "stream" in the first of the stream's codecs the client supports, sends the metadata and the codec header.
+    /// A multicast session is moved to the stream's group (or to TCP, if the stream has none) before the header is sent
+    void setStream(StreamSession& session, const PcmStreamPtr& stream) const;
+    /// The client asked for multicast, "stream" has a multicast group and the client supports the codec of its first encoding
+    bool useMulticast(const StreamSession& session, const PcmStream* stream) const;
+    /// Send the client's volume, latency and multicast group of "stream"
+    void sendServerSettings(StreamSession& session, const PcmStream* stream) const;
+    /// Add the multicast group of "stream" to "serverSettings", if "session" receives the audio via multicast
+    void setMulticast(msg::ServerSettings& serverSettings, const StreamSession& session, const PcmStream* stream) const;
+    /// Create a multicast sender for "stream" on the first free port, if multicast is enabled
+    void addMulticastSender(const PcmStream* stream);
+    void removeMulticastSender(const PcmStream* stream);
+    /// Fall back to TCP, if the client reports that no multicast chunks arrive
+    void checkMulticast(StreamSession& session, const msg::ClientInfo& clientInfo);
+
+    /// Empty if sharding is disabled, then all sessions run on io_context_
+    std::vector<std::unique_ptr<Shard>> shards_;
+    /// Serializes writers of sessions_, readers don't lock
+    std::mutex sessionsMutex_;
+    std::mutex routingMutex_;
     mutable std::recursive_mutex clientMutex_;
-    std::vector<std::weak_ptr<StreamSession>> sessions_;
+    /// Copy-on-write list of sessions: writers publish a modified copy with std::atomic_store
+    std::shared_ptr<const session_list> sessions_;
+    /// Read by the stream readers without locking, replaced as a whole by updateRouting (use std::atomic_load/store)
+    std::shared_ptr<const routing_table> routing_;
+    /// Read by the stream readers without locking, replaced as a whole when a stream is added or removed (use std::atomic_load/store)
+    std::shared_ptr<const multicast_senders> multicastSenders_;
+    std::mutex multicastMutex_;
     boost::asio::io_context& io_context_;
     std::vector<acceptor_ptr> acceptor_;
 
@@ -20,16 +20,31 @@
 
 #include "common/aixlog.hpp"
 #include "message/pcm_chunk.hpp"
+#include <algorithm>
 #include <iostream>
+#include <limits>
 
 using namespace std;
 
 
+/// Max. number of bytes gathered into a single write
+static constexpr size_t max_write_size = 64 * 1024;
+/// Min. time between two steps down the ladder, to let the queues drain
+static constexpr std::chrono::seconds step_down_interval{3};
+/// Time the session must be healthy, before it steps up the ladder
+static constexpr std::chrono::seconds step_up_interval{20};
+/// A switch happens this many chunks after the last chunk sent, so that the new encoding's chunks are routed to the session in time
+static constexpr int64_t switch_lead = 4;
+/// Max. number of held chunks of the new encoding, the switch is completed if the old encoding doesn't reach the switch point
+static constexpr size_t max_held = 8;
+
+
 StreamSession::StreamSession(boost::asio::io_context& ioc, MessageReceiver* receiver, tcp::socket&& socket)
-    : socket_(std::move(socket)), messageReceiver_(receiver), pcmStream_(nullptr), strand_(ioc)
+    : socket_(std::move(socket)), messageReceiver_(receiver), maxQueueMs_(0), pcmStream_(nullptr), encoding_(0), strand_(ioc), inFlight_(0), queuedMs_(0.),
+      queueSize_(0), queueMs_(0), droppedChunks_(0), sentEncoding_(0), lastTimestamp_(std::numeric_limits<int64_t>::min()), chunkNs_(0), switchAt_(0),
+      lastSwitch_(std::chrono::steady_clock::now()), healthySince_(lastSwitch_), bufferHealthMs_(-1), rttMs_(-1), switches_(0)
 {
-    base_msg_size_ = baseMessage_.getSize();
-    buffer_.resize(base_msg_size_);
+    buffer_.resize(msg::BaseMessage::header_size);
 }
 
 
@@ -52,7 +67,24 @@ void StreamSession::read_next()
         return;
     }
 
-    boost::asio::async_read(socket_, boost::asio::buffer(buffer_, base_msg_size_),
+    // Read the smallest possible header first, it tells the actual header size
+    boost::asio::async_read(socket_, boost::asio::buffer(buffer_, msg::BaseMessage::min_header_size),
+                            boost::asio::bind_executor(strand_, [this, self](boost::system::error_code ec, std::size_t length) mutable {
+                                if (ec)
+                                {
+                                    LOG(ERROR) << "Error reading message header of length " << length << ": " << ec.message() << "\n";
+                                    messageReceiver_->onDisconnect(this);
+                                    return;
+                                }
+                                read_message(msg::BaseMessage::headerSize(buffer_.data()));
+                            }));
+}
+
+
+void StreamSession::read_message(size_t headerSize)
+{
+    auto self = shared_from_this();
+    boost::asio::async_read(socket_, boost::asio::buffer(buffer_.data() + msg::BaseMessage::min_header_size, headerSize - msg::BaseMessage::min_header_size),
                             boost::asio::bind_executor(strand_, [this, self](boost::system::error_code ec, std::size_t length) mutable {
                                 if (ec)
                                 {
@@ -92,17 +124,38 @@ void StreamSession::read_next()
 
                                         tv t;
                                         baseMessage_.received = t;
-                                        if (messageReceiver_ != nullptr)
-                                            messageReceiver_->onMessageReceived(this, baseMessage_, buffer_.data());
+                                        try
+                                        {
+                                            if (messageReceiver_ != nullptr)
+                                                messageReceiver_->onMessageReceived(this, baseMessage_, buffer_.data());
+                                        }
+                                        catch (const std::exception& e)
+                                        {
+                                            LOG(ERROR) << "Error processing message of type " << baseMessage_.type << ": " << e.what() << "\n";
+                                            messageReceiver_->onDisconnect(this);
+                                            return;
+                                        }
                                         read_next();
                                     }));
                             }));
 }
 
 
-void StreamSession::setPcmStream(PcmStreamPtr pcmStream)
+void StreamSession::setPcmStream(PcmStreamPtr pcmStream, size_t encoding)
 {
     pcmStream_ = pcmStream;
+    encoding_ = encoding;
+    sentEncoding_ = encoding;
+    // a multicast client receives the group's encoding, whatever its congestion. The ladder is for TCP sessions only
+    std::vector<size_t> ladder = (pcmStream && !multicast) ? pcmStream->getLadder(encoding) : std::vector<size_t>{encoding};
+    auto self = shared_from_this();
+    strand_.post([this, self, ladder, encoding]() {
+        ladder_ = ladder;
+        sentEncoding_ = encoding;
+        held_.clear();
+        lastTimestamp_ = std::numeric_limits<int64_t>::min();
+        lastSwitch_ = healthySince_ = std::chrono::steady_clock::now();
+    });
 }
 
 
@@ -112,6 +165,22 @@ const PcmStreamPtr StreamSession::pcmStream() const
 }
 
 
+size_t StreamSession::encoding() const
+{
+    return encoding_;
+}
+
+
+std::vector<size_t> StreamSession::routedEncodings() const
+{
+    size_t sent = sentEncoding_;
+    size_t encoding = encoding_;
+    if (sent == encoding)
+        return {sent};
+    return {sent, encoding};
+}
+
+
 void StreamSession::start()
 {
     read_next();
@@ -146,10 +215,28 @@ void StreamSession::send_next()
         return;
     }
 
-    auto buffer = messages_.front();
+    // Gather as many queued messages as possible into one write. At least one message
+    // is sent, even if it exceeds max_write_size.
+    writeBuffers_.clear();
+    size_t writeSize = 0;
+    for (const auto& message : messages_)
+    {
+        size_t size = boost::asio::buffer_size(message);
+        if ((inFlight_ > 0) && (writeSize + size > max_write_size))
+            break;
+        writeBuffers_.insert(writeBuffers_.end(), message.begin(), message.end());
+        writeSize += size;
+        ++inFlight_;
+    }
 
-    boost::asio::async_write(socket_, buffer, boost::asio::bind_executor(strand_, [this, self, buffer](boost::system::error_code ec, std::size_t length) {
-                                 messages_.pop_front();
+    boost::asio::async_write(socket_, writeBuffers_, boost::asio::bind_executor(strand_, [this, self](boost::system::error_code ec, std::size_t length) {
+                                 for (; inFlight_ > 0; --inFlight_)
+                                 {
+                                     queuedMs_ -= messages_.front().duration();
+                                     messages_.pop_front();
+                                 }
+                                 queueSize_ = messages_.size();
+                                 queueMs_ = queuedMs_;
                                  if (ec)
                                  {
                                      LOG(ERROR) << "StreamSession write error (msg lenght: " << length << "): " << ec.message() << "\n";
@@ -162,15 +249,174 @@ void StreamSession::send_next()
 }
 
 
+bool StreamSession::acceptChunk(const shared_const_buffer& const_buf)
+{
+    int64_t timestamp = const_buf.timestamp();
+    // The encoders convert their time stamps independently, the same chunk's time stamps can differ by some ns
+    auto halfChunk = static_cast<int64_t>(const_buf.duration() * 500000.);
+    if (const_buf.encoding() == sentEncoding_)
+    {
+        // late chunks of the new encoding, that have been sent in the old one. Large steps back (e.g. a restarted stream) are passed
+        if ((lastTimestamp_ != std::numeric_limits<int64_t>::min()) && (timestamp <= lastTimestamp_ + halfChunk) &&
+            (timestamp > lastTimestamp_ - (switch_lead + static_cast<int64_t>(max_held)) * chunkNs_))
+            return false;
+
+        if (sentEncoding_ != encoding_)
+        {
+            // the old encoding passed the switch point without a chunk at it
+            if (timestamp > switchAt_ + halfChunk)
+            {
+                completeSwitch();
+                return false;
+            }
+            if (timestamp >= switchAt_ - halfChunk)
+                completeSwitch();
+        }
+        lastTimestamp_ = timestamp;
+        chunkNs_ = 2 * halfChunk;
+        return true;
+    }
+
+    // The new encoding may arrive before the old one reaches the switch point, e.g. if its encoder is faster
+    if ((const_buf.encoding() == encoding_) && (timestamp > switchAt_ + halfChunk))
+    {
+        held_.push_back(const_buf);
+        if (held_.size() >= max_held)
+            completeSwitch();
+    }
+    return false;
+}
+
+
+void StreamSession::completeSwitch()
+{
+    LOG(DEBUG) << "Client " << clientId << " switched from encoding " << sentEncoding_ << " to " << encoding_ << "\n";
+    sentEncoding_ = encoding_.load();
+    messageReceiver_->onEncodingChanged(this);
+}
+
+
+void StreamSession::adaptEncoding(bool congested)
+{
+    size_t rung = std::find(ladder_.begin(), ladder_.end(), encoding_.load()) - ladder_.begin();
+    // one switch at a time
+    if ((ladder_.size() < 2) || (rung >= ladder_.size()) || (sentEncoding_ != encoding_))
+        return;
+
+    auto now = std::chrono::steady_clock::now();
+    size_t next = rung;
+    if (congested)
+    {
+        healthySince_ = now;
+        if ((rung + 1 < ladder_.size()) && (now - lastSwitch_ >= step_down_interval))
+            next = rung + 1;
+    }
+    else if ((rung > 0) && (now - healthySince_ >= step_up_interval))
+        next = rung - 1;
+
+    if (next == rung)
+        return;
+
+    LOG(INFO) << "Client " << clientId << (congested ? " is congested" : " is healthy") << ", switching from encoding " << ladder_[rung] << " to "
+              << ladder_[next] << "\n";
+    encoding_ = ladder_[next];
+    // every step up needs another healthy period
+    lastSwitch_ = healthySince_ = now;
+    ++switches_;
+    if (lastTimestamp_ == std::numeric_limits<int64_t>::min())
+    {
+        completeSwitch();
+        return;
+    }
+    switchAt_ = lastTimestamp_ + switch_lead * chunkNs_;
+    // route the new encoding's chunks to the session as well
+    messageReceiver_->onEncodingChanged(this);
+}
+
+
+void StreamSession::push(const shared_const_buffer& const_buf, bool send_now)
+{
+    // Messages in flight are at the front of the queue, urgent messages are queued right behind them
+    auto pending = std::next(messages_.begin(), inFlight_);
+    if (send_now)
+        messages_.insert(pending, const_buf.forVersion(protocolVersion));
+    else
+        messages_.push_back(const_buf.forVersion(protocolVersion));
+    queuedMs_ += const_buf.duration();
+}
+
+
+void StreamSession::enqueue(shared_const_buffer const_buf, bool send_now)
+{
+    bool chunk = (const_buf.type() == message_type::kWireChunk);
+    if (!chunk)
+        push(const_buf, send_now);
+    else
+    {
+        bool accepted = acceptChunk(const_buf);
+        if (accepted)
+            push(const_buf, send_now);
+        // the switch has been completed, the held chunks of the new encoding follow the old encoding's last chunk
+        if (!held_.empty() && (sentEncoding_ == encoding_))
+        {
+            for (const auto& held : held_)
+            {
+                push(held, send_now);
+                lastTimestamp_ = held.timestamp();
+            }
+            held_.clear();
+            accepted = true;
+        }
+        if (!accepted)
+            return;
+    }
+
+    // Messages in flight are left alone, all other audio chunks can be dropped if the client
+    // doesn't keep up. Control, time and settings messages are never dropped.
+    size_t dropped = 0;
+    if ((maxQueueMs_ > 0) && (queuedMs_ > maxQueueMs_))
+    {
+        for (auto iter = std::next(messages_.begin(), inFlight_); (iter != messages_.end()) && (queuedMs_ > maxQueueMs_);)
+        {
+            if (iter->type() == message_type::kWireChunk)
+            {
+                queuedMs_ -= iter->duration();
+                iter = messages_.erase(iter);
+                ++dropped;
+            }
+            else
+                ++iter;
+        }
+        if (dropped > 0)
+        {
+            droppedChunks_ += dropped;
+            LOG(DEBUG) << "Send queue of " << clientId << " exceeds " << maxQueueMs_ << " ms, dropped " << dropped << " chunk(s), total: " << droppedChunks_
+                       << "\n";
+        }
+    }
+    queueSize_ = messages_.size();
+    queueMs_ = queuedMs_;
+
+    // the send queue grows if the network doesn't keep up
+    if (chunk && (ladder_.size() > 1))
+        adaptEncoding((dropped > 0) || (queuedMs_ > bufferMs_ / 4.));
+}
+
+
+void StreamSession::send(shared_const_buffer const_buf)
+{
+    enqueue(const_buf, false);
+    if (inFlight_ == 0)
+        send_next();
+}
+
+
 void StreamSession::sendAsync(shared_const_buffer const_buf, bool send_now)
 {
     auto self = shared_from_this();
     strand_.post([this, self, const_buf, send_now]() {
-        if (send_now)
-            messages_.push_front(const_buf);
-        else
-            messages_.push_back(const_buf);
-        if (messages_.size() > 1)
+        enqueue(const_buf, send_now);
+        if (inFlight_ > 0)
         {
             LOG(DEBUG) << "outstanding async_write\n";
             return;
@@ -185,12 +431,9 @@ void StreamSession::sendAsync(msg::message_ptr message, bool send_now)
     if (!message)
         return;
 
-    // sendAsync(shared_const_buffer(*message), send_now);
     tv t;
     message->sent = t;
-    std::ostringstream oss;
-    message->serialize(oss);
-    sendAsync(shared_const_buffer(oss.str()), send_now);
+    sendAsync(shared_const_buffer(*message, protocolVersion), send_now);
 }
 
 
@@ -198,3 +441,36 @@ void StreamSession::setBufferMs(size_t bufferMs)
 {
     bufferMs_ = bufferMs;
 }
+
+
+void StreamSession::setMaxQueueMs(size_t maxQueueMs)
+{
+    maxQueueMs_ = maxQueueMs;
+}
+
+
+json StreamSession::getQueueStats() const
+{
+    return {{"size", queueSize_.load()}, {"ms", queueMs_.load()}, {"dropped", droppedChunks_.load()}};
+}
+
+
+void StreamSession::reportHealth(int bufferMs, int rttMs)
+{
+    bufferHealthMs_ = bufferMs;
+    rttMs_ = rttMs;
+    if (ladder_.size() < 2)
+        return;
+
+    // A high round trip time hints at a filling network queue. It can be stale (the client syncs its time every
+    // 30s at most), so it only holds off stepping up.
+    if (rttMs > static_cast<int>(bufferMs_ / 4))
+        healthySince_ = std::chrono::steady_clock::now();
+    adaptEncoding(((bufferMs >= 0) && (bufferMs < static_cast<int>(bufferMs_ / 4))) || (queuedMs_ > bufferMs_ / 4.));
+}
+
+
+json StreamSession::getHealth() const
+{
+    return {{"encoding", encoding_.load()}, {"buffer", bufferHealthMs_.load()}, {"rtt", rttMs_.load()}, {"switches", switches_.load()}};
+}
@@ -21,9 +21,12 @@
 
 #include "common/snap_queue.h"
 #include "message/message.hpp"
+#include "message/wire_chunk.hpp"
 #include "streamreader/stream_manager.hpp"
+#include <array>
 #include <atomic>
 #include <boost/asio.hpp>
+#include <chrono>
 #include <condition_variable>
 #include <deque>
 #include <memory>
@@ -47,46 +50,115 @@ class MessageReceiver
 public:
     virtual void onMessageReceived(StreamSession* connection, const msg::BaseMessage& baseMessage, char* buffer) = 0;
     virtual void onDisconnect(StreamSession* connection) = 0;
+    /// The encodings the session needs changed (see StreamSession::routedEncodings), called on the session's strand
+    virtual void onEncodingChanged(StreamSession* connection) = 0;
 };
 
 
 // A reference-counted non-modifiable buffer class.
-// TODO: add overload for messages
+/**
+ * Holds a serialized message, shared by all sessions it is sent to.
+ * The payload of a WireChunk is not copied: the buffer sequence consists
+ * of the serialized header and the chunk's payload, which is kept alive
+ * together with the header.
+ */
 class shared_const_buffer
 {
+    struct Data
+    {
+        std::vector<char> serialized;
+        /// v3 header of a chunk
+        std::vector<char> compact;
+        std::shared_ptr<const msg::WireChunk> chunk;
+        uint16_t type{message_type::kBase};
+        double duration{0.};
+        size_t encoding{0};
+    };
+
 public:
     // Construct from a std::string.
-    explicit shared_const_buffer(const std::string& data) : data_(new std::vector<char>(data.begin(), data.end())), buffer_(boost::asio::buffer(*data_))
+    explicit shared_const_buffer(const std::string& data) : data_(std::make_shared<Data>()), count_(1)
+    {
+        data_->serialized.assign(data.begin(), data.end());
+        buffers_[0] = boost::asio::buffer(data_->serialized);
+    }
+
+    // Construct from a message, serialized in protocol "version"
+    explicit shared_const_buffer(const msg::BaseMessage& message, int version = msg::protocol_v2) : data_(std::make_shared<Data>()), count_(1)
+    {
+        data_->serialized = message.serialize(version);
+        data_->type = message.type;
+        buffers_[0] = boost::asio::buffer(data_->serialized);
+    }
+
+    // Construct from a chunk of "duration" ms in "encoding" of its stream, header and payload are sent as scatter-gather sequence
+    explicit shared_const_buffer(std::shared_ptr<const msg::WireChunk> chunk, double duration = 0., size_t encoding = 0)
+        : data_(std::make_shared<Data>()), count_(2)
     {
+        data_->type = chunk->type;
+        data_->duration = duration;
+        data_->encoding = encoding;
+        // Headers for both protocol versions are tiny, the sessions pick theirs with "forVersion"
+        data_->serialized.resize(chunk->getHeaderSize(msg::protocol_v2));
+        msg::BufferWriter writer(data_->serialized.data(), data_->serialized.data() + data_->serialized.size(), msg::protocol_v2);
+        chunk->serializeHeader(writer);
+        data_->compact.resize(chunk->getHeaderSize(msg::protocol_v3));
+        msg::BufferWriter compactWriter(data_->compact.data(), data_->compact.data() + data_->compact.size(), msg::protocol_v3);
+        chunk->serializeHeader(compactWriter);
+        data_->chunk = std::move(chunk);
+        buffers_[0] = boost::asio::buffer(data_->serialized);
+        buffers_[1] = boost::asio::buffer(data_->chunk->payload, data_->chunk->payloadSize);
     }
 
-    // // Construct from a message.
-    // explicit shared_const_buffer(const msg::BaseMessage& message)
-    // {
-    //     std::ostringstream oss;
-    //     message.serialize(oss);
+    /// The chunk with the header for protocol "version". Other messages are already serialized for their session
+    shared_const_buffer forVersion(int version) const
+    {
+        shared_const_buffer result(*this);
+        if ((version >= msg::protocol_v3) && !data_->compact.empty())
+            result.buffers_[0] = boost::asio::buffer(data_->compact);
+        return result;
+    }
 
-    //     data_ = std::shared_ptr<std::vector<char>>(new std::vector<char>(oss.str().begin(), oss.str().end()));
-    //     //std::make_shared<std::vector<char>>(oss.str().begin(), oss.str().end());
-    //     buffer_ = boost::asio::buffer(*data_);
-    // }
+    /// Type of the message, kBase if constructed from a string
+    uint16_t type() const
+    {
+        return data_->type;
+    }
 
+    /// Duration of the contained audio [ms], 0 for non audio messages
+    double duration() const
+    {
+        return data_->duration;
+    }
+
+    /// Index of the stream's codec the contained audio is encoded with (see PcmStream::getEncoding)
+    size_t encoding() const
+    {
+        return data_->encoding;
+    }
+
+    /// Time stamp of the contained audio [ns], 0 for non audio messages
+    int64_t timestamp() const
+    {
+        return data_->chunk ? data_->chunk->timestamp.nsec : 0;
+    }
 
     // Implement the ConstBufferSequence requirements.
     typedef boost::asio::const_buffer value_type;
     typedef const boost::asio::const_buffer* const_iterator;
     const boost::asio::const_buffer* begin() const
     {
-        return &buffer_;
+        return buffers_.data();
     }
     const boost::asio::const_buffer* end() const
     {
-        return &buffer_ + 1;
+        return buffers_.data() + count_;
     }
 
 private:
-    std::shared_ptr<std::vector<char>> data_;
-    boost::asio::const_buffer buffer_;
+    std::shared_ptr<Data> data_;
+    std::array<boost::asio::const_buffer, 2> buffers_;
+    size_t count_;
 };
 
 
@@ -111,32 +183,110 @@ public:
     /// Sends a message to the client (asynchronous)
     void sendAsync(shared_const_buffer const_buf, bool send_now = false);
 
+    /// Sends a message to the client without posting it to the session's strand
+    /**
+     * Must be called from the thread that runs the session's io_context, which must be the only one
+     */
+    void send(shared_const_buffer const_buf);
+
+    /// The io_context that the session is running on
+    boost::asio::io_context& getIoContext()
+    {
+        return strand_.context();
+    }
+
     /// Max playout latency. No need to send PCM data that is older than bufferMs
     void setBufferMs(size_t bufferMs);
 
+    /// Max amount of queued audio [ms]. If exceeded, the oldest chunks are dropped
+    void setMaxQueueMs(size_t maxQueueMs);
+
+    /// Send queue statistics: queued messages, queued audio [ms] and dropped chunks
+    json getQueueStats() const;
+
+    /// Buffer health "bufferMs" and round trip time "rttMs" reported by the client, -1 if unknown.
+    /// Must be called on the session's strand, i.e. from MessageReceiver::onMessageReceived
+    void reportHealth(int bufferMs, int rttMs);
+
+    /// Encoding, last reported buffer health and round trip time, number of encoding switches
+    json getHealth() const;
+
     std::string clientId;
+    /// The client asked for the audio via multicast (Hello message), cleared if no multicast chunks arrive
+    std::atomic<bool> multicastRequested{false};
+    /// The client receives the audio via multicast, chunks are not sent over this session
+    std::atomic<bool> multicast{false};
+    /// Chunks published to the multicast group at the client's last ClientInfo and the number of ClientInfos in a row without a received chunk
+    size_t multicastSent{0};
+    size_t multicastMisses{0};
+    /// Protocol version used for sending, announced by the client's Hello message
+    std::atomic<int> protocolVersion{msg::protocol_v2};
+    /// Codecs the client can decode, announced by the client's Hello message (empty: unknown)
+    std::vector<std::string> codecs;
 
     std::string getIP()
     {
         return socket_.remote_endpoint().address().to_string();
     }
 
-    void setPcmStream(PcmStreamPtr pcmStream);
+    /// Stream and the index of the stream's codec (PcmStream::getEncoding) that the session receives.
+    /// If the encoding is part of a ladder (PcmStream::getLadder), the session moves along it depending on the congestion of the client.
+    /// Multicast sessions don't, set "multicast" before
+    void setPcmStream(PcmStreamPtr pcmStream, size_t encoding = 0);
     const PcmStreamPtr pcmStream() const;
+    size_t encoding() const;
+    /// Encodings whose chunks must be routed to the session: the one that is sent and, while a switch is pending, the new one
+    std::vector<size_t> routedEncodings() const;
 
 protected:
     void read_next();
+    /// Read the rest of a header of "headerSize" bytes (if any) and the message body
+    void read_message(size_t headerSize);
     void send_next();
+    void enqueue(shared_const_buffer const_buf, bool send_now);
+    /// Add a message to the send queue
+    void push(const shared_const_buffer& const_buf, bool send_now);
+    /// Pass chunks of the encoding that is sent. While a switch is pending, the old encoding is passed up to switchAt_ and
+    /// chunks of the new encoding after switchAt_ are held until the switch is completed
+    bool acceptChunk(const shared_const_buffer& const_buf);
+    void completeSwitch();
+    /// Step down the ladder if "congested", step up if the session has been healthy for a while
+    void adaptEncoding(bool congested);
 
     msg::BaseMessage baseMessage_;
     std::vector<char> buffer_;
-    size_t base_msg_size_;
     tcp::socket socket_;
     MessageReceiver* messageReceiver_;
     size_t bufferMs_;
+    size_t maxQueueMs_;
     PcmStreamPtr pcmStream_;
+    /// Encoding the session should receive, changed by adaptEncoding
+    std::atomic<size_t> encoding_;
     boost::asio::io_context::strand strand_;
     std::deque<shared_const_buffer> messages_;
+    std::vector<boost::asio::const_buffer> writeBuffers_;
+    size_t inFlight_;
+    double queuedMs_;
+    std::atomic<size_t> queueSize_;
+    std::atomic<size_t> queueMs_;
+    std::atomic<size_t> droppedChunks_;
+
+    /// Ladder state, accessed on the strand only
+    std::vector<size_t> ladder_;
+    /// Encoding of the last chunk sent, differs from encoding_ until the switch is completed by acceptChunk
+    std::atomic<size_t> sentEncoding_;
+    int64_t lastTimestamp_;
+    /// Duration of the last chunk sent [ns]
+    int64_t chunkNs_;
+    /// Time stamp of the last chunk of the old encoding of a pending switch
+    int64_t switchAt_;
+    /// Chunks of the new encoding that arrived before the old encoding reached switchAt_
+    std::vector<shared_const_buffer> held_;
+    std::chrono::steady_clock::time_point lastSwitch_;
+    std::chrono::steady_clock::time_point healthySince_;
+    std::atomic<int> bufferHealthMs_;
+    std::atomic<int> rttMs_;
+    std::atomic<size_t> switches_;
 };
 
 
@@ -22,6 +22,7 @@
 #include "common/snap_exception.hpp"
 #include "common/utils.hpp"
 #include "common/utils/string_utils.hpp"
+#include <fcntl.h>
 
 using namespace std;
 
@@ -41,7 +42,8 @@ static string hex2str(string input)
  * move to Makefile?
  */
 
-AirplayStream::AirplayStream(PcmListener* pcmListener, const StreamUri& uri) : ProcessStream(pcmListener, uri), port_(5000)
+AirplayStream::AirplayStream(PcmListener* pcmListener, boost::asio::io_context& ioc, const StreamUri& uri)
+    : ProcessStream(pcmListener, ioc, uri), port_(5000), metaPipe_(ioc), metaTimer_(ioc)
 {
     logStderr_ = true;
 
@@ -60,8 +62,9 @@ AirplayStream::AirplayStream(PcmListener* pcmListener, const StreamUri& uri) : P
     params_wo_port_ += " --metadata-pipename " + pipePath_;
     params_ = params_wo_port_ + " --port=" + cpt::to_string(port_);
 
-    pipeReaderThread_ = thread(&AirplayStream::pipeReader, this);
-    pipeReaderThread_.detach();
+#ifdef HAS_EXPAT
+    createParser();
+#endif
 }
 
 
@@ -121,31 +124,82 @@ void AirplayStream::push()
 }
 #endif
 
-void AirplayStream::pipeReader()
+void AirplayStream::connect()
 {
-#ifdef HAS_EXPAT
-    createParser();
-#endif
+    ProcessStream::connect();
+    openMetaPipe();
+}
 
-    while (true)
+
+void AirplayStream::disconnect()
+{
+    boost::system::error_code ec;
+    metaTimer_.cancel(ec);
+    metaPipe_.close(ec);
+    ProcessStream::disconnect();
+}
+
+
+void AirplayStream::openMetaPipe()
+{
+    boost::system::error_code ec;
+    metaPipe_.close(ec);
+    metaBuffer_.consume(metaBuffer_.size());
+    int fd = ::open(pipePath_.c_str(), O_RDONLY | O_NONBLOCK);
+    if (fd == -1)
     {
-        ifstream pipe(pipePath_);
+        retryMetaPipe();
+        return;
+    }
+
+    metaPipe_.assign(fd, ec);
+    if (ec)
+    {
+        ::close(fd);
+        retryMetaPipe();
+        return;
+    }
+    readMetaLine();
+}
 
-        if (pipe)
-        {
-            string line;
 
-            while (getline(pipe, line))
-            {
+void AirplayStream::retryMetaPipe()
+{
+    // Wait a little until we try to open it again
+    std::weak_ptr<PcmStream> self = shared_from_this();
+    metaTimer_.expires_after(std::chrono::milliseconds(500));
+    metaTimer_.async_wait(boost::asio::bind_executor(strand_, [this, self](const boost::system::error_code& ec) {
+        auto stream = self.lock();
+        if (!stream || ec || !active_)
+            return;
+        openMetaPipe();
+    }));
+}
+
+
+void AirplayStream::readMetaLine()
+{
+    std::weak_ptr<PcmStream> self = shared_from_this();
+    boost::asio::async_read_until(metaPipe_, metaBuffer_, '\n',
+                                  boost::asio::bind_executor(strand_, [this, self](const boost::system::error_code& ec, std::size_t bytes) {
+                                      auto stream = self.lock();
+                                      if (!stream || !active_ || (ec == boost::asio::error::operation_aborted))
+                                          return;
+                                      if (ec)
+                                      {
+                                          // no writer (yet) or the writer has gone
+                                          retryMetaPipe();
+                                          return;
+                                      }
+
+                                      CpuTimer cpuTimer(cpuTimeNs_);
 #ifdef HAS_EXPAT
-                parse(line);
+                                      auto begin = boost::asio::buffers_begin(metaBuffer_.data());
+                                      parse(string(begin, begin + bytes - 1));
 #endif
-            }
-        }
-
-        // Wait a little until we try to open it again
-        this_thread::sleep_for(chrono::milliseconds(500));
-    }
+                                      metaBuffer_.consume(bytes);
+                                      readMetaLine();
+                                  }));
 }
 
 void AirplayStream::initExeAndPath(const string& filename)
@@ -56,7 +56,7 @@ class AirplayStream : public ProcessStream
 {
 public:
     /// ctor. Encoded PCM data is passed to the PipeListener
-    AirplayStream(PcmListener* pcmListener, const StreamUri& uri);
+    AirplayStream(PcmListener* pcmListener, boost::asio::io_context& ioc, const StreamUri& uri);
     ~AirplayStream() override;
 
 protected:
@@ -67,19 +67,27 @@ protected:
     std::string buf_;
     json jtag_;
 
-    void pipeReader();
+    /// Open the metadata pipe and read it line by line
+    void openMetaPipe();
+    /// Try to open the metadata pipe again in 500ms
+    void retryMetaPipe();
+    void readMetaLine();
 #ifdef HAS_EXPAT
     int parse(std::string line);
     void createParser();
     void push();
 #endif
 
+    void connect() override;
+    void disconnect() override;
     void onStderrMsg(const char* buffer, size_t n) override;
     void initExeAndPath(const std::string& filename) override;
     size_t port_;
     std::string pipePath_;
     std::string params_wo_port_;
-    std::thread pipeReaderThread_;
+    boost::asio::posix::stream_descriptor metaPipe_;
+    boost::asio::steady_timer metaTimer_;
+    boost::asio::streambuf metaBuffer_;
 
 #ifdef HAS_EXPAT
     static void XMLCALL element_start(void* userdata, const char* element_name, const char** attr);
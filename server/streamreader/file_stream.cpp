@@ -16,6 +16,8 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 ***/
 
+#include <algorithm>
+#include <cerrno>
 #include <fcntl.h>
 #include <memory>
 #include <sys/stat.h>
@@ -30,7 +32,7 @@ using namespace std;
 
 
 
-FileStream::FileStream(PcmListener* pcmListener, const StreamUri& uri) : PcmStream(pcmListener, uri)
+FileStream::FileStream(PcmListener* pcmListener, boost::asio::io_context& ioc, const StreamUri& uri) : PosixStream(pcmListener, ioc, uri), length_(0)
 {
     ifs.open(uri_.path.c_str(), std::ifstream::in | std::ifstream::binary);
     if (!ifs.good())
@@ -47,66 +49,37 @@ FileStream::~FileStream()
 }
 
 
-void FileStream::worker()
+void FileStream::connect()
 {
-    timeval tvChunk;
-    std::unique_ptr<msg::PcmChunk> chunk(new msg::PcmChunk(sampleFormat_, pcmReadMs_));
-
+    ifs.clear();
     ifs.seekg(0, ifs.end);
-    size_t length = ifs.tellg();
+    length_ = ifs.tellg();
     ifs.seekg(0, ifs.beg);
+    if (!ifs.good() || (length_ == 0))
+    {
+        onError("failed to read PCM file: \"" + uri_.path + "\"");
+        return;
+    }
+    startReading();
+}
 
-    setState(kPlaying);
 
-    while (active_)
+ssize_t FileStream::doRead(char* buffer, size_t count)
+{
+    size_t len = 0;
+    while (len < count)
     {
-        chronos::systemtimeofday(&tvChunk);
-        tvEncodedChunk_ = tvChunk;
-        long nextTick = chronos::getTickCount();
-        try
-        {
-            while (active_)
-            {
-                chunk->timestamp.sec = tvChunk.tv_sec;
-                chunk->timestamp.usec = tvChunk.tv_usec;
-                size_t toRead = chunk->payloadSize;
-                size_t count = 0;
-
-                size_t pos = ifs.tellg();
-                size_t left = length - pos;
-                if (left < toRead)
-                {
-                    ifs.read(chunk->payload, left);
-                    ifs.seekg(0, ifs.beg);
-                    count = left;
-                }
-                ifs.read(chunk->payload + count, toRead - count);
-
-                encoder_->encode(chunk.get());
-                if (!active_)
-                    break;
-                nextTick += pcmReadMs_;
-                chronos::addUs(tvChunk, pcmReadMs_ * 1000);
-                long currentTick = chronos::getTickCount();
-
-                if (nextTick >= currentTick)
-                {
-                    //					LOG(INFO) << "sleep: " << nextTick - currentTick << "\n";
-                    if (!sleep(nextTick - currentTick))
-                        break;
-                }
-                else
-                {
-                    chronos::systemtimeofday(&tvChunk);
-                    tvEncodedChunk_ = tvChunk;
-                    pcmListener_->onResync(this, currentTick - nextTick);
-                    nextTick = currentTick;
-                }
-            }
-        }
-        catch (const std::exception& e)
+        size_t left = length_ - static_cast<size_t>(ifs.tellg());
+        size_t toRead = std::min(left, count - len);
+        ifs.read(buffer + len, toRead);
+        if (!ifs.good())
         {
-            LOG(ERROR) << "(FileStream) Exception: " << e.what() << std::endl;
+            errno = EIO;
+            return -1;
         }
+        len += toRead;
+        if (toRead == left)
+            ifs.seekg(0, ifs.beg);
     }
+    return len;
 }
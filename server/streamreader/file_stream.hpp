@@ -19,7 +19,7 @@
 #ifndef FILE_STREAM_H
 #define FILE_STREAM_H
 
-#include "pcm_stream.hpp"
+#include "posix_stream.hpp"
 #include <fstream>
 
 
@@ -28,17 +28,23 @@
  * Reads PCM from a file and passes the data to an encoder.
  * Implements EncoderListener to get the encoded data.
  * Data is passed to the PcmListener
+ * The file is played in a loop, a chunk per timer tick.
  */
-class FileStream : public PcmStream
+class FileStream : public PosixStream
 {
 public:
     /// ctor. Encoded PCM data is passed to the PipeListener
-    FileStream(PcmListener* pcmListener, const StreamUri& uri);
+    FileStream(PcmListener* pcmListener, boost::asio::io_context& ioc, const StreamUri& uri);
     ~FileStream() override;
 
 protected:
-    void worker() override;
+    /// Rewind the file and start reading, a file is always readable
+    void connect() override;
+    /// Read "count" bytes, continuing at the beginning when the end of the file is reached
+    ssize_t doRead(char* buffer, size_t count) override;
+
     std::ifstream ifs;
+    size_t length_;
 };
 
 
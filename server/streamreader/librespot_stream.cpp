@@ -28,7 +28,8 @@ using namespace std;
 
 
 
-LibrespotStream::LibrespotStream(PcmListener* pcmListener, const StreamUri& uri) : ProcessStream(pcmListener, uri)
+LibrespotStream::LibrespotStream(PcmListener* pcmListener, boost::asio::io_context& ioc, const StreamUri& uri)
+    : ProcessStream(pcmListener, ioc, uri), watchdog_(make_shared<Watchdog>(ioc, this))
 {
     sampleFormat_ = SampleFormat("44100:16:2");
     uri_.query["sampleformat"] = sampleFormat_.getFormat();
@@ -153,12 +154,18 @@ void LibrespotStream::onStderrMsg(const char* buffer, size_t n)
 }
 
 
-void LibrespotStream::stderrReader()
+void LibrespotStream::connect()
 {
-    watchdog_.reset(new Watchdog(this));
     /// 130min
     watchdog_->start(130 * 60 * 1000);
-    ProcessStream::stderrReader();
+    ProcessStream::connect();
+}
+
+
+void LibrespotStream::disconnect()
+{
+    watchdog_->stop();
+    ProcessStream::disconnect();
 }
 
 
@@ -31,17 +31,18 @@
  *   snapserver -s "spotify:///librespot?name=Spotify&username=<my username>&password=<my password>[&devicename=Snapcast][&bitrate=320][&volume=<volume in
  * percent>][&cache=<cache dir>]"
  */
-class LibrespotStream : public ProcessStream, WatchdogListener
+class LibrespotStream : public ProcessStream, public WatchdogListener
 {
 public:
     /// ctor. Encoded PCM data is passed to the PipeListener
-    LibrespotStream(PcmListener* pcmListener, const StreamUri& uri);
+    LibrespotStream(PcmListener* pcmListener, boost::asio::io_context& ioc, const StreamUri& uri);
     ~LibrespotStream() override;
 
 protected:
-    std::unique_ptr<Watchdog> watchdog_;
+    std::shared_ptr<Watchdog> watchdog_;
 
-    void stderrReader() override;
+    void connect() override;
+    void disconnect() override;
     void onStderrMsg(const char* buffer, size_t n) override;
     void initExeAndPath(const std::string& filename) override;
 
@@ -16,6 +16,7 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 ***/
 
+#include <algorithm>
 #include <fcntl.h>
 #include <memory>
 #include <sys/stat.h>
@@ -23,6 +24,7 @@
 #include "common/aixlog.hpp"
 #include "common/snap_exception.hpp"
 #include "common/str_compat.hpp"
+#include "common/utils/string_utils.hpp"
 #include "encoder/encoder_factory.hpp"
 #include "pcm_stream.hpp"
 
@@ -30,13 +32,24 @@
 using namespace std;
 
 
+constexpr std::array<uint32_t, 8> PcmStream::jitter_bounds_us;
 
-PcmStream::PcmStream(PcmListener* pcmListener, const StreamUri& uri) : active_(false), pcmListener_(pcmListener), uri_(uri), pcmReadMs_(20), state_(kIdle)
+
+
+PcmStream::PcmStream(PcmListener* pcmListener, boost::asio::io_context& ioc, const StreamUri& uri)
+    : active_(false), cpuTimeNs_(0), clockFrames_(0), clockGeneration_(1), resyncs_(0), pcmListener_(pcmListener), uri_(uri),
+      pcmReadMs_(20), state_(kIdle)
 {
     encoder::EncoderFactory encoderFactory;
     if (uri_.query.find("codec") == uri_.query.end())
         throw SnapException("Stream URI must have a codec");
-    encoder_.reset(encoderFactory.createEncoder(uri_.query["codec"]));
+    for (const auto& codec : utils::string::split(uri_.query["codec"], '|'))
+    {
+        if (!utils::string::trim_copy(codec).empty())
+            encodings_.emplace_back(new Encoding(ioc, encoderFactory.createEncoder(codec)));
+    }
+    if (encodings_.empty())
+        throw SnapException("Stream URI must have a codec");
 
     if (uri_.query.find("name") == uri_.query.end())
         throw SnapException("Stream URI must have a name");
@@ -55,6 +68,9 @@ PcmStream::PcmStream(PcmListener* pcmListener, const StreamUri& uri) : active_(f
     else
         dryoutMs_ = 2000;
 
+    for (auto& bucket : pacingJitter_)
+        bucket = 0;
+
     // meta_.reset(new msg::StreamTags());
     // meta_->msg["stream"] = name_;
     setMeta(json());
@@ -67,9 +83,43 @@ PcmStream::~PcmStream()
 }
 
 
-std::shared_ptr<msg::CodecHeader> PcmStream::getHeader()
+std::shared_ptr<msg::CodecHeader> PcmStream::getHeader(size_t encoding)
+{
+    return encodings_[encoding]->encoder->getHeader();
+}
+
+
+size_t PcmStream::getEncoding(const std::vector<std::string>& codecs) const
+{
+    // in the order of the stream's codecs, i.e. the first codec is preferred
+    for (size_t n = 0; n < encodings_.size(); ++n)
+    {
+        if (std::find(codecs.begin(), codecs.end(), encodings_[n]->encoder->name()) != codecs.end())
+            return n;
+    }
+    return 0;
+}
+
+
+std::string PcmStream::getCodec(size_t encoding) const
+{
+    return encodings_[encoding]->encoder->name();
+}
+
+
+std::vector<size_t> PcmStream::getLadder(size_t encoding) const
 {
-    return encoder_->getHeader();
+    // Opus packets are self-contained and the header carries the sample format only, so the decoder doesn't notice a change of the encoder
+    if (getCodec(encoding) != "opus")
+        return {encoding};
+
+    std::vector<size_t> ladder;
+    for (size_t n = 0; n < encodings_.size(); ++n)
+    {
+        if (getCodec(n) == "opus")
+            ladder.push_back(n);
+    }
+    return ladder;
 }
 
 
@@ -100,30 +150,16 @@ const SampleFormat& PcmStream::getSampleFormat() const
 void PcmStream::start()
 {
     LOG(DEBUG) << "PcmStream start: " << sampleFormat_.getFormat() << "\n";
-    encoder_->init(this, sampleFormat_);
+    for (auto& encoding : encodings_)
+        encoding->encoder->init(this, sampleFormat_);
+    tpStart_ = clock::now();
     active_ = true;
-    thread_ = thread(&PcmStream::worker, this);
 }
 
 
 void PcmStream::stop()
 {
-    if (!active_ && !thread_.joinable())
-        return;
-
     active_ = false;
-    cv_.notify_one();
-    if (thread_.joinable())
-        thread_.join();
-}
-
-
-bool PcmStream::sleep(int32_t ms)
-{
-    if (ms < 0)
-        return true;
-    std::unique_lock<std::mutex> lck(mtx_);
-    return (!cv_.wait_for(lck, std::chrono::milliseconds(ms), [this] { return !active_; }));
 }
 
 
@@ -144,17 +180,116 @@ void PcmStream::setState(const ReaderState& newState)
 }
 
 
-void PcmStream::onChunkEncoded(const encoder::Encoder* /*encoder*/, msg::PcmChunk* chunk, double duration)
+void PcmStream::resetClock(const clock::time_point& now)
+{
+    clockAnchor_ = now;
+    clockFrames_ = 0;
+    ++clockGeneration_;
+}
+
+
+PcmStream::clock::time_point PcmStream::advanceClock(size_t frames)
+{
+    clockFrames_ += frames;
+    return clockPosition();
+}
+
+
+PcmStream::clock::time_point PcmStream::clockPosition() const
+{
+    // frames are counted exactly, there is no rounding error that adds up
+    uint64_t rate = sampleFormat_.rate;
+    std::chrono::nanoseconds position(std::chrono::seconds(clockFrames_ / rate) + std::chrono::nanoseconds((clockFrames_ % rate) * 1000000000 / rate));
+    return clockAnchor_ + std::chrono::duration_cast<clock::duration>(position);
+}
+
+
+tv PcmStream::toProtocolTime(const clock::time_point& timePoint)
+{
+    return tv(std::chrono::duration_cast<chronos::nsec>(timePoint.time_since_epoch()));
+}
+
+
+void PcmStream::addPacingJitter(const clock::duration& late)
+{
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(late).count();
+    size_t bucket = 0;
+    while ((bucket < jitter_bounds_us.size()) && (us >= jitter_bounds_us[bucket]))
+        ++bucket;
+    ++pacingJitter_[bucket];
+}
+
+
+void PcmStream::encode(std::shared_ptr<msg::PcmChunk>& chunk, const clock::time_point& position)
+{
+    if (encodings_.size() == 1)
+    {
+        encode(*encodings_.front(), chunk.get(), position, clockGeneration_);
+        return;
+    }
+
+    // the encoders run in parallel on their strands, sharing the chunk. The reader continues with a free chunk from the pool
+    std::shared_ptr<const msg::PcmChunk> sharedChunk = chunk;
+    uint32_t clockGeneration = clockGeneration_;
+    std::weak_ptr<PcmStream> self = shared_from_this();
+    for (auto& encoding : encodings_)
+    {
+        Encoding* enc = encoding.get();
+        boost::asio::post(enc->strand, [this, self, enc, sharedChunk, position, clockGeneration] {
+            auto stream = self.lock();
+            if (!stream || !active_)
+                return;
+            CpuTimer cpuTimer(cpuTimeNs_);
+            encode(*enc, sharedChunk.get(), position, clockGeneration);
+        });
+    }
+
+    chunk = nullptr;
+    for (const auto& pooled : chunkPool_)
+    {
+        if (pooled.use_count() == 1)
+        {
+            // the encoders have released it: synchronize with their last reads before the payload is overwritten
+            std::atomic_thread_fence(std::memory_order_acquire);
+            chunk = pooled;
+            return;
+        }
+    }
+    chunk = std::make_shared<msg::PcmChunk>(sampleFormat_, pcmReadMs_);
+    if (chunkPool_.size() < max_pooled_chunks)
+        chunkPool_.push_back(chunk);
+}
+
+
+void PcmStream::encode(Encoding& encoding, const msg::PcmChunk* chunk, const clock::time_point& position, uint32_t clockGeneration)
+{
+    if (encoding.clockGeneration != clockGeneration)
+    {
+        encoding.tpEncoded = position;
+        encoding.clockGeneration = clockGeneration;
+    }
+    /// TODO: use less raw pointers, make this encoding more transparent
+    encoding.encoder->encode(chunk);
+}
+
+
+void PcmStream::onChunkEncoded(const encoder::Encoder* encoder, msg::PcmChunk* chunk, double duration)
 {
     //	LOG(INFO) << "onChunkEncoded: " << duration << " us\n";
     if (duration <= 0)
         return;
 
-    chunk->timestamp.sec = tvEncodedChunk_.tv_sec;
-    chunk->timestamp.usec = tvEncodedChunk_.tv_usec;
-    chronos::addUs(tvEncodedChunk_, duration * 1000);
+    size_t n = 0;
+    while ((n < encodings_.size()) && (encodings_[n]->encoder.get() != encoder))
+        ++n;
+    if (n == encodings_.size())
+        return;
+
+    auto& encoding = *encodings_[n];
+    chunk->timestamp = toProtocolTime(encoding.tpEncoded);
+    encoding.tpEncoded += std::chrono::duration_cast<clock::duration>(std::chrono::duration<double, std::milli>(duration));
     if (pcmListener_)
-        pcmListener_->onChunkRead(this, chunk, duration);
+        pcmListener_->onChunkRead(this, n, chunk, duration);
 }
 
 
@@ -168,13 +303,34 @@ json PcmStream::toJson() const
     else if (state_ == kDisabled)
         state = "disabled";
 
+    json codecs = json::array();
+    for (const auto& encoding : encodings_)
+        codecs.push_back(encoding->encoder->name());
+
     json j = {
-        {"uri", uri_.toJson()}, {"id", getId()}, {"status", state},
+        {"uri", uri_.toJson()}, {"id", getId()}, {"status", state}, {"codecs", codecs},
     };
 
     if (meta_)
         j["meta"] = meta_->msg;
 
+    // average load of the reader since the stream has been started
+    uint64_t cpuUs = cpuTimeNs_ / 1000;
+    double load = 0.;
+    if (active_)
+    {
+        auto runningUs = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - tpStart_).count();
+        if (runningUs > 0)
+            load = 100. * cpuUs / runningUs;
+    }
+    j["cpu"] = {{"usec", cpuUs}, {"percent", load}};
+
+    // how late the reader woke up for the chunks, counts per bucket
+    json jitter = json::array();
+    for (const auto& bucket : pacingJitter_)
+        jitter.push_back(bucket.load());
+    j["pacing"] = {{"jitter", {{"bounds_us", jitter_bounds_us}, {"counts", jitter}}}, {"resyncs", resyncs_.load()}};
+
     return j;
 }
 
@@ -25,12 +25,16 @@
 #include "message/codec_header.hpp"
 #include "message/stream_tags.hpp"
 #include "stream_uri.hpp"
+#include <array>
 #include <atomic>
-#include <condition_variable>
+#include <boost/asio.hpp>
+#include <chrono>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <string>
-#include <thread>
+#include <time.h>
+#include <vector>
 
 
 class PcmStream;
@@ -53,22 +57,52 @@ class PcmListener
 public:
     virtual void onMetaChanged(const PcmStream* pcmStream) = 0;
     virtual void onStateChanged(const PcmStream* pcmStream, const ReaderState& state) = 0;
-    virtual void onChunkRead(const PcmStream* pcmStream, msg::PcmChunk* chunk, double duration) = 0;
+    /// "encoding" is the index of the codec, the chunk is encoded with (see PcmStream::getEncoding)
+    virtual void onChunkRead(const PcmStream* pcmStream, size_t encoding, msg::PcmChunk* chunk, double duration) = 0;
     virtual void onResync(const PcmStream* pcmStream, double ms) = 0;
 };
 
 
+/// Adds the CPU time that the calling thread spends in its scope to "cpuTimeNs"
+class CpuTimer
+{
+public:
+    CpuTimer(std::atomic<uint64_t>& cpuTimeNs) : cpuTimeNs_(cpuTimeNs), start_(now())
+    {
+    }
+
+    ~CpuTimer()
+    {
+        cpuTimeNs_ += now() - start_;
+    }
+
+private:
+    static uint64_t now()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+
+    std::atomic<uint64_t>& cpuTimeNs_;
+    uint64_t start_;
+};
+
+
 /// Reads and decodes PCM data
 /**
  * Reads PCM and passes the data to an encoder.
  * Implements EncoderListener to get the encoded data.
  * Data is passed to the PcmListener
+ *
+ * A stream can be encoded with several codecs ("codec=opus|pcm"), every read chunk is
+ * passed to all of the encoders, each of them running on its own strand.
  */
-class PcmStream : public encoder::EncoderListener
+class PcmStream : public encoder::EncoderListener, public std::enable_shared_from_this<PcmStream>
 {
 public:
-    /// ctor. Encoded PCM data is passed to the PcmListener
-    PcmStream(PcmListener* pcmListener, const StreamUri& uri);
+    /// ctor. Encoded PCM data is passed to the PcmListener, the encoders run on "ioc"
+    PcmStream(PcmListener* pcmListener, boost::asio::io_context& ioc, const StreamUri& uri);
     virtual ~PcmStream();
 
     virtual void start();
@@ -76,7 +110,14 @@ public:
 
     /// Implementation of EncoderListener::onChunkEncoded
     void onChunkEncoded(const encoder::Encoder* encoder, msg::PcmChunk* chunk, double duration) override;
-    virtual std::shared_ptr<msg::CodecHeader> getHeader();
+    virtual std::shared_ptr<msg::CodecHeader> getHeader(size_t encoding = 0);
+    /// Index of the first of the stream's codecs that is in "codecs", 0 if none or if "codecs" is empty
+    size_t getEncoding(const std::vector<std::string>& codecs) const;
+    /// Name of the codec of "encoding"
+    std::string getCodec(size_t encoding) const;
+    /// Encodings a client of "encoding" can be switched between without a new codec header, in the order of the stream's codecs.
+    /// These are all opus encodings (e.g. "opus:BITRATE:256000|opus:BITRATE:128000|opus:BITRATE:64000"), for other codecs just "encoding"
+    std::vector<size_t> getLadder(size_t encoding) const;
 
     virtual const StreamUri& getUri() const;
     virtual const std::string& getName() const;
@@ -91,22 +132,68 @@ public:
 
 
 protected:
-    std::condition_variable cv_;
-    std::mutex mtx_;
-    std::thread thread_;
+    /// The protocol's time base
+    using clock = chronos::clk;
+
+    /// Upper bounds of the pacing jitter histogram buckets [us], the last bucket takes the rest
+    static constexpr std::array<uint32_t, 8> jitter_bounds_us{{25, 50, 100, 250, 500, 1000, 2000, 5000}};
+    /// Max. number of read chunks that are kept for reuse, more are allocated if the encoders fall behind
+    static constexpr size_t max_pooled_chunks = 8;
+
     std::atomic<bool> active_;
+    /// CPU time spent reading and encoding, add to it with a CpuTimer
+    std::atomic<uint64_t> cpuTimeNs_;
+    clock::time_point tpStart_;
+
+    /// An encoder with the position of its next encoded frame on the media clock
+    struct Encoding
+    {
+        Encoding(boost::asio::io_context& ioc, encoder::Encoder* encoder) : encoder(encoder), strand(ioc), clockGeneration(0)
+        {
+        }
+
+        std::unique_ptr<encoder::Encoder> encoder;
+        boost::asio::io_context::strand strand;
+        clock::time_point tpEncoded;
+        /// The clock has been reset, if this differs from the stream's clockGeneration_
+        uint32_t clockGeneration;
+    };
 
-    virtual void worker() = 0;
-    virtual bool sleep(int32_t ms);
     void setState(const ReaderState& newState);
 
-    timeval tvEncodedChunk_;
+    /// Encode "chunk" that has been read at "position" of the media clock with all encoders. If the encoders still use it
+    /// on their strands, "chunk" is replaced by a free one from the pool, to be filled by the reader
+    void encode(std::shared_ptr<msg::PcmChunk>& chunk, const clock::time_point& position);
+    void encode(Encoding& encoding, const msg::PcmChunk* chunk, const clock::time_point& position, uint32_t clockGeneration);
+
+    /// Media clock: counts the frames that have been read since it has been anchored to the steady clock (CLOCK_MONOTONIC).
+    /// The readers pace themselves against it, it's not affected by steps of the system time.
+    /// (Re)anchor the clock at "now", the next chunk is due immediately
+    void resetClock(const clock::time_point& now);
+    /// Advance the clock by "frames" that have been read, returns when the next chunk is due
+    clock::time_point advanceClock(size_t frames);
+    /// Position of the clock, i.e. the time of the next frame to be read
+    clock::time_point clockPosition() const;
+    /// Convert a time point of the media clock into a protocol time stamp, the only place where this is done
+    static tv toProtocolTime(const clock::time_point& timePoint);
+    /// Add the lateness of a reader's wakeup to the pacing jitter histogram
+    void addPacingJitter(const clock::duration& late);
+
+    clock::time_point clockAnchor_;
+    uint64_t clockFrames_;
+    /// Incremented by resetClock
+    uint32_t clockGeneration_;
+    /// Read chunks that are handed to the encoders without a copy. A chunk is free, if the pool holds the only reference
+    std::vector<std::shared_ptr<msg::PcmChunk>> chunkPool_;
+    std::array<std::atomic<uint64_t>, jitter_bounds_us.size() + 1> pacingJitter_;
+    std::atomic<uint64_t> resyncs_;
+
     PcmListener* pcmListener_;
     StreamUri uri_;
     SampleFormat sampleFormat_;
     size_t pcmReadMs_;
     size_t dryoutMs_;
-    std::unique_ptr<encoder::Encoder> encoder_;
+    std::vector<std::unique_ptr<Encoding>> encodings_;
     std::string name_;
     ReaderState state_;
     std::shared_ptr<msg::StreamTags> meta_;
@@ -17,6 +17,7 @@
 ***/
 
 #include <cerrno>
+#include <cstring>
 #include <fcntl.h>
 #include <memory>
 #include <sys/stat.h>
@@ -33,7 +34,7 @@ using namespace std;
 
 
 
-PipeStream::PipeStream(PcmListener* pcmListener, const StreamUri& uri) : PcmStream(pcmListener, uri), fd_(-1)
+PipeStream::PipeStream(PcmListener* pcmListener, boost::asio::io_context& ioc, const StreamUri& uri) : PosixStream(pcmListener, ioc, uri)
 {
     umask(0);
     string mode = uri_.getQuery("mode", "create");
@@ -50,104 +51,27 @@ PipeStream::PipeStream(PcmListener* pcmListener, const StreamUri& uri) : PcmStre
 }
 
 
-PipeStream::~PipeStream()
+void PipeStream::connect()
 {
-    if (fd_ != -1)
-        close(fd_);
-}
-
-
-void PipeStream::worker()
-{
-    timeval tvChunk;
-    std::unique_ptr<msg::PcmChunk> chunk(new msg::PcmChunk(sampleFormat_, pcmReadMs_));
-    string lastException = "";
-
-    while (active_)
+    boost::system::error_code ec;
+    stream_.close(ec);
+    // being a writer ourselves, the pipe never signals EOF or hangup when the real writer goes away,
+    // the reactor wakes up only when data arrives. Fall back to read only, if we may not write.
+    int fd = ::open(uri_.path.c_str(), O_RDWR | O_NONBLOCK);
+    if (fd == -1)
+        fd = ::open(uri_.path.c_str(), O_RDONLY | O_NONBLOCK);
+    if (fd == -1)
     {
-        if (fd_ != -1)
-            close(fd_);
-        fd_ = open(uri_.path.c_str(), O_RDONLY | O_NONBLOCK);
-        chronos::systemtimeofday(&tvChunk);
-        tvEncodedChunk_ = tvChunk;
-        long nextTick = chronos::getTickCount();
-        int idleBytes = 0;
-        int maxIdleBytes = sampleFormat_.rate * sampleFormat_.frameSize * dryoutMs_ / 1000;
-        try
-        {
-            if (fd_ == -1)
-                throw SnapException("failed to open fifo: \"" + uri_.path + "\"");
-
-            while (active_)
-            {
-                chunk->timestamp.sec = tvChunk.tv_sec;
-                chunk->timestamp.usec = tvChunk.tv_usec;
-                int toRead = chunk->payloadSize;
-                int len = 0;
-                do
-                {
-                    int count = read(fd_, chunk->payload + len, toRead - len);
-                    if (count < 0 && idleBytes < maxIdleBytes)
-                    {
-                        memset(chunk->payload + len, 0, toRead - len);
-                        idleBytes += toRead - len;
-                        len += toRead - len;
-                        continue;
-                    }
-                    if (count < 0)
-                    {
-                        setState(kIdle);
-                        if (!sleep(100))
-                            break;
-                    }
-                    else if (count == 0)
-                        throw SnapException("end of file");
-                    else
-                    {
-                        len += count;
-                        idleBytes = 0;
-                    }
-                } while ((len < toRead) && active_);
-
-                if (!active_)
-                    break;
-
-                /// TODO: use less raw pointers, make this encoding more transparent
-                encoder_->encode(chunk.get());
-
-                if (!active_)
-                    break;
-
-                nextTick += pcmReadMs_;
-                chronos::addUs(tvChunk, pcmReadMs_ * 1000);
-                long currentTick = chronos::getTickCount();
-
-                if (nextTick >= currentTick)
-                {
-                    setState(kPlaying);
-                    if (!sleep(nextTick - currentTick))
-                        break;
-                }
-                else
-                {
-                    chronos::systemtimeofday(&tvChunk);
-                    tvEncodedChunk_ = tvChunk;
-                    pcmListener_->onResync(this, currentTick - nextTick);
-                    nextTick = currentTick;
-                }
+        onError("failed to open fifo: \"" + uri_.path + "\"");
+        return;
+    }
 
-                lastException = "";
-            }
-        }
-        catch (const std::exception& e)
-        {
-            if (lastException != e.what())
-            {
-                LOG(ERROR) << "(PipeStream) Exception: " << e.what() << std::endl;
-                lastException = e.what();
-            }
-            if (!sleep(100))
-                break;
-        }
+    stream_.assign(fd, ec);
+    if (ec)
+    {
+        ::close(fd);
+        onError("failed to assign fifo: " + ec.message());
+        return;
     }
+    waitForData();
 }
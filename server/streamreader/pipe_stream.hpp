@@ -19,7 +19,7 @@
 #ifndef PIPE_STREAM_H
 #define PIPE_STREAM_H
 
-#include "pcm_stream.hpp"
+#include "posix_stream.hpp"
 
 
 
@@ -29,16 +29,15 @@
  * Implements EncoderListener to get the encoded data.
  * Data is passed to the PcmListener
  */
-class PipeStream : public PcmStream
+class PipeStream : public PosixStream
 {
 public:
     /// ctor. Encoded PCM data is passed to the PipeListener
-    PipeStream(PcmListener* pcmListener, const StreamUri& uri);
-    ~PipeStream() override;
+    PipeStream(PcmListener* pcmListener, boost::asio::io_context& ioc, const StreamUri& uri);
 
 protected:
-    void worker() override;
-    int fd_;
+    /// (Re)open the pipe and wait for data
+    void connect() override;
 };
 
 
@@ -0,0 +1,220 @@
+/***
+    This file is part of snapcast
+    Copyright (C) 2014-2019  Johannes Pohl
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <unistd.h>
+
+#include "common/aixlog.hpp"
+#include "common/str_compat.hpp"
+#include "posix_stream.hpp"
+
+
+using namespace std;
+
+
+constexpr std::chrono::milliseconds PosixStream::max_catch_up;
+
+
+
+PosixStream::PosixStream(PcmListener* pcmListener, boost::asio::io_context& ioc, const StreamUri& uri)
+    : PcmStream(pcmListener, ioc, uri), strand_(ioc), stream_(ioc), timer_(ioc), reconnectDelay_(100), len_(0), idleBytes_(0)
+{
+}
+
+
+void PosixStream::start()
+{
+    PcmStream::start();
+    chunk_.reset(new msg::PcmChunk(sampleFormat_, pcmReadMs_));
+    std::weak_ptr<PcmStream> self = shared_from_this();
+    boost::asio::post(strand_, [this, self] {
+        auto stream = self.lock();
+        if (!stream || !active_)
+            return;
+        CpuTimer cpuTimer(cpuTimeNs_);
+        len_ = 0;
+        connect();
+    });
+}
+
+
+void PosixStream::stop()
+{
+    if (!active_)
+        return;
+
+    // handlers that are already running see active_ == false, pending ones are cancelled on the strand
+    PcmStream::stop();
+    std::weak_ptr<PcmStream> self = shared_from_this();
+    boost::asio::post(strand_, [this, self] {
+        auto stream = self.lock();
+        if (!stream)
+            return;
+        boost::system::error_code ec;
+        timer_.cancel(ec);
+        disconnect();
+    });
+}
+
+
+void PosixStream::disconnect()
+{
+    boost::system::error_code ec;
+    stream_.close(ec);
+}
+
+
+ssize_t PosixStream::doRead(char* buffer, size_t count)
+{
+    return ::read(stream_.native_handle(), buffer, count);
+}
+
+
+void PosixStream::waitForData()
+{
+    std::weak_ptr<PcmStream> self = shared_from_this();
+    stream_.async_wait(boost::asio::posix::stream_descriptor::wait_read,
+                       boost::asio::bind_executor(strand_, [this, self](const boost::system::error_code& ec) {
+                           auto stream = self.lock();
+                           if (!stream || !active_ || (ec == boost::asio::error::operation_aborted))
+                               return;
+                           CpuTimer cpuTimer(cpuTimeNs_);
+                           if (ec)
+                               onError(ec.message());
+                           else
+                               startReading();
+                       }));
+}
+
+
+void PosixStream::startReading()
+{
+    resetClock(clock::now());
+    idleBytes_ = 0;
+    readChunk();
+}
+
+
+void PosixStream::readChunk()
+{
+    if (!active_)
+        return;
+
+    size_t maxIdleBytes = sampleFormat_.rate * sampleFormat_.frameSize * dryoutMs_ / 1000;
+    while (len_ < chunk_->payloadSize)
+    {
+        ssize_t count = doRead(chunk_->payload + len_, chunk_->payloadSize - len_);
+        if (count > 0)
+        {
+            len_ += count;
+            idleBytes_ = 0;
+        }
+        else if (count == 0)
+        {
+            onError("end of file");
+            return;
+        }
+        else if (errno == EINTR)
+        {
+            continue;
+        }
+        else if (errno != EAGAIN)
+        {
+            onError("failed to read: " + cpt::to_string(errno));
+            return;
+        }
+        else if (idleBytes_ < maxIdleBytes)
+        {
+            // ran dry: continue with silence for dryout_ms
+            memset(chunk_->payload + len_, 0, chunk_->payloadSize - len_);
+            idleBytes_ += chunk_->payloadSize - len_;
+            len_ = chunk_->payloadSize;
+        }
+        else
+        {
+            setState(kIdle);
+            waitForData();
+            return;
+        }
+    }
+    len_ = 0;
+
+    auto position = clockPosition();
+    encode(chunk_, position);
+    if (!active_)
+        return;
+
+    auto nextTick = advanceClock(chunk_->getFrameCount());
+    auto now = clock::now();
+    std::weak_ptr<PcmStream> self = shared_from_this();
+    if (nextTick >= now)
+    {
+        setState(kPlaying);
+        lastException_ = "";
+        timer_.expires_at(nextTick);
+        timer_.async_wait(boost::asio::bind_executor(strand_, [this, self](const boost::system::error_code& ec) {
+            auto stream = self.lock();
+            if (!stream || ec)
+                return;
+            CpuTimer cpuTimer(cpuTimeNs_);
+            addPacingJitter(clock::now() - timer_.expiry());
+            readChunk();
+        }));
+        return;
+    }
+
+    // late: read the next chunk right away, the time stamps stay continuous while the backlog is read.
+    // Only if it's too late for this, continue with the current time.
+    if (now - nextTick > max_catch_up)
+    {
+        ++resyncs_;
+        pcmListener_->onResync(this, std::chrono::duration<double, std::milli>(now - nextTick).count());
+        resetClock(now);
+    }
+    boost::asio::post(strand_, [this, self] {
+        auto stream = self.lock();
+        if (!stream)
+            return;
+        CpuTimer cpuTimer(cpuTimeNs_);
+        readChunk();
+    });
+}
+
+
+void PosixStream::onError(const std::string& error)
+{
+    if (lastException_ != error)
+    {
+        LOG(ERROR) << "(" << getName() << ") Exception: " << error << std::endl;
+        lastException_ = error;
+    }
+
+    disconnect();
+    len_ = 0;
+    std::weak_ptr<PcmStream> self = shared_from_this();
+    timer_.expires_after(reconnectDelay_);
+    timer_.async_wait(boost::asio::bind_executor(strand_, [this, self](const boost::system::error_code& ec) {
+        auto stream = self.lock();
+        if (!stream || ec || !active_)
+            return;
+        CpuTimer cpuTimer(cpuTimeNs_);
+        connect();
+    }));
+}
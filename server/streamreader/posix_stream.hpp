@@ -0,0 +1,76 @@
+/***
+    This file is part of snapcast
+    Copyright (C) 2014-2019  Johannes Pohl
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#ifndef POSIX_STREAM_H
+#define POSIX_STREAM_H
+
+#include "pcm_stream.hpp"
+#include <boost/asio.hpp>
+#include <chrono>
+
+
+
+/// Reads PCM data from a file descriptor, driven by the stream readers' io_context
+/**
+ * Base for streams that read from a file descriptor without a thread of their own:
+ * an idle stream waits for the descriptor to become readable, a playing stream reads
+ * and encodes a chunk per timer tick. All handlers of a stream run on its strand.
+ */
+class PosixStream : public PcmStream
+{
+public:
+    /// A reader that is late by up to this, catches up by reading the next chunks right away. Beyond, the media clock is reset
+    static constexpr std::chrono::milliseconds max_catch_up{500};
+
+    /// ctor. Encoded PCM data is passed to the PcmListener
+    PosixStream(PcmListener* pcmListener, boost::asio::io_context& ioc, const StreamUri& uri);
+
+    void start() override;
+    void stop() override;
+
+protected:
+    /// Open stream_ and call waitForData(), or onError() on failure. Runs on the strand
+    virtual void connect() = 0;
+    /// Close stream_. Runs on the strand
+    virtual void disconnect();
+    /// Read up to "count" bytes into "buffer", returns the number of bytes, 0 on end of file and -1 with errno on error
+    virtual ssize_t doRead(char* buffer, size_t count);
+
+    /// Wait until stream_ becomes readable
+    void waitForData();
+    /// (Re)start the media clock and read the first chunk
+    void startReading();
+    /// Read and encode the chunk that is due now
+    void readChunk();
+    /// Log "error", disconnect and reconnect after reconnectDelay_
+    void onError(const std::string& error);
+
+    boost::asio::io_context::strand strand_;
+    boost::asio::posix::stream_descriptor stream_;
+    boost::asio::steady_timer timer_;
+    std::chrono::milliseconds reconnectDelay_;
+    std::shared_ptr<msg::PcmChunk> chunk_;
+    /// Bytes of chunk_ that have been read
+    size_t len_;
+    /// Bytes of silence that have been inserted since the stream ran dry
+    size_t idleBytes_;
+    std::string lastException_;
+};
+
+
+#endif
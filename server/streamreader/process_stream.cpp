@@ -31,8 +31,10 @@ using namespace std;
 
 
 
-ProcessStream::ProcessStream(PcmListener* pcmListener, const StreamUri& uri) : PcmStream(pcmListener, uri), path_(""), process_(nullptr)
+ProcessStream::ProcessStream(PcmListener* pcmListener, boost::asio::io_context& ioc, const StreamUri& uri)
+    : PosixStream(pcmListener, ioc, uri), path_(""), process_(nullptr), stderr_(ioc)
 {
+    reconnectDelay_ = std::chrono::seconds(30);
     params_ = uri_.getQuery("params");
     logStderr_ = (uri_.getQuery("logStderr", "false") == "true");
 }
@@ -100,19 +102,39 @@ void ProcessStream::initExeAndPath(const std::string& filename)
 void ProcessStream::start()
 {
     initExeAndPath(uri_.path);
-    PcmStream::start();
+    PosixStream::start();
 }
 
 
-void ProcessStream::stop()
+void ProcessStream::connect()
+{
+    process_.reset(new Process(path_ + exe_ + " " + params_, path_));
+    int flags = fcntl(process_->getStdout(), F_GETFL, 0);
+    fcntl(process_->getStdout(), F_SETFL, flags | O_NONBLOCK);
+
+    // the descriptors own duplicates, process_ closes the originals
+    boost::system::error_code ec;
+    stream_.assign(dup(process_->getStdout()), ec);
+    if (!ec)
+        stderr_.assign(dup(process_->getStderr()), ec);
+    if (ec)
+    {
+        onError("failed to assign process output: " + ec.message());
+        return;
+    }
+
+    readStderr();
+    waitForData();
+}
+
+
+void ProcessStream::disconnect()
 {
     if (process_)
         process_->kill();
-    PcmStream::stop();
-
-    /// thread is detached, so it is not joinable
-    if (stderrReaderThread_.joinable())
-        stderrReaderThread_.join();
+    boost::system::error_code ec;
+    stderr_.close(ec);
+    PosixStream::disconnect();
 }
 
 
@@ -127,110 +149,16 @@ void ProcessStream::onStderrMsg(const char* buffer, size_t n)
 }
 
 
-void ProcessStream::stderrReader()
+void ProcessStream::readStderr()
 {
-    size_t buffer_size = 8192;
-    auto buffer = std::unique_ptr<char[]>(new char[buffer_size]);
-    ssize_t n;
-    stringstream message;
-    while (active_ && (n = read(process_->getStderr(), buffer.get(), buffer_size)) > 0)
-        onStderrMsg(buffer.get(), n);
-}
-
-
-void ProcessStream::worker()
-{
-    timeval tvChunk;
-    std::unique_ptr<msg::PcmChunk> chunk(new msg::PcmChunk(sampleFormat_, pcmReadMs_));
-    setState(kPlaying);
-    string lastException = "";
-
-    while (active_)
-    {
-        process_.reset(new Process(path_ + exe_ + " " + params_, path_));
-        int flags = fcntl(process_->getStdout(), F_GETFL, 0);
-        fcntl(process_->getStdout(), F_SETFL, flags | O_NONBLOCK);
-
-        stderrReaderThread_ = thread(&ProcessStream::stderrReader, this);
-        stderrReaderThread_.detach();
-
-        chronos::systemtimeofday(&tvChunk);
-        tvEncodedChunk_ = tvChunk;
-        long nextTick = chronos::getTickCount();
-        int idleBytes = 0;
-        int maxIdleBytes = sampleFormat_.rate * sampleFormat_.frameSize * dryoutMs_ / 1000;
-        try
-        {
-            while (active_)
-            {
-                chunk->timestamp.sec = tvChunk.tv_sec;
-                chunk->timestamp.usec = tvChunk.tv_usec;
-                int toRead = chunk->payloadSize;
-                int len = 0;
-                do
-                {
-                    int count = read(process_->getStdout(), chunk->payload + len, toRead - len);
-                    if (count < 0 && idleBytes < maxIdleBytes)
-                    {
-                        memset(chunk->payload + len, 0, toRead - len);
-                        idleBytes += toRead - len;
-                        len += toRead - len;
-                        continue;
-                    }
-                    if (count < 0)
-                    {
-                        setState(kIdle);
-                        if (!sleep(100))
-                            break;
-                    }
-                    else if (count == 0)
-                        throw SnapException("end of file");
-                    else
-                    {
-                        len += count;
-                        idleBytes = 0;
-                    }
-                } while ((len < toRead) && active_);
-
-                if (!active_)
-                    break;
-
-                encoder_->encode(chunk.get());
-
-                if (!active_)
-                    break;
-
-                nextTick += pcmReadMs_;
-                chronos::addUs(tvChunk, pcmReadMs_ * 1000);
-                long currentTick = chronos::getTickCount();
-
-                if (nextTick >= currentTick)
-                {
-                    setState(kPlaying);
-                    if (!sleep(nextTick - currentTick))
-                        break;
-                }
-                else
-                {
-                    chronos::systemtimeofday(&tvChunk);
-                    tvEncodedChunk_ = tvChunk;
-                    pcmListener_->onResync(this, currentTick - nextTick);
-                    nextTick = currentTick;
-                }
-
-                lastException = "";
-            }
-        }
-        catch (const std::exception& e)
-        {
-            if (lastException != e.what())
-            {
-                LOG(ERROR) << "(PipeStream) Exception: " << e.what() << std::endl;
-                lastException = e.what();
-            }
-            process_->kill();
-            if (!sleep(30000))
-                break;
-        }
-    }
+    std::weak_ptr<PcmStream> self = shared_from_this();
+    stderr_.async_read_some(boost::asio::buffer(stderrBuffer_),
+                            boost::asio::bind_executor(strand_, [this, self](const boost::system::error_code& ec, std::size_t bytes) {
+                                auto stream = self.lock();
+                                if (!stream || !active_ || ec)
+                                    return;
+                                CpuTimer cpuTimer(cpuTimeNs_);
+                                onStderrMsg(stderrBuffer_.data(), bytes);
+                                readStderr();
+                            }));
 }
@@ -19,10 +19,11 @@
 #ifndef PROCESS_STREAM_H
 #define PROCESS_STREAM_H
 
+#include <array>
 #include <memory>
 #include <string>
 
-#include "pcm_stream.hpp"
+#include "posix_stream.hpp"
 #include "process.hpp"
 
 
@@ -32,26 +33,31 @@
  * Implements EncoderListener to get the encoded data.
  * Data is passed to the PcmListener
  */
-class ProcessStream : public PcmStream
+class ProcessStream : public PosixStream
 {
 public:
     /// ctor. Encoded PCM data is passed to the PipeListener
-    ProcessStream(PcmListener* pcmListener, const StreamUri& uri);
+    ProcessStream(PcmListener* pcmListener, boost::asio::io_context& ioc, const StreamUri& uri);
     ~ProcessStream() override;
 
     void start() override;
-    void stop() override;
 
 protected:
     std::string exe_;
     std::string path_;
     std::string params_;
     std::unique_ptr<Process> process_;
-    std::thread stderrReaderThread_;
+    /// stderr of process_, read asynchronously on the strand
+    boost::asio::posix::stream_descriptor stderr_;
+    std::array<char, 8192> stderrBuffer_;
     bool logStderr_;
 
-    void worker() override;
-    virtual void stderrReader();
+    /// Start the process and wait for data on its stdout
+    void connect() override;
+    /// Kill the process
+    void disconnect() override;
+    /// Read stderr until the process closes it
+    void readStderr();
     virtual void onStderrMsg(const char* buffer, size_t n);
     virtual void initExeAndPath(const std::string& filename);
 
@@ -31,12 +31,20 @@
 using namespace std;
 
 
-StreamManager::StreamManager(PcmListener* pcmListener, const std::string& defaultSampleFormat, const std::string& defaultCodec, size_t defaultReadBufferMs)
-    : pcmListener_(pcmListener), sampleFormat_(defaultSampleFormat), codec_(defaultCodec), readBufferMs_(defaultReadBufferMs)
+StreamManager::StreamManager(PcmListener* pcmListener, size_t readerThreads, const std::string& defaultSampleFormat, const std::string& defaultCodec,
+                             size_t defaultReadBufferMs)
+    : work_(boost::asio::make_work_guard(ioc_)), numReaderThreads_(std::max(readerThreads, size_t(1))), pcmListener_(pcmListener),
+      sampleFormat_(defaultSampleFormat), codec_(defaultCodec), readBufferMs_(defaultReadBufferMs)
 {
 }
 
 
+StreamManager::~StreamManager()
+{
+    stop();
+}
+
+
 PcmStreamPtr StreamManager::addStream(const std::string& uri)
 {
     StreamUri streamUri(uri);
@@ -59,23 +67,23 @@ PcmStreamPtr StreamManager::addStream(const std::string& uri)
 
     if (streamUri.scheme == "pipe")
     {
-        stream = make_shared<PipeStream>(pcmListener_, streamUri);
+        stream = make_shared<PipeStream>(pcmListener_, ioc_, streamUri);
     }
     else if (streamUri.scheme == "file")
     {
-        stream = make_shared<FileStream>(pcmListener_, streamUri);
+        stream = make_shared<FileStream>(pcmListener_, ioc_, streamUri);
     }
     else if (streamUri.scheme == "process")
     {
-        stream = make_shared<ProcessStream>(pcmListener_, streamUri);
+        stream = make_shared<ProcessStream>(pcmListener_, ioc_, streamUri);
     }
     else if ((streamUri.scheme == "spotify") || (streamUri.scheme == "librespot"))
     {
-        stream = make_shared<LibrespotStream>(pcmListener_, streamUri);
+        stream = make_shared<LibrespotStream>(pcmListener_, ioc_, streamUri);
     }
     else if (streamUri.scheme == "airplay")
     {
-        stream = make_shared<AirplayStream>(pcmListener_, streamUri);
+        stream = make_shared<AirplayStream>(pcmListener_, ioc_, streamUri);
     }
     else
     {
@@ -135,6 +143,10 @@ const PcmStreamPtr StreamManager::getStream(const std::string& id)
 
 void StreamManager::start()
 {
+    LOG(DEBUG) << "Starting " << numReaderThreads_ << " stream reader threads\n";
+    for (size_t n = readerThreads_.size(); n < numReaderThreads_; ++n)
+        readerThreads_.emplace_back([this] { ioc_.run(); });
+
     for (auto stream : streams_)
         stream->start();
 }
@@ -144,6 +156,12 @@ void StreamManager::stop()
 {
     for (auto stream : streams_)
         stream->stop();
+
+    // let the streams close their descriptors and kill their processes, the threads return when there is no more work
+    work_.reset();
+    for (auto& thread : readerThreads_)
+        thread.join();
+    readerThreads_.clear();
 }
 
 
@@ -2,8 +2,10 @@
 #define PCM_READER_FACTORY_H
 
 #include "pcm_stream.hpp"
+#include <boost/asio.hpp>
 #include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
 typedef std::shared_ptr<PcmStream> PcmStreamPtr;
@@ -11,7 +13,10 @@ typedef std::shared_ptr<PcmStream> PcmStreamPtr;
 class StreamManager
 {
 public:
-    StreamManager(PcmListener* pcmListener, const std::string& defaultSampleFormat, const std::string& defaultCodec, size_t defaultReadBufferMs = 20);
+    /// All streams are read on a shared pool of "readerThreads" threads
+    StreamManager(PcmListener* pcmListener, size_t readerThreads, const std::string& defaultSampleFormat, const std::string& defaultCodec,
+                  size_t defaultReadBufferMs = 20);
+    ~StreamManager();
 
     PcmStreamPtr addStream(const std::string& uri);
     void removeStream(const std::string& name);
@@ -23,6 +28,11 @@ public:
     json toJson() const;
 
 private:
+    /// Must outlive the streams, their descriptors and timers are bound to it
+    boost::asio::io_context ioc_;
+    boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work_;
+    std::vector<std::thread> readerThreads_;
+    size_t numReaderThreads_;
     std::vector<PcmStreamPtr> streams_;
     PcmListener* pcmListener_;
     std::string sampleFormat_;
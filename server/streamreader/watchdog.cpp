@@ -23,60 +23,69 @@
 using namespace std;
 
 
-Watchdog::Watchdog(WatchdogListener* listener) : listener_(listener), thread_(nullptr), active_(false)
+Watchdog::Watchdog(boost::asio::io_context& ioc, WatchdogListener* listener) : listener_(listener), strand_(ioc), timer_(ioc), timeoutMs_(0), active_(false)
 {
 }
 
 
 Watchdog::~Watchdog()
 {
-    stop();
+    boost::system::error_code ec;
+    timer_.cancel(ec);
 }
 
 
 void Watchdog::start(size_t timeoutMs)
 {
-    timeoutMs_ = timeoutMs;
-    if (!thread_ || !active_)
-    {
-        active_ = true;
-        thread_.reset(new thread(&Watchdog::worker, this));
-    }
-    else
-        trigger();
+    std::weak_ptr<Watchdog> self = shared_from_this();
+    boost::asio::post(strand_, [this, self, timeoutMs] {
+        if (auto watchdog = self.lock())
+        {
+            timeoutMs_ = timeoutMs;
+            active_ = true;
+            arm();
+        }
+    });
 }
 
 
 void Watchdog::stop()
 {
-    active_ = false;
-    trigger();
-    if (thread_ && thread_->joinable())
-        thread_->join();
-    thread_ = nullptr;
+    std::weak_ptr<Watchdog> self = shared_from_this();
+    boost::asio::post(strand_, [this, self] {
+        if (auto watchdog = self.lock())
+        {
+            active_ = false;
+            boost::system::error_code ec;
+            timer_.cancel(ec);
+        }
+    });
 }
 
 
 void Watchdog::trigger()
 {
-    //	std::unique_lock<std::mutex> lck(mtx_);
-    cv_.notify_one();
+    std::weak_ptr<Watchdog> self = shared_from_this();
+    boost::asio::post(strand_, [this, self] {
+        auto watchdog = self.lock();
+        if (watchdog && active_)
+            arm();
+    });
 }
 
 
-void Watchdog::worker()
+void Watchdog::arm()
 {
-    while (active_)
-    {
-        std::unique_lock<std::mutex> lck(mtx_);
-        if (cv_.wait_for(lck, std::chrono::milliseconds(timeoutMs_)) == std::cv_status::timeout)
-        {
-            if (listener_)
-            {
-                listener_->onTimeout(this, timeoutMs_);
-                break;
-            }
-        }
-    }
-    active_ = false;
+    std::weak_ptr<Watchdog> self = shared_from_this();
+    // re-arming cancels the pending wait
+    timer_.expires_after(std::chrono::milliseconds(timeoutMs_));
+    timer_.async_wait(boost::asio::bind_executor(strand_, [this, self](const boost::system::error_code& ec) {
+        auto watchdog = self.lock();
+        // a handler that has been queued before the timer was re-armed is outdated
+        if (!watchdog || ec || !active_ || (timer_.expiry() > std::chrono::steady_clock::now()))
+            return;
+        active_ = false;
+        if (listener_)
+            listener_->onTimeout(this, timeoutMs_);
+    }));
 }
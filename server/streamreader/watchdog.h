@@ -19,11 +19,8 @@
 #ifndef WATCH_DOG_H
 #define WATCH_DOG_H
 
-#include <atomic>
-#include <condition_variable>
+#include <boost/asio.hpp>
 #include <memory>
-#include <mutex>
-#include <thread>
 
 
 class Watchdog;
@@ -37,10 +34,14 @@ public:
 
 
 /// Watchdog
-class Watchdog
+/**
+ * Calls WatchdogListener::onTimeout, if it has not been triggered for timeoutMs.
+ * Runs as a timer on "ioc", must be owned by a shared_ptr
+ */
+class Watchdog : public std::enable_shared_from_this<Watchdog>
 {
 public:
-    Watchdog(WatchdogListener* listener = nullptr);
+    Watchdog(boost::asio::io_context& ioc, WatchdogListener* listener = nullptr);
     virtual ~Watchdog();
 
     void start(size_t timeoutMs);
@@ -48,14 +49,14 @@ public:
     void trigger();
 
 private:
+    /// (Re)arm the timer, runs on the strand
+    void arm();
+
     WatchdogListener* listener_;
-    std::condition_variable cv_;
-    std::mutex mtx_;
-    std::unique_ptr<std::thread> thread_;
+    boost::asio::io_context::strand strand_;
+    boost::asio::steady_timer timer_;
     size_t timeoutMs_;
-    std::atomic<bool> active_;
-
-    void worker();
+    bool active_;
 };
 
 
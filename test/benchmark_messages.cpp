@@ -0,0 +1,410 @@
+/***
+    This file is part of snapcast
+    Copyright (C) 2014-2019  Johannes Pohl
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+***/
+
+/// Messages per second of the BufferWriter/BufferReader codec vs. the former iostream based codec, for WireChunk, Time and
+/// CodecHeader in protocol v2. Both must produce the same bytes, the benchmark fails otherwise.
+
+#include "common/endian.hpp"
+#include "message/codec_header.hpp"
+#include "message/time.hpp"
+#include "message/wire_chunk.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+namespace legacy
+{
+
+struct membuf : public std::basic_streambuf<char>
+{
+    membuf(char* begin, char* end)
+    {
+        this->setg(begin, begin, end);
+    }
+};
+
+
+/// The iostream based BaseMessage, as it was before the buffer writer/reader
+struct BaseMessage
+{
+    BaseMessage(uint16_t type_) : type(type_), id(0), refersTo(0), sentSec(0), sentUsec(0), receivedSec(0), receivedUsec(0), size(0)
+    {
+    }
+
+    virtual ~BaseMessage() = default;
+
+    virtual void read(std::istream& stream)
+    {
+        readVal(stream, type);
+        readVal(stream, id);
+        readVal(stream, refersTo);
+        readVal(stream, sentSec);
+        readVal(stream, sentUsec);
+        readVal(stream, receivedSec);
+        readVal(stream, receivedUsec);
+        readVal(stream, size);
+    }
+
+    void deserialize(char* payload)
+    {
+        membuf databuf(payload, payload + BaseMessage::getSize());
+        std::istream is(&databuf);
+        read(is);
+    }
+
+    void deserialize(const BaseMessage& baseMessage, char* payload)
+    {
+        type = baseMessage.type;
+        id = baseMessage.id;
+        refersTo = baseMessage.refersTo;
+        sentSec = baseMessage.sentSec;
+        sentUsec = baseMessage.sentUsec;
+        receivedSec = baseMessage.receivedSec;
+        receivedUsec = baseMessage.receivedUsec;
+        size = baseMessage.size;
+        membuf databuf(payload, payload + size);
+        std::istream is(&databuf);
+        read(is);
+    }
+
+    virtual void serialize(std::ostream& stream) const
+    {
+        writeVal(stream, type);
+        writeVal(stream, id);
+        writeVal(stream, refersTo);
+        writeVal(stream, sentSec);
+        writeVal(stream, sentUsec);
+        writeVal(stream, receivedSec);
+        writeVal(stream, receivedUsec);
+        size = getSize();
+        writeVal(stream, size);
+        doserialize(stream);
+    }
+
+    virtual uint32_t getSize() const
+    {
+        return 3 * sizeof(uint16_t) + 4 * sizeof(int32_t) + sizeof(uint32_t);
+    };
+
+    uint16_t type;
+    uint16_t id;
+    uint16_t refersTo;
+    int32_t sentSec;
+    int32_t sentUsec;
+    int32_t receivedSec;
+    int32_t receivedUsec;
+    mutable uint32_t size;
+
+protected:
+    void writeVal(std::ostream& stream, const uint16_t& val) const
+    {
+        uint16_t v = SWAP_16(val);
+        stream.write(reinterpret_cast<const char*>(&v), sizeof(uint16_t));
+    }
+
+    void writeVal(std::ostream& stream, const uint32_t& val) const
+    {
+        uint32_t v = SWAP_32(val);
+        stream.write(reinterpret_cast<const char*>(&v), sizeof(uint32_t));
+    }
+
+    void writeVal(std::ostream& stream, const int32_t& val) const
+    {
+        uint32_t v = SWAP_32(val);
+        stream.write(reinterpret_cast<const char*>(&v), sizeof(int32_t));
+    }
+
+    void writeVal(std::ostream& stream, const char* payload, const uint32_t& size) const
+    {
+        writeVal(stream, size);
+        stream.write(payload, size);
+    }
+
+    void writeVal(std::ostream& stream, const std::string& val) const
+    {
+        uint32_t size = val.size();
+        writeVal(stream, val.c_str(), size);
+    }
+
+    void readVal(std::istream& stream, uint16_t& val) const
+    {
+        stream.read(reinterpret_cast<char*>(&val), sizeof(uint16_t));
+        val = SWAP_16(val);
+    }
+
+    void readVal(std::istream& stream, uint32_t& val) const
+    {
+        stream.read(reinterpret_cast<char*>(&val), sizeof(uint32_t));
+        val = SWAP_32(val);
+    }
+
+    void readVal(std::istream& stream, int32_t& val) const
+    {
+        stream.read(reinterpret_cast<char*>(&val), sizeof(int32_t));
+        val = SWAP_32(val);
+    }
+
+    void readVal(std::istream& stream, char** payload, uint32_t& size) const
+    {
+        readVal(stream, size);
+        *payload = (char*)realloc(*payload, size);
+        stream.read(*payload, size);
+    }
+
+    void readVal(std::istream& stream, std::string& val) const
+    {
+        uint32_t size;
+        readVal(stream, size);
+        val.resize(size);
+        stream.read(&val[0], size);
+    }
+
+    virtual void doserialize(std::ostream& /*stream*/) const {};
+};
+
+
+struct WireChunk : public BaseMessage
+{
+    WireChunk(size_t size = 0) : BaseMessage(message_type::kWireChunk), sec(0), usec(0), payloadSize(size), payload(nullptr)
+    {
+        if (size > 0)
+            payload = (char*)malloc(size);
+    }
+
+    ~WireChunk() override
+    {
+        free(payload);
+    }
+
+    void read(std::istream& stream) override
+    {
+        readVal(stream, sec);
+        readVal(stream, usec);
+        readVal(stream, &payload, payloadSize);
+    }
+
+    uint32_t getSize() const override
+    {
+        return 2 * sizeof(int32_t) + sizeof(int32_t) + payloadSize;
+    }
+
+    int32_t sec;
+    int32_t usec;
+    uint32_t payloadSize;
+    char* payload;
+
+protected:
+    void doserialize(std::ostream& stream) const override
+    {
+        writeVal(stream, sec);
+        writeVal(stream, usec);
+        writeVal(stream, payload, payloadSize);
+    }
+};
+
+
+struct Time : public BaseMessage
+{
+    Time() : BaseMessage(message_type::kTime), sec(0), usec(0)
+    {
+    }
+
+    void read(std::istream& stream) override
+    {
+        readVal(stream, sec);
+        readVal(stream, usec);
+    }
+
+    uint32_t getSize() const override
+    {
+        return 2 * sizeof(int32_t);
+    }
+
+    int32_t sec;
+    int32_t usec;
+
+protected:
+    void doserialize(std::ostream& stream) const override
+    {
+        writeVal(stream, sec);
+        writeVal(stream, usec);
+    }
+};
+
+
+struct CodecHeader : public BaseMessage
+{
+    CodecHeader(const std::string& codecName = "", size_t size = 0) : BaseMessage(message_type::kCodecHeader), payloadSize(size), payload(nullptr), codec(codecName)
+    {
+        if (size > 0)
+            payload = (char*)malloc(size);
+    }
+
+    ~CodecHeader() override
+    {
+        free(payload);
+    }
+
+    void read(std::istream& stream) override
+    {
+        readVal(stream, codec);
+        readVal(stream, &payload, payloadSize);
+    }
+
+    uint32_t getSize() const override
+    {
+        return sizeof(uint32_t) + codec.size() + sizeof(uint32_t) + payloadSize;
+    }
+
+    uint32_t payloadSize;
+    char* payload;
+    std::string codec;
+
+protected:
+    void doserialize(std::ostream& stream) const override
+    {
+        writeVal(stream, codec);
+        writeVal(stream, payload, payloadSize);
+    }
+};
+
+} // namespace legacy
+
+
+namespace
+{
+
+/// A 20ms chunk of 48000:16:2 PCM
+static constexpr size_t chunk_size = 3840;
+/// Size of a FLAC stream header
+static constexpr size_t codec_header_size = 42;
+static constexpr size_t iterations = 200000;
+
+/// Millions of calls of "func" per second
+double measure(const std::function<size_t()>& func)
+{
+    size_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t n = 0; n < iterations; ++n)
+        sink += func();
+    std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+    if (sink == 0)
+        printf(" ");
+    return iterations / duration.count() / 1000000.;
+}
+
+
+/// Time stamps and payload of all messages, the same for both codecs
+void fill(char* payload, size_t size)
+{
+    for (size_t n = 0; n < size; ++n)
+        payload[n] = static_cast<char>(n * 7);
+}
+
+
+template <typename Legacy, typename Message>
+bool run(const char* name, const Legacy& legacyMsg, const Message& message)
+{
+    std::ostringstream oss;
+    legacyMsg.serialize(oss);
+    std::string legacyBytes = oss.str();
+    std::vector<char> bytes = message.serialize();
+    if ((legacyBytes.size() != bytes.size()) || (memcmp(legacyBytes.data(), bytes.data(), bytes.size()) != 0))
+    {
+        printf("%-12s serialized messages differ\n", name);
+        return false;
+    }
+
+    double legacySerialize = measure([&]() {
+        std::ostringstream oss;
+        legacyMsg.serialize(oss);
+        return oss.str().size();
+    });
+    double serialize = measure([&]() { return message.serialize().size(); });
+
+    double legacyParse = measure([&]() {
+        legacy::BaseMessage base(0);
+        base.deserialize(&legacyBytes[0]);
+        Legacy parsed;
+        parsed.deserialize(base, &legacyBytes[0] + base.getSize());
+        return static_cast<size_t>(parsed.size);
+    });
+    double parse = measure([&]() {
+        msg::BaseMessage base;
+        base.deserialize(bytes.data());
+        Message parsed;
+        parsed.deserialize(base, bytes.data() + msg::BaseMessage::header_size);
+        return static_cast<size_t>(parsed.size);
+    });
+
+    printf("%-12s %10.2f %10.2f %7.2fx %10.2f %10.2f %7.2fx\n", name, legacySerialize, serialize, serialize / legacySerialize, legacyParse, parse,
+           parse / legacyParse);
+    return true;
+}
+
+} // namespace
+
+
+int main(int /*argc*/, char** /*argv*/)
+{
+    const tv sent(1577836800, 123456);
+    const tv timestamp(1577836799, 987654);
+
+    legacy::WireChunk legacyChunk(chunk_size);
+    legacyChunk.sentSec = static_cast<int32_t>(sent.sec());
+    legacyChunk.sentUsec = sent.usec();
+    legacyChunk.sec = static_cast<int32_t>(timestamp.sec());
+    legacyChunk.usec = timestamp.usec();
+    fill(legacyChunk.payload, chunk_size);
+    msg::WireChunk chunk(chunk_size);
+    chunk.sent = sent;
+    chunk.received = tv(0, 0);
+    chunk.timestamp = timestamp;
+    fill(chunk.payload, chunk_size);
+
+    legacy::Time legacyTime;
+    legacyTime.id = 42;
+    legacyTime.sentSec = static_cast<int32_t>(sent.sec());
+    legacyTime.sentUsec = sent.usec();
+    legacyTime.usec = 1500;
+    msg::Time time;
+    time.id = 42;
+    time.sent = sent;
+    time.received = tv(0, 0);
+    time.latency = tv(0, 1500);
+
+    legacy::CodecHeader legacyHeader("flac", codec_header_size);
+    legacyHeader.sentSec = static_cast<int32_t>(sent.sec());
+    legacyHeader.sentUsec = sent.usec();
+    fill(legacyHeader.payload, codec_header_size);
+    msg::CodecHeader header("flac", codec_header_size);
+    header.sent = sent;
+    header.received = tv(0, 0);
+    fill(header.payload, codec_header_size);
+
+    printf("%-12s %10s %10s %8s %10s %10s %8s\n", "M msg/s", "ser. old", "ser. new", "", "parse old", "parse new", "");
+    bool ok = run("WireChunk", legacyChunk, chunk);
+    ok = run("Time", legacyTime, time) && ok;
+    ok = run("CodecHeader", legacyHeader, header) && ok;
+    return ok ? 0 : 1;
+}
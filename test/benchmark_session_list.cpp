@@ -0,0 +1,188 @@
+/***
+    This file is part of snapcast
+    Copyright (C) 2014-2019  Johannes Pohl
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+***/
+
+/// Micro-benchmark of the StreamServer session list: a recursive_mutex guarded vector of weak_ptrs that is copied into
+/// shared_ptrs for every chunk vs. the copy-on-write list that readers take a snapshot of with std::atomic_load.
+/// Every stream reader walks the list once per chunk, while a writer thread connects and disconnects sessions.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+/// Stand-in for a StreamSession
+struct Session
+{
+    std::atomic<size_t> chunks{0};
+};
+
+using session_ptr = std::shared_ptr<Session>;
+using session_list = std::vector<std::weak_ptr<Session>>;
+
+
+/// The session list before: readers lock and collect the live sessions
+class LockedList
+{
+public:
+    void add(const session_ptr& session)
+    {
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        sessions_.emplace_back(session);
+    }
+
+    void remove(const Session* session)
+    {
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        sessions_.erase(std::remove_if(sessions_.begin(), sessions_.end(), [session](const std::weak_ptr<Session>& s) { return s.lock().get() == session; }),
+                        sessions_.end());
+    }
+
+    void onChunk()
+    {
+        std::vector<session_ptr> sessions;
+        {
+            std::lock_guard<std::recursive_mutex> lock(mutex_);
+            for (const auto& session : sessions_)
+                if (auto s = session.lock())
+                    sessions.push_back(s);
+        }
+        for (const auto& session : sessions)
+            session->chunks.fetch_add(1, std::memory_order_relaxed);
+    }
+
+private:
+    std::recursive_mutex mutex_;
+    session_list sessions_;
+};
+
+
+/// The session list now: writers publish a modified copy, readers don't lock or allocate
+class CowList
+{
+public:
+    CowList() : sessions_(std::make_shared<session_list>())
+    {
+    }
+
+    void add(const session_ptr& session)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto sessions = std::make_shared<session_list>(*std::atomic_load(&sessions_));
+        sessions->emplace_back(session);
+        std::atomic_store(&sessions_, std::shared_ptr<const session_list>(sessions));
+    }
+
+    void remove(const Session* session)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto sessions = std::make_shared<session_list>(*std::atomic_load(&sessions_));
+        sessions->erase(std::remove_if(sessions->begin(), sessions->end(), [session](const std::weak_ptr<Session>& s) { return s.lock().get() == session; }),
+                        sessions->end());
+        std::atomic_store(&sessions_, std::shared_ptr<const session_list>(sessions));
+    }
+
+    void onChunk()
+    {
+        auto sessions = std::atomic_load(&sessions_);
+        for (const auto& session : *sessions)
+            if (auto s = session.lock())
+                s->chunks.fetch_add(1, std::memory_order_relaxed);
+    }
+
+private:
+    std::mutex mutex_;
+    std::shared_ptr<const session_list> sessions_;
+};
+
+
+/// Chunks per second of "readers" threads walking a list of "count" sessions, "churn" reconnects per second
+template <typename List>
+double run(size_t count, size_t readers, size_t churn)
+{
+    static constexpr auto duration = std::chrono::milliseconds(500);
+    List list;
+    std::vector<session_ptr> sessions;
+    for (size_t n = 0; n < count; ++n)
+    {
+        sessions.push_back(std::make_shared<Session>());
+        list.add(sessions.back());
+    }
+
+    std::atomic<bool> active(true);
+    std::atomic<size_t> chunks(0);
+    std::vector<std::thread> threads;
+    for (size_t n = 0; n < readers; ++n)
+    {
+        threads.emplace_back([&]() {
+            size_t local = 0;
+            while (active)
+            {
+                list.onChunk();
+                ++local;
+            }
+            chunks += local;
+        });
+    }
+    if (churn > 0)
+    {
+        threads.emplace_back([&]() {
+            size_t n = 0;
+            while (active)
+            {
+                auto& session = sessions[n++ % sessions.size()];
+                list.remove(session.get());
+                session = std::make_shared<Session>();
+                list.add(session);
+                std::this_thread::sleep_for(std::chrono::microseconds(1000000 / churn));
+            }
+        });
+    }
+
+    std::this_thread::sleep_for(duration);
+    active = false;
+    for (auto& thread : threads)
+        thread.join();
+    return chunks / std::chrono::duration<double>(duration).count();
+}
+
+} // namespace
+
+
+int main(int /*argc*/, char** /*argv*/)
+{
+    static constexpr size_t readers = 4;
+    static constexpr size_t churn = 100;
+    printf("%8s %8s %8s %16s %16s %8s\n", "sessions", "readers", "churn/s", "locked chunk/s", "cow chunk/s", "speedup");
+    for (size_t count : {10, 100, 1000})
+    {
+        for (size_t threads : {size_t(1), readers})
+        {
+            double locked = run<LockedList>(count, threads, churn);
+            double cow = run<CowList>(count, threads, churn);
+            printf("%8zu %8zu %8zu %16.0f %16.0f %7.2fx\n", count, threads, churn, locked, cow, cow / locked);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,221 @@
+/***
+    This file is part of snapcast
+    Copyright (C) 2014-2019  Johannes Pohl
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+***/
+
+/// Offline simulator of the servo sync mode (Stream::getPlayerChunk with --sync=servo).
+/// A trace holds one line "age_us [dac_delay_us]" per playback period, recorded at a fixed rate without sync corrections, i.e.
+/// the open loop phase error. The measured age is the sum of both columns. Corrections shift the phase, so the closed loop
+/// age is the trace's age minus the accumulated correction. Without a trace, a seeded synthetic one is used.
+/// Reports the convergence time, the residual jitter and skew, and the estimated frequency offset. These are taken from the
+/// phase error without the measurement noise, which is known for synthetic traces only.
+
+#include "clock_servo.hpp"
+#include "common/popl.hpp"
+#include "double_buffer.hpp"
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace popl;
+
+namespace
+{
+
+/// Age of a period with no correction applied [us]
+struct Sample
+{
+    /// Measured age, i.e. phase error plus noise
+    double age;
+    double noise;
+};
+
+
+vector<Sample> loadTrace(const string& filename)
+{
+    vector<Sample> trace;
+    ifstream ifs(filename);
+    if (!ifs)
+        throw runtime_error("failed to open " + filename);
+    string line;
+    while (getline(ifs, line))
+    {
+        if (line.empty() || (line[0] == '#'))
+            continue;
+        istringstream iss(line);
+        double age(0.), dac(0.);
+        if (!(iss >> age))
+            continue;
+        iss >> dac;
+        trace.push_back({age + dac, 0.});
+    }
+    return trace;
+}
+
+
+/// A DAC that is "ppm" slower than the server, with gaussian measurement noise of "noise" [us]
+vector<Sample> synthesize(size_t periods, double period, double ppm, double noise, unsigned int seed)
+{
+    mt19937 rng(seed);
+    normal_distribution<double> jitter(0., noise);
+    vector<Sample> trace(periods);
+    for (size_t n = 0; n < periods; ++n)
+    {
+        trace[n].noise = jitter(rng);
+        trace[n].age = n * period * ppm + trace[n].noise;
+    }
+    return trace;
+}
+
+
+struct Result
+{
+    /// Time after which the mean phase error over "window" periods stays within the tolerance [s], < 0 if it doesn't converge
+    double convergence;
+    /// RMS and max. phase error after convergence [us]
+    double jitter;
+    double skew;
+    size_t hardCorrections;
+    double ppm;
+};
+
+
+Result simulate(const vector<Sample>& trace, double period, double offset, double tolerance, size_t window)
+{
+    ClockServo servo;
+    DoubleBuffer<double> miniBuffer(ClockServo::hard_correction_window);
+    double correction = 0.;
+    double sleep = 0.;
+    double rateRatio = 1.;
+    Result result{0., 0., 0., 0, 0.};
+    vector<double> errors(trace.size());
+
+    for (size_t n = 0; n < trace.size(); ++n)
+    {
+        if (sleep != 0.)
+        {
+            double step = max<double>(-ClockServo::hard_correction_step_us, min<double>(ClockServo::hard_correction_step_us, sleep));
+            sleep -= step;
+            correction += step;
+        }
+
+        double age = trace[n].age + offset - correction;
+        if (sleep == 0.)
+        {
+            if (ClockServo::needsHardCorrection(miniBuffer))
+            {
+                sleep = miniBuffer.median();
+                servo.reset();
+                ++result.hardCorrections;
+            }
+            else
+            {
+                rateRatio = servo.update(age, period);
+            }
+        }
+        miniBuffer.add(age);
+        errors[n] = age - trace[n].noise;
+        // the rate applies to the playback of the next period
+        correction += (rateRatio - 1.) * period * 1000000.;
+    }
+
+    size_t converged = 0;
+    double sum = 0.;
+    for (size_t n = 0; n < errors.size(); ++n)
+    {
+        sum += errors[n];
+        if (n >= window)
+            sum -= errors[n - window];
+        if ((n + 1 >= window) && (abs(sum / window) > tolerance))
+            converged = n + 1;
+    }
+    if (converged >= errors.size())
+    {
+        result.convergence = -1.;
+        return result;
+    }
+
+    result.convergence = converged * period;
+    double squares = 0.;
+    for (size_t n = converged; n < errors.size(); ++n)
+    {
+        squares += errors[n] * errors[n];
+        result.skew = max(result.skew, abs(errors[n]));
+    }
+    result.jitter = sqrt(squares / (errors.size() - converged));
+    result.ppm = servo.ppm();
+    return result;
+}
+
+} // namespace
+
+
+int main(int argc, char** argv)
+{
+    try
+    {
+        string traceFile;
+        double periodMs, offset, tolerance, ppm, noise, duration;
+        unsigned int seed;
+
+        OptionParser op("Allowed options");
+        auto helpSwitch = op.add<Switch>("", "help", "produce help message");
+        op.add<Value<string>>("t", "trace", "trace file with one \"age_us [dac_delay_us]\" line per period, synthetic if empty", "", &traceFile);
+        op.add<Value<double>>("", "period", "playback period [ms]", 20., &periodMs);
+        op.add<Value<double>>("", "offset", "phase error at the start of the playback [us]", 2000., &offset);
+        op.add<Value<double>>("", "tolerance", "max. mean error over 1s of a converged servo [us]", 100., &tolerance);
+        op.add<Value<double>>("", "ppm", "synthetic trace: frequency offset of the DAC [ppm]", 50., &ppm);
+        op.add<Value<double>>("", "noise", "synthetic trace: standard deviation of the measured age [us]", 300., &noise);
+        op.add<Value<double>>("", "duration", "synthetic trace: duration [s]", 120., &duration);
+        op.add<Value<unsigned int>>("", "seed", "synthetic trace: random seed", 1, &seed);
+        op.parse(argc, argv);
+
+        if (helpSwitch->is_set())
+        {
+            cout << op << "\n";
+            return 0;
+        }
+
+        double period = periodMs / 1000.;
+        vector<Sample> trace = traceFile.empty() ? synthesize(static_cast<size_t>(duration / period), period, ppm, noise, seed) : loadTrace(traceFile);
+        if (trace.empty())
+            throw runtime_error("empty trace");
+
+        size_t window = max<size_t>(static_cast<size_t>(1. / period), 1);
+        Result result = simulate(trace, period, offset, tolerance, window);
+        printf("periods:          %zu (%.1fs)\n", trace.size(), trace.size() * period);
+        printf("hard corrections: %zu\n", result.hardCorrections);
+        if (result.convergence < 0)
+        {
+            printf("not converged within %.0fus\n", tolerance);
+            return 1;
+        }
+        printf("convergence:      %.2fs\n", result.convergence);
+        printf("residual jitter:  %.1fus RMS, %.1fus max\n", result.jitter, result.skew);
+        printf("rate correction:  %.1fppm\n", result.ppm);
+    }
+    catch (const std::exception& e)
+    {
+        cerr << "Exception: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,182 @@
+/***
+    This file is part of snapcast
+    Copyright (C) 2014-2019  Johannes Pohl
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+***/
+
+/// Loopback tests of the multicast datagram framing: mcast::Encoder => (loss, reordering) => mcast::Decoder
+
+#include "common/multicast.hpp"
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace
+{
+
+int failures = 0;
+
+#define CHECK(expr)                                                                                                                                            \
+    do                                                                                                                                                         \
+    {                                                                                                                                                          \
+        if (!(expr))                                                                                                                                           \
+        {                                                                                                                                                      \
+            printf("%s:%d: %s: CHECK(%s) failed\n", __FILE__, __LINE__, name, #expr);                                                                         \
+            ++failures;                                                                                                                                        \
+        }                                                                                                                                                      \
+    } while (false)
+
+
+using Datagram = std::vector<char>;
+
+std::vector<char> makeMessage(size_t size, size_t index)
+{
+    std::vector<char> message(size);
+    for (size_t n = 0; n < size; ++n)
+        message[n] = static_cast<char>(n * 13 + index);
+    return message;
+}
+
+
+bool isParity(const Datagram& datagram)
+{
+    return (datagram[4] == mcast::kParity);
+}
+
+
+/// Encode "count" messages of "size" bytes, pass the datagrams through "channel" and decode them
+/// @return number of messages that arrived intact
+size_t loopback(mcast::Decoder& decoder, size_t count, size_t size, size_t fecGroup, const std::function<std::vector<Datagram>(std::vector<Datagram>)>& channel)
+{
+    mcast::Encoder encoder(fecGroup);
+    std::vector<Datagram> datagrams;
+    for (size_t n = 0; n < count; ++n)
+    {
+        auto message = makeMessage(size, n);
+        encoder.encode(message.data(), message.size(), [&datagrams](const char* data, size_t size) { datagrams.emplace_back(data, data + size); });
+    }
+
+    size_t received = 0;
+    size_t index = 0;
+    for (const auto& datagram : channel(std::move(datagrams)))
+    {
+        decoder.decode(datagram.data(), datagram.size(), [&](char* data, size_t size) {
+            // messages may be lost, but must arrive in order
+            while ((index < count) && (makeMessage(size, index) != std::vector<char>(data, data + size)))
+                ++index;
+            if (index < count)
+            {
+                ++received;
+                ++index;
+            }
+        });
+    }
+    return received;
+}
+
+
+std::vector<Datagram> lossless(std::vector<Datagram> datagrams)
+{
+    return datagrams;
+}
+
+
+/// Messages with more fragments than the decoder's loss window
+void testLargeMessages()
+{
+    const char* name = "large messages";
+    for (size_t size : {1000, 11520, 15000, 60000})
+    {
+        mcast::Decoder decoder;
+        CHECK(loopback(decoder, 10, size, 4, lossless) == 10);
+        CHECK(decoder.lost() == 0);
+        mcast::Decoder noFec;
+        CHECK(loopback(noFec, 10, size, 0, lossless) == 10);
+    }
+}
+
+
+/// One lost datagram per FEC group is restored from the parity
+void testFecRecovery()
+{
+    const char* name = "fec recovery";
+    mcast::Decoder decoder;
+    size_t received = loopback(decoder, 20, 15000, 4, [](std::vector<Datagram> datagrams) {
+        std::vector<Datagram> result;
+        size_t data = 0;
+        for (auto& datagram : datagrams)
+        {
+            if (isParity(datagram) || (data++ % 4 != 1))
+                result.push_back(std::move(datagram));
+        }
+        return result;
+    });
+    CHECK(received == 20);
+    CHECK(decoder.recovered() > 0);
+    CHECK(decoder.lost() == 0);
+}
+
+
+/// Two lost datagrams of a group can't be restored: only that message is lost
+void testUnrecoverableLoss()
+{
+    const char* name = "unrecoverable loss";
+    mcast::Decoder decoder;
+    size_t received = loopback(decoder, 10, 11520, 4, [](std::vector<Datagram> datagrams) {
+        std::vector<Datagram> result;
+        size_t data = 0;
+        for (auto& datagram : datagrams)
+        {
+            // message #3 spans the data datagrams [30, 40)
+            size_t seq = isParity(datagram) ? 0 : data++;
+            if ((seq != 32) && (seq != 33))
+                result.push_back(std::move(datagram));
+        }
+        return result;
+    });
+    CHECK(received == 9);
+    CHECK(decoder.lost() == 2);
+}
+
+
+/// Swapped datagrams are reordered. The decoder syncs on the first datagram it receives, so that one stays in place
+void testReordering()
+{
+    const char* name = "reordering";
+    mcast::Decoder decoder;
+    size_t received = loopback(decoder, 10, 15000, 4, [](std::vector<Datagram> datagrams) {
+        for (size_t n = 1; n + 1 < datagrams.size(); n += 5)
+            std::swap(datagrams[n], datagrams[n + 1]);
+        return datagrams;
+    });
+    CHECK(received == 10);
+    CHECK(decoder.lost() == 0);
+}
+
+} // namespace
+
+
+int main(int /*argc*/, char** /*argv*/)
+{
+    testLargeMessages();
+    testFecRecovery();
+    testUnrecoverableLoss();
+    testReordering();
+    if (failures == 0)
+        printf("all tests passed\n");
+    return (failures == 0) ? 0 : 1;
+}